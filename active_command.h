@@ -24,9 +24,67 @@ typedef struct {
 /// Values for the mode (command type) field of an active mode command
 typedef enum {
 	ACM_VIB,	///<Activate a motor 00
-	ACM_SPT,	///<Play back a spatio-temporal pattern 01
+	ACM_SPT,	///<Play back the pattern given in the motor field 01
 	ACM_GCL,	///<Send a command to all motors (TWI general call) 10
 	ACM_LRN		///<Return to learning mode 11
 } acmd_mode_t;
 
+/// Extended commands, carried in the motor field of an ACM_LRN command
+/** A plain ACM_LRN command (motor field 0) still returns to learning mode;
+ *  any other motor value selects one of the extended commands below. The
+ *  vibration byte of the command is then the argument to the extended
+ *  command, and may be followed by more data as described for each one.
+ */
+typedef enum {
+	ACX_LRN,	///<Return to learning mode 000000
+	/** \brief Batched activation 000001
+	 *  The argument byte is a count N, followed by N active_command_t
+	 *  tuples (ACM_VIB only). The reply is one status byte, followed by
+	 *  (N+7)/8 bitmap bytes; bit i%8 of byte i/8 is set if tuple i
+	 *  failed. ACX_WIDE prefixes may be among the tuples, and count as
+	 *  tuples themselves.
+	 */
+	ACX_BATCH,
+	/** \brief Wide motor number prefix 000010
+	 *  The argument byte holds the bits of a motor number above the 6 in
+	 *  the motor field of the next command, which must be an ACM_VIB;
+	 *  motor = argument*64 + motor field. It is answered with its own
+	 *  status byte, so every command stays 2 bytes long in every mode.
+	 */
+	ACX_WIDE,
+	/** \brief Clock sync 000011
+	 *  The reply is one status byte, followed by the low 16 bits of the
+	 *  controller clock in ms, big endian. The host can estimate its offset
+	 *  from the controller clock as the stamp minus the midpoint of the
+	 *  exchange. Not allowed in a frame, which carries statuses only.
+	 */
+	ACX_SYNC,
+	/** \brief Library entry prefix 000100
+	 *  The argument byte holds the bits of the rhythm (high nibble) and
+	 *  magnitude (low nibble) above those in the vibration_t of the next
+	 *  command: rhythm = high nibble*8 + rhythm field, magnitude = low
+	 *  nibble*4 + magnitude field. It applies to every tuple of an
+	 *  ACX_BATCH, and is answered with its own status byte like ACX_WIDE.
+	 */
+	ACX_LIB,
+	/** \brief Group activation 001nnn
+	 *  ACX_GROUP+n activates every motor in group n (see LRN GRP) with
+	 *  the argument byte as the vibration_t. A group of every motor goes
+	 *  out as one general call; otherwise the members are written in
+	 *  turn, and their statuses collected in the background.
+	 */
+	ACX_GROUP = 8,
+	/** \brief Scheduled command prefix 1ttttt
+	 *  The low 5 bits of the motor field and the argument byte hold the
+	 *  low 13 bits of a controller clock time, in ms, at which the next
+	 *  ACM_VIB or ACM_GCL is to be sent instead of right away. Times up to
+	 *  SCHED_LATE ms in the past are sent at once; any other time is taken
+	 *  to be in the next 7 s. The command itself is answered when it is
+	 *  queued, with EQFULL if SCHED_MAX commands are already waiting; its
+	 *  motor status is then collected in the background. ACX_WIDE and
+	 *  ACX_LIB may come before or after it.
+	 */
+	ACX_AT = 32
+} acmd_ext_t;
+
 #endif
@@ -0,0 +1,98 @@
+/*************************************************************************//**
+ * \file   haptic_bench.cpp
+ * \brief  Throughput of the client against the pty stand-in controller.
+ * \date   20261016 - initial version
+ *
+ * Sends the same number of activations at each in-flight depth and prints
+ * commands per second with the median and 99th percentile latency from
+ * queueing a command to its status. Build and run with, for example,
+ *	g++ -O2 -pthread -I.. haptic_bench.cpp haptic_client.cpp \
+ *		haptic_loopback.cpp ../error.c -o haptic_bench
+ *	./haptic_bench [COUNT] [MOTORS] [TWI_US] [BAUD]
+ ****************************************************************************/
+
+#include "haptic_loopback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace haptic;
+
+typedef std::chrono::steady_clock clock_type;
+
+/// Send and completion times of each command, by index
+static std::vector<clock_type::time_point> sent, answered;
+static unsigned long failures;
+
+static void on_done( void *ctx, const reply_t *reply )
+{
+	answered[ (size_t)ctx ] = clock_type::now();
+	if( reply->status != ESUCCESS ) ++failures;
+}
+
+int main( int argc, char **argv )
+{
+	unsigned count = argc > 1? atoi( argv[1] ) : 2000;
+	unsigned motors = argc > 2? atoi( argv[2] ) : 16;
+	unsigned twi_us = argc > 3? atoi( argv[3] ) : 400;
+	unsigned long baud = argc > 4? atol( argv[4] ) : 115200;
+	static const unsigned depths[] = { 1, 2, 4, 8, 16 };
+	std::vector<double> lat( count );
+	unsigned d, i;
+
+	sent.resize( count );
+	answered.resize( count );
+
+	printf( "%u activations, %u motors, %u us TWI, %lu baud\n",
+		count, motors, twi_us, baud );
+	printf( "depth  cmds/s   p50 us   p99 us\n" );
+
+	for( d=0; d<sizeof(depths)/sizeof(*depths); ++d ) {
+		loopback lb( motors, twi_us, baud );
+		int fd = lb.open_host();
+		if( fd < 0 ) {
+			perror( "pty" );
+			return 1;
+		}
+
+		client c( fd, depths[d] );
+		c.begin();
+		if( c.drain(1000) ) {
+			fprintf( stderr, "no answer to BGN\n" );
+			return 1;
+		}
+
+		failures = 0;
+		clock_type::time_point start = clock_type::now();
+		for( i=0; i<count; ) {
+			while( i < count && c.activate(i % motors,
+				vibration(0, 0, 1), on_done, (void*)(size_t)i)
+			)
+				sent[ i++ ] = clock_type::now();
+			if( c.poll(1000) < 0 ) break;
+		}
+		if( c.drain(1000) ) {
+			fprintf( stderr, "lost replies at depth %u\n", depths[d] );
+			return 1;
+		}
+		double secs = std::chrono::duration<double>(
+			clock_type::now() - start ).count();
+
+		for( i=0; i<count; ++i )
+			lat[i] = std::chrono::duration<double, std::micro>(
+				answered[i] - sent[i] ).count();
+		std::sort( lat.begin(), lat.end() );
+
+		printf( "%5u %7.0f %8.0f %8.0f%s\n", depths[d], count / secs,
+			lat[count/2], lat[count*99/100],
+			failures? "  (failures)" : "" );
+		close( fd );
+	}
+
+	return 0;
+}
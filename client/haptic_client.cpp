@@ -0,0 +1,308 @@
+/*************************************************************************//**
+ * \file   haptic_client.cpp
+ * \brief  Host-side C++ client for the haptic controller's serial protocol.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#include "haptic_client.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace haptic {
+
+/// Longest learning mode line the controller takes, less its line end
+#define LINE_MAX_LEN 31
+
+/// Byte with which the controller asks for the next chunk of an image
+#define CFG_XON 0x11
+/// Bytes of an image sent for each CFG_XON; as in haptic_firmware.ino
+#define CFG_CHUNK 16
+
+client::client( int fd, unsigned max_inflight )
+	: fd( fd ), cap( max_inflight ), head( 0 ), count( 0 ),
+	active_mode( false ), out_len( 0 ), text_len( 0 ), rsp_len( 0 ),
+	data_len( 0 ), data_need( 0 ), img_len( 0 ), img_sent( 0 )
+{
+	q = new pending_t[ cap ];
+
+	// room for every in-flight command to be a whole line, plus a chunk
+	out_cap = cap * (LINE_MAX_LEN+1) + CFG_CHUNK;
+	out = new uint8_t[ out_cap ];
+}
+
+client::~client()
+{
+	delete[] q;
+	delete[] out;
+}
+
+/// True if \a bytes more can be queued
+/** Nothing can be while an image is being sent, as it would go out first. */
+bool client::room( size_t bytes ) const
+{
+	return !img_len && count < cap && out_len + bytes <= out_cap;
+}
+
+/// Add a command to the in-flight ring; the caller has checked room()
+bool client::push( uint8_t kind, uint16_t extra, done_fn done, void *ctx )
+{
+	pending_t *p = q + (head + count) % cap;
+
+	p->kind = kind;
+	p->extra = extra;
+	p->done = done;
+	p->ctx = ctx;
+	++count;
+
+	return true;
+}
+
+bool client::line( const char *cmd, done_fn done, void *ctx,
+	const uint8_t *data, size_t len
+) {
+	size_t n = strlen( cmd );
+
+	if( active_mode || n > LINE_MAX_LEN || len > sizeof(img) ||
+		!room(n+1)
+	)
+		return false;
+
+	memcpy( out+out_len, cmd, n );
+	out_len += n;
+	out[ out_len++ ] = '\r';
+	if( len ) {
+		memcpy( img, data, len );
+		img_len = len;
+		img_sent = 0;
+	}
+
+	return push( len? K_IMAGE : K_LINE, 0, done, ctx );
+}
+
+bool client::begin( done_fn done, void *ctx )
+{
+	if( !line("BGN", done, ctx) ) return false;
+
+	active_mode = true;
+	return true;
+}
+
+bool client::learn( done_fn done, void *ctx )
+{
+	if( !active(ACM_LRN, ACX_LRN, 0, 0, done, ctx) ) return false;
+
+	active_mode = false;
+	return true;
+}
+
+bool client::active( unsigned mode, unsigned motor, uint8_t arg,
+	unsigned extra, done_fn done, void *ctx
+) {
+	// the status and extra bytes are gathered in text
+	if( !active_mode || extra > sizeof(text)-1 || !room(2) ) return false;
+
+	encode_active( out+out_len, mode, motor, arg );
+	out_len += 2;
+
+	return push( K_ACTIVE, extra, done, ctx );
+}
+
+bool client::activate( unsigned motor, uint8_t v, done_fn done, void *ctx )
+{
+	if( motor < 64 )
+		return active( ACM_VIB, motor, v, 0, done, ctx );
+
+	// the prefix and the command must go out together
+	if( !active_mode || count+2 > cap || !room(4) ) return false;
+
+	encode_active( out+out_len, ACM_LRN, ACX_WIDE, motor >> 6 );
+	out_len += 2;
+	push( K_PREFIX, 0, NULL, NULL );
+
+	return active( ACM_VIB, motor, v, 0, done, ctx );
+}
+
+bool client::batch( const uint8_t *tuples, uint8_t n, done_fn done,
+	void *ctx
+) {
+	if( !active_mode || (n+7)/8u > sizeof(text)-1 || !room(2 + 2*n) )
+		return false;
+
+	encode_active( out+out_len, ACM_LRN, ACX_BATCH, n );
+	memcpy( out+out_len+2, tuples, 2*n );
+	out_len += 2 + 2*n;
+
+	return push( K_ACTIVE, (n+7)/8, done, ctx );
+}
+
+bool client::sync( done_fn done, void *ctx )
+{
+	return active( ACM_LRN, ACX_SYNC, 0, 2, done, ctx );
+}
+
+int client::flush( void )
+{
+	size_t sent = 0;
+	ssize_t n;
+
+	while( sent < out_len ) {
+		n = write( fd, out+sent, out_len-sent );
+		if( n < 0 ) {
+			if( errno == EINTR ) continue;
+			if( errno != EAGAIN ) return -1;
+
+			// the port is full; keep the rest for the next flush
+			break;
+		}
+		sent += n;
+	}
+
+	memmove( out, out+sent, out_len-sent );
+	out_len -= sent;
+
+	return sent;
+}
+
+/// Finish the command at the head of the ring with the reply gathered
+void client::complete( error_t status )
+{
+	pending_t *p = q + head;
+	reply_t r;
+
+	head = (head + 1) % cap;
+	--count;
+	if( p->kind == K_IMAGE )
+		img_len = img_sent = 0;
+
+	if( p->done ) {
+		r.status = status;
+		r.rsp = rsp;
+		r.rsp_len = rsp_len;
+		r.data = data;
+		r.data_len = data_len;
+		p->done( p->ctx, &r );
+	}
+
+	rsp_len = data_len = 0;
+}
+
+/// Handle a whole line of a learning mode reply, in text
+void client::take_line( void )
+{
+	text[ text_len ] = '\0';
+
+	if( !strncmp(text, "STS ", 4) ) {
+		complete( (error_t)atoi(text+4) );
+		return;
+	}
+	if( strncmp(text, "RSP ", 4) ) return;	// DBG output and the like
+
+	if( rsp_len + text_len+1 <= sizeof(rsp) ) {
+		memcpy( rsp+rsp_len, text, text_len );
+		rsp_len += text_len;
+		rsp[ rsp_len++ ] = '\n';
+	}
+
+	// QRY CFG: "RSP CFG <LEN> <CRC>", then LEN raw bytes
+	if( !strncmp(text, "RSP CFG ", 8) )
+		data_need = atoi( text+8 );
+}
+
+/// Handle one byte received from the controller
+void client::take( uint8_t ch )
+{
+	pending_t *p = q + head;
+
+	if( !count ) return;	// not asked for; nothing to match it to
+
+	if( data_need ) {
+		if( data_len < sizeof(data) ) data[ data_len++ ] = ch;
+		--data_need;
+		return;
+	}
+
+	if( p->kind == K_ACTIVE || p->kind == K_PREFIX ) {
+		// status byte first, then the extra bytes, kept in text;
+		// active() and batch() see that they fit
+		if( text_len < sizeof(text) ) text[ text_len++ ] = ch;
+		if( text_len < 1u + p->extra ) return;
+
+		memcpy( data, text+1, p->extra );
+		data_len = p->extra;
+		text_len = 0;
+		if( p->kind == K_PREFIX ) {
+			head = (head + 1) % cap;
+			--count;
+		}else	complete( (error_t)(uint8_t)text[0] );
+		return;
+	}
+
+	if( ch == CFG_XON && p->kind == K_IMAGE ) {
+		size_t n = img_len - img_sent;
+
+		if( n > CFG_CHUNK ) n = CFG_CHUNK;
+		memcpy( out+out_len, img+img_sent, n );
+		out_len += n;
+		img_sent += n;
+		return;
+	}
+	if( ch == '\r' ) return;
+	if( ch == '\n' ) {
+		take_line();
+		text_len = 0;
+	}else if( text_len < sizeof(text)-1 )
+		text[ text_len++ ] = ch;
+}
+
+/// Flush, then read and handle whatever arrives within \a timeout_ms
+/** \return The number of bytes read, or -1 on error. */
+int client::wait( int timeout_ms )
+{
+	uint8_t buf[ 256 ];
+	struct pollfd pfd;
+	ssize_t n, i;
+
+	if( flush() < 0 ) return -1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN | (out_len? POLLOUT : 0);
+	n = ::poll( &pfd, 1, timeout_ms );
+	if( n < 0 ) return errno==EINTR? 0 : -1;
+	if( !(pfd.revents & POLLIN) ) return 0;
+
+	n = read( fd, buf, sizeof(buf) );
+	if( n < 0 ) return errno==EAGAIN || errno==EINTR? 0 : -1;
+	if( n == 0 ) return -1;
+
+	for( i=0; i<n; ++i )
+		take( buf[i] );
+
+	return n;
+}
+
+int client::poll( int timeout_ms )
+{
+	unsigned before = count;
+
+	if( wait(timeout_ms) < 0 ) return -1;
+	return before - count;
+}
+
+int client::drain( int timeout_ms )
+{
+	while( count ) {
+		int n = wait( timeout_ms );
+
+		if( n < 0 ) return -1;
+		// waiting only for a full port to take more is not a timeout
+		if( n == 0 && !out_len ) return -1;
+	}
+
+	return 0;
+}
+
+} // namespace haptic
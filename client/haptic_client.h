@@ -0,0 +1,183 @@
+/*************************************************************************//**
+ * \file   haptic_client.h
+ * \brief  Host-side C++ client for the haptic controller's serial protocol.
+ * \date   20261016 - initial version
+ *
+ * The client speaks the wire format of haptic_firmware.ino: LRN/QRY/BGN
+ * lines in learning mode, answered by any number of "RSP" lines and one
+ * "STS" line, and 2-byte active_command_t commands in active mode, each
+ * answered by one status byte and any extra reply bytes.
+ *
+ * The controller handles commands strictly in order, so replies are matched
+ * to commands by position alone. Commands are queued, written together by
+ * flush() in as few write() calls as possible, and completed from poll()
+ * through a callback. Nothing is allocated after the client is made.
+ *
+ * Build with, for example,
+ *	g++ -O2 -I.. -c haptic_client.cpp ../error.c
+ ****************************************************************************/
+
+#ifndef HAPTIC_CLIENT_H
+#define HAPTIC_CLIENT_H
+
+// glibc has its own error_t when _GNU_SOURCE is defined, as g++ always
+// does; this keeps it out of the way of the firmware's, as long as this
+// header comes before any system header
+#ifndef __error_t_defined
+#	define __error_t_defined 1
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "error.h"
+#include "active_command.h"
+
+namespace haptic {
+
+/// Encode a vibration_t byte: RRRMMddd, each field from 0
+inline uint8_t vibration( unsigned rhythm, unsigned magnitude,
+	unsigned duration
+) {
+	return (rhythm & 7) << 5 | (magnitude & 3) << 3 | (duration & 7);
+}
+
+/// Encode an active_command_t into \a out, most significant byte first
+/** The word is ttmmmmmmAAAAAAAA, where t is an acmd_mode_t, m the motor
+ *  field and A the vibration_t or extended command argument. This is done
+ *  with shifts rather than through the bitfields of active_command_t, whose
+ *  layout is up to the compiler.
+ */
+inline void encode_active( uint8_t *out, unsigned mode, unsigned motor,
+	uint8_t arg
+) {
+	uint16_t word = (mode & 3) << 14 | (motor & 0x3f) << 8 | arg;
+
+	out[0] = word >> 8;
+	out[1] = word & 0xff;
+}
+
+/// Reply to one command, passed to its done_fn
+struct reply_t {
+	error_t status;		///<Status the controller returned
+	const char *rsp;	///<RSP lines, each ended by '\\n'; learning mode
+	size_t rsp_len;		///<Number of characters at \a rsp
+	const uint8_t *data;	///<Extra reply bytes, e.g. ACX_SYNC or QRY CFG
+	size_t data_len;	///<Number of bytes at \a data
+};
+
+/** \brief Called once a command completes. The buffers in \a reply are
+ *  only valid until the callback returns.
+ */
+typedef void (*done_fn)( void *ctx, const reply_t *reply );
+
+/// Client for one controller on an open, raw serial file descriptor
+class client {
+public:
+	/** \param fd
+	 *	Serial port (or pty) to the controller, already set up raw and
+	 *	in learning mode. It is not closed by the client.
+	 *  \param max_inflight
+	 *	Most commands to have sent but not answered, counting prefixes.
+	 *	The controller has a 64-byte receive buffer, so 16 suits active
+	 *	mode; keep learning mode lines within 64 bytes in all.
+	 */
+	client( int fd, unsigned max_inflight = 16 );
+	~client();
+
+	/// Queue a learning mode line, without its line end
+	/** \a data, if given, is an image sent raw after the line, as LRN CFG
+	 *  needs: a chunk each time the controller asks for one. Nothing more
+	 *  can be queued until the command completes. A "RSP CFG" reply has
+	 *  its image passed in reply_t::data.
+	 *  \return false if the queue is full or the line too long.
+	 */
+	bool line( const char *cmd, done_fn done = NULL, void *ctx = NULL,
+		const uint8_t *data = NULL, size_t len = 0 );
+
+	/// Queue BGN, after which commands are in active mode
+	bool begin( done_fn done = NULL, void *ctx = NULL );
+
+	/// Queue ACX_LRN, after which commands are in learning mode again
+	bool learn( done_fn done = NULL, void *ctx = NULL );
+
+	/// Queue an active mode command; \a extra is its extra reply bytes
+	/** Fails if \a extra is more than a reply line holds, 127 bytes. */
+	bool active( unsigned mode, unsigned motor, uint8_t arg,
+		unsigned extra = 0, done_fn done = NULL, void *ctx = NULL );
+
+	/// Queue an activation of \a motor, with an ACX_WIDE prefix past 63
+	/** The prefix is answered with its own status byte, which is dropped;
+	 *  setting the prefix cannot fail.
+	 */
+	bool activate( unsigned motor, uint8_t v, done_fn done = NULL,
+		void *ctx = NULL );
+
+	/// Queue ACX_BATCH of \a n encoded ACM_VIB commands at \a tuples
+	/** The failure bitmap comes back in reply_t::data. */
+	bool batch( const uint8_t *tuples, uint8_t n, done_fn done = NULL,
+		void *ctx = NULL );
+
+	/// Queue ACX_SYNC; the 16-bit controller clock comes back in data
+	bool sync( done_fn done = NULL, void *ctx = NULL );
+
+	/// Write everything queued; returns -1 on error, else bytes written
+	int flush( void );
+
+	/// Flush, then wait up to \a timeout_ms for replies and complete them
+	/** \return The number of commands completed, or -1 on error. */
+	int poll( int timeout_ms );
+
+	/// Poll until nothing is in flight, or \a timeout_ms passes without one
+	/** \return 0 once idle, -1 on error or timeout. */
+	int drain( int timeout_ms );
+
+	/// Number of commands sent or queued and not yet answered
+	unsigned inflight( void ) const { return count; }
+
+	/// True while new commands are queued in active mode
+	bool is_active( void ) const { return active_mode; }
+
+private:
+	/// How the reply to an in-flight command is framed
+	enum kind_t { K_LINE, K_IMAGE, K_ACTIVE, K_PREFIX };
+
+	/// Command sent or queued, waiting for its reply
+	struct pending_t {
+		uint8_t kind;		///<kind_t
+		uint16_t extra;		///<Extra reply bytes, K_ACTIVE only
+		done_fn done;
+		void *ctx;
+	};
+
+	bool push( uint8_t kind, uint16_t extra, done_fn done, void *ctx );
+	bool room( size_t bytes ) const;
+	int wait( int timeout_ms );
+	void take( uint8_t ch );
+	void take_line( void );
+	void complete( error_t status );
+
+	int fd;
+	pending_t *q;		///<Ring of in-flight commands
+	unsigned cap, head, count;
+	bool active_mode;
+
+	uint8_t *out;		///<Queued bytes not yet written
+	size_t out_len, out_cap;
+
+	char text[ 128 ];	///<Current reply line
+	size_t text_len;
+	char rsp[ 1024 ];	///<RSP lines of the current reply
+	size_t rsp_len;
+	uint8_t data[ 512 ];	///<Extra reply bytes of the current reply
+	size_t data_len, data_need;
+	uint8_t img[ 512 ];	///<Image of a K_IMAGE command, sent by chunks
+	size_t img_len, img_sent;
+
+	client( const client& );
+	client& operator=( const client& );
+};
+
+} // namespace haptic
+
+#endif
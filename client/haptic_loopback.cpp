@@ -0,0 +1,227 @@
+/*************************************************************************//**
+ * \file   haptic_loopback.cpp
+ * \brief  Stand-in controller on a pseudo-terminal, for tests without a belt.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#include "haptic_loopback.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace haptic {
+
+loopback::loopback( unsigned motors, unsigned twi_us, unsigned long baud,
+	unsigned rtt_us
+)
+	: master( -1 ), motors( motors ), twi_us( twi_us ), rtt_us( rtt_us ),
+	baud( baud ), stop( false ), done( 0 )
+{
+	name[0] = '\0';
+
+	master = posix_openpt( O_RDWR | O_NOCTTY );
+	if( master < 0 ) return;
+	if( grantpt(master) || unlockpt(master) ||
+		!ptsname(master) || strlen(ptsname(master)) >= sizeof(name)
+	) {
+		close( master );
+		master = -1;
+		return;
+	}
+	strcpy( name, ptsname(master) );
+
+	worker = std::thread( &loopback::run, this );
+	writer = std::thread( &loopback::deliver, this );
+}
+
+loopback::~loopback()
+{
+	{
+		std::lock_guard<std::mutex> hold( lock );
+		stop = true;
+	}
+	ready.notify_all();
+	if( worker.joinable() ) worker.join();
+	if( writer.joinable() ) writer.join();
+	if( master >= 0 ) close( master );
+}
+
+int loopback::open_host( void )
+{
+	struct termios tio;
+	int fd;
+
+	if( master < 0 ) return -1;
+
+	fd = open( name, O_RDWR | O_NOCTTY | O_NONBLOCK );
+	if( fd < 0 ) return -1;
+
+	tcgetattr( fd, &tio );
+	cfmakeraw( &tio );
+	tcsetattr( fd, TCSANOW, &tio );
+
+	return fd;
+}
+
+/// Hand a reply to the link once the controller would have sent it
+/** The controller works one command at a time, so each reply is sent
+ *  \a work_us after the one before, or after now if it has been idle,
+ *  plus the time to send it over the serial link.
+ */
+void loopback::reply( const uint8_t *buf, size_t len, unsigned long work_us )
+{
+	clock_type::time_point now = clock_type::now();
+	sent_t s;
+
+	if( baud )
+		work_us += len * 10000000UL / baud;
+	busy = std::max( busy, now ) + std::chrono::microseconds( work_us );
+	std::this_thread::sleep_until( busy );
+
+	s.due = busy + std::chrono::microseconds( rtt_us );
+	s.len = len;
+	memcpy( s.buf, buf, len );
+	{
+		std::lock_guard<std::mutex> hold( lock );
+		wire.push_back( s );
+	}
+	ready.notify_one();
+}
+
+/// Write each reply to the host once its round trip is over
+void loopback::deliver( void )
+{
+	std::unique_lock<std::mutex> hold( lock );
+	const uint8_t *buf;
+	size_t len;
+	ssize_t n;
+
+	while( !stop ) {
+		if( wire.empty() ) {
+			ready.wait( hold );
+			continue;
+		}
+
+		sent_t s = wire.front();
+		wire.pop_front();
+		hold.unlock();
+
+		std::this_thread::sleep_until( s.due );
+		for( buf=s.buf, len=s.len; len; buf+=n, len-=n ) {
+			n = write( master, buf, len );
+			if( n <= 0 ) break;
+		}
+
+		hold.lock();
+	}
+}
+
+void loopback::run( void )
+{
+	clock_type::time_point start = clock_type::now();
+	char line[ 64 ];
+	uint8_t cmd[2], out[ 40 ], buf[ 256 ], wide = 0;
+	size_t line_len = 0, cmd_len = 0, batch = 0, batch_n = 0, n, k;
+	unsigned long rx_us = baud? 2 * 10000000UL / baud : 0, batch_us = 0;
+	bool active = false;
+	struct pollfd pfd;
+	ssize_t got;
+
+	pfd.fd = master;
+	pfd.events = POLLIN;
+
+	while( !stop ) {
+		if( ::poll(&pfd, 1, 50) <= 0 ) continue;
+		got = read( master, buf, sizeof(buf) );
+		if( got <= 0 ) continue;
+
+		for( k=0; k<(size_t)got; ++k ) {
+			uint8_t ch = buf[k];
+
+			if( !active ) {
+				if( ch != '\r' && ch != '\n' ) {
+					if( line_len < sizeof(line)-1 )
+						line[ line_len++ ] = ch;
+					continue;
+				}
+				line[ line_len ] = '\0';
+				if( !line_len ) continue;
+
+				n = 0;
+				if( !strcmp(line, "QRY VER") )
+					n = sprintf( (char*)out, "RSP VER 1\r\n" );
+				n += sprintf( (char*)out+n, "STS 0\r\n" );
+				active = !strcmp( line, "BGN" );
+				reply( out, n, baud? line_len*10000000UL/baud : 0 );
+				line_len = 0;
+				continue;
+			}
+
+			cmd[ cmd_len++ ] = ch;
+			if( cmd_len < 2 ) continue;
+			cmd_len = 0;
+
+			unsigned mode = cmd[0] >> 6, motor = cmd[0] & 0x3f;
+			unsigned long work = rx_us;
+
+			// tuples of a batch are only answered as a whole, with
+			// a bitmap of the ones that failed
+			if( batch < batch_n ) {
+				if( wide*64u + motor >= motors ) {
+					out[ 1 + batch/8 ] |= 1 << (batch%8);
+					out[0] = ENOMOTOR;
+				}else	batch_us += twi_us;
+				wide = 0;
+				if( ++batch < batch_n ) continue;
+				reply( out, 1 + (batch_n+7)/8, batch_us );
+				++done;
+				continue;
+			}
+
+			out[0] = ESUCCESS;
+			n = 1;
+			switch( mode ) {
+			case ACM_VIB:
+				if( wide*64u + motor >= motors )
+					out[0] = ENOMOTOR;
+				else	work += twi_us;
+				wide = 0;
+				break;
+			case ACM_GCL:
+				work += twi_us;
+				break;
+			case ACM_LRN:
+				if( motor == ACX_LRN )
+					active = false;
+				else if( motor == ACX_WIDE )
+					wide = cmd[1];
+				else if( motor == ACX_BATCH && cmd[1] ) {
+					batch = 0;
+					batch_n = cmd[1];
+					batch_us = rx_us * (1 + batch_n);
+					memset( out+1, 0, (batch_n+7)/8 );
+					continue;
+				}else if( motor == ACX_SYNC ) {
+					unsigned long ms = std::chrono::duration_cast
+						<std::chrono::milliseconds>(
+						clock_type::now() - start ).count();
+					out[1] = ms >> 8;
+					out[2] = ms & 0xff;
+					n = 3;
+				}
+				break;
+			}
+			reply( out, n, work );
+			++done;
+		}
+	}
+}
+
+} // namespace haptic
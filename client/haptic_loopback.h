@@ -0,0 +1,94 @@
+/*************************************************************************//**
+ * \file   haptic_loopback.h
+ * \brief  Stand-in controller on a pseudo-terminal, for tests without a belt.
+ * \date   20261016 - initial version
+ *
+ * Answers the serial protocol the way haptic_firmware.ino does, from a
+ * thread of its own, on the master side of a pty: learning mode lines get
+ * "STS 0" (and "RSP VER" for QRY VER), and active mode commands get their
+ * status byte and extra reply bytes. Activations of motors past the
+ * configured count fail with ENOMOTOR.
+ *
+ * Each reply is held back by a simple timing model of the real controller:
+ * the serial link at a given rate, plus a fixed TWI time per motor written,
+ * so that throughput measured against it is in the right proportions. The
+ * controller handles one command at a time, but a reply then takes a fixed
+ * round trip to reach the host (USB serial adapters buffer for about 1 ms),
+ * during which the controller goes on to the next command.
+ ****************************************************************************/
+
+#ifndef HAPTIC_LOOPBACK_H
+#define HAPTIC_LOOPBACK_H
+
+#include "haptic_client.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace haptic {
+
+/// Simulated controller on a pty
+class loopback {
+public:
+	/** \param motors
+	 *	Number of motors present.
+	 *  \param twi_us
+	 *	Time to write one motor and read its status, in us; about 400 at
+	 *	100 kHz.
+	 *  \param baud
+	 *	Serial rate to model, or 0 for no serial delay.
+	 *  \param rtt_us
+	 *	Round trip of the link between host and controller, in us.
+	 */
+	loopback( unsigned motors = 16, unsigned twi_us = 400,
+		unsigned long baud = 115200, unsigned rtt_us = 1000 );
+	~loopback();
+
+	/// Open the host side of the pty, raw and non-blocking; -1 on error
+	int open_host( void );
+
+	/// Path of the host side of the pty, for other programs to open
+	const char *path( void ) const { return name; }
+
+	/// Number of active mode commands handled so far
+	unsigned long handled( void ) const { return done; }
+
+private:
+	typedef std::chrono::steady_clock clock_type;
+
+	/// Reply handled by the controller, on its way to the host
+	struct sent_t {
+		clock_type::time_point due;	///<When it reaches the host
+		uint8_t len;
+		uint8_t buf[ 40 ];
+	};
+
+	void run( void );
+	void deliver( void );
+	void reply( const uint8_t *buf, size_t len, unsigned long work_us );
+
+	int master;
+	char name[ 64 ];
+	unsigned motors, twi_us, rtt_us;
+	unsigned long baud;
+	std::atomic<bool> stop;
+	std::atomic<unsigned long> done;
+	clock_type::time_point busy;	///<When the last reply is due
+	std::thread worker;
+
+	std::deque<sent_t> wire;	///<Replies not yet at the host
+	std::mutex lock;		///<Guards \a wire
+	std::condition_variable ready;	///<Signalled when \a wire grows
+	std::thread writer;
+
+	loopback( const loopback& );
+	loopback& operator=( const loopback& );
+};
+
+} // namespace haptic
+
+#endif
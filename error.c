@@ -44,6 +44,10 @@ static STR ebusof[] = "Bus transmit overflow";
 static STR ebusan[] = "Bus address not acknowledged";
 static STR ebusdn[] = "Bus data not acknowledged";
 static STR emissing[] = "Command not implemented";
+static STR enog[] = "Requested group not defined";
+static STR eqfull[] = "Schedule or cue queue full";
+static STR ecfg[] = "Configuration image damaged or incomplete";
+static STR eovrld[] = "Overloaded; replaced a command not yet sent";
 static STR emax[] = "Unknown error";
 
 /// Table of status strings for fast lookups
@@ -75,6 +79,10 @@ static STR *const error_names[] = {
 	ebusan,
 	ebusdn,
 	emissing,
+	enog,
+	eqfull,
+	ecfg,
+	eovrld,
 	emax
 };
 #undef STR
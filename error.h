@@ -44,6 +44,10 @@ typedef enum {
 	EBUSAN,		///< TWI address not acknowledged	(L/O, M->V)
 	EBUSDN,		///< TWI data not acknowledged		(L/O, M->V)
 	EMISSING,	///< Command not implemented yet	(L, P->M/M->V)
+	ENOG,		///< Requested group not defined	(O, P->M)
+	EQFULL,		///< Schedule or cue queue full		(O, P->M)
+	ECFG,		///< Configuration image damaged	(L, P->M)
+	EOVRLD,		///< Replaced a cue not yet sent	(O, P->M)
 	EMAX		///< Invalid/unknown error number
 } error_t;
 
@@ -0,0 +1,60 @@
+/*************************************************************************//**
+ * \file   frame.h
+ * \brief  Framed mode definitions.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+/** \brief Start-of-frame marker.
+ *
+ *  Frames in both directions have the form
+ *	SOF TYPE SEQ LEN DATA[LEN] CRC
+ *  where CRC is the CRC-16/XMODEM of TYPE through the end of DATA, sent
+ *  big endian. Host frames (FRT_CMD) carry LEN/2 active commands, each in
+ *  the 2-byte active_command_t format; their replies (FRT_ACK) carry one
+ *  status byte per command. The controller acks every frame in order and
+ *  never reorders commands, so the host may keep up to FRM_WINDOW frames
+ *  in flight. Frames are handled as they arrive, TWI time and any teaching
+ *  included, so the window is no more than fits in the serial RX buffer.
+ *
+ *  A damaged frame, or one that arrives out of sequence, is answered with
+ *  a FRT_NAK frame whose SEQ is the next sequence number expected; the host
+ *  resends everything from there (go-back-N). A frame that was already
+ *  handled, because its ack was lost, is acked again with LEN 0 and is not
+ *  handled twice.
+ */
+#define FRM_SOF 0x7e
+
+/// Maximum length of the data in a frame: 8 active commands
+#define FRM_MAX_LEN 16
+
+/** \brief Maximum number of frames the host may send before the first is
+ *  acked. Two full frames of 22 bytes fit in the 64-byte RX buffer of the
+ *  AVR core while a third would overrun it.
+ */
+#define FRM_WINDOW 2
+
+/// Time after which a partly received frame is abandoned, in ms
+#define FRM_TIMEOUT 50
+
+/// Values for the TYPE byte of a frame
+typedef enum {
+	FRT_CMD = 'C',	///<Active commands, host to controller
+	FRT_ACK = 'A',	///<Statuses of a handled frame, controller to host
+	FRT_NAK = 'N'	///<Damaged or missing frame, controller to host
+} frame_type_t;
+
+/// States of the framed mode receiver
+typedef enum {
+	FRS_SOF,	///<Hunting for the start-of-frame marker
+	FRS_TYPE,	///<Expecting the TYPE byte
+	FRS_SEQ,	///<Expecting the SEQ byte
+	FRS_LEN,	///<Expecting the LEN byte
+	FRS_DATA,	///<Receiving data bytes
+	FRS_CRCH,	///<Expecting the high byte of the CRC
+	FRS_CRCL	///<Expecting the low byte of the CRC
+} frame_state_t;
+
+#endif
@@ -9,8 +9,12 @@
 #define GLOBALS_H
 
 #include"active_command.h"
+#include"spatio.h"
 #include"parse.h"
 #include"menu.h"
+#include"frame.h"
+#include"stats.h"
+#include"trace.h"
 
 /// Current version of the funnel firmware--must be an ASCII decimal number
 #define FUNNEL_VER "1"
@@ -19,14 +23,137 @@
 #define TINY_VER 0
 
 /** \brief Maximum number of motors the firmware can support.
- *  Careful--increasing this requires a change in the active command format!
+ *  Motors past the 64th can only be activated through the ACX_WIDE prefix.
+ *  Each motor costs about 8 bytes of SRAM, which is what really limits this
+ *  on an ATmega328.
  */
-#define MAX_MOTORS 64
+#ifndef MAX_MOTORS
+#	define MAX_MOTORS 64
+#endif
+
+/** \brief Number of TWI segments the motors are spread over. More than one
+ *  needs a TWI multiplexer (e.g. TCA9548A) at TWI_MUX_ADDR, with segment
+ *  \a n on its channel \a n.
+ */
+#ifndef TWI_SEGMENTS
+#	define TWI_SEGMENTS 1
+#endif
+
+/// TWI address of the multiplexer, if TWI_SEGMENTS is more than 1
+#define TWI_MUX_ADDR 0x70
+
+/// Type that can hold any motor number, plus MOTOR_ALL
+#if MAX_MOTORS < 255
+	typedef uint8_t motor_t;
+#else
+	typedef uint16_t motor_t;
+#endif
+
+/// Motor number meaning every motor; see send_command()
+#define MOTOR_ALL ((motor_t)~0)
+
+/// Segment of motor \a _i_
+#if TWI_SEGMENTS > 1
+#	define MTR_SEG( _i_ ) ( glbl.mtrs[_i_].seg )
+#else
+#	define MTR_SEG( _i_ ) 0
+#endif
+
+/// Number of bytes in a bitmap with one bit per motor
+#define MOTOR_BITMAP ((MAX_MOTORS+7)/8)
+
+/// Number of bytes in a bitmap with one bit per 7-bit TWI address
+#define TWI_BITMAP (128/8)
+
+/** \brief Number of rhythms in the library. Only MAX_RHYTHM fit in the
+ *  motors at once, so their slots cache the library; see lib_slot().
+ */
+#define LIB_RHYTHMS 24
+/// Number of magnitudes in the library, cached in MAX_MAGNITUDE motor slots
+#define LIB_MAGNITUDES 8
+
+/// Number of motor slots for rhythms and magnitudes, rhythm slots first
+#define LIB_SLOTS ( MAX_RHYTHM + MAX_MAGNITUDE )
+
+/// Oldest age a used motor slot reaches; an empty one counts as older
+#define SLOT_AGE_MAX 0xfe
+
+/// Maximum number of motor groups that can be learned
+#define MAX_GROUPS 8
+
+/// Motor group definition, as stored in EEPROM
+typedef struct {
+	uint8_t used;			///<1 if the group is defined
+	uint8_t bits[ MOTOR_BITMAP ];	///<Member motors, by motor number
+} group_t;
+
+/// Maximum number of scheduled active commands waiting to be sent; ACX_AT
+#define SCHED_MAX 16
+
+/// How late an ACX_AT time may be and still be sent at once, in ms
+#define SCHED_LATE 1024
+
+/// Active command waiting to be sent at a given time
+typedef struct {
+	uint16_t at;		///<Low 16 bits of millis() when it is due
+	motor_t motor;		///<Motor to send it to, or MOTOR_ALL
+	vibration_t v;		///<Vibration to send
+	uint8_t xlib;		///<High library bits of \a v; see ACX_LIB
+} sched_t;
+
+/** \brief Maximum number of motors with a cue waiting to be sent; see
+ *  cue_add(). Bounds how long a cue can wait under overload.
+ */
+#ifndef CUE_MAX
+#	define CUE_MAX 16
+#endif
+
+/** \brief Commands waiting on the serial link beyond which vibrations are
+ *  held as cues; see cue_add(). A host that keeps no more than this many
+ *  in flight is never coalesced; half of the AVR's 64-byte RX buffer.
+ */
+#ifndef CUE_BACKLOG
+#	define CUE_BACKLOG 16
+#endif
+
+/// Vibration of a single motor waiting for the bus; see cue_add()
+typedef struct {
+	motor_t motor;		///<Motor to send it to
+	vibration_t v;		///<Latest vibration for \a motor
+	uint8_t xlib;		///<High library bits of \a v; see ACX_LIB
+} cue_t;
+
+/// Index of the address \a _a_ on segment \a _s_ in a TWI_BITMAP per segment
+#define TWI_INDEX( _s_, _a_ ) ( (uint16_t)(_s_) << 7 | (_a_) )
+
+/// Test bit \a _i_ of the byte array \a _bm_
+#define BIT_GET( _bm_, _i_ ) ( (_bm_)[(_i_)/8] & (1 << ((_i_)%8)) )
+/// Set bit \a _i_ of the byte array \a _bm_
+#define BIT_SET( _bm_, _i_ ) ( (_bm_)[(_i_)/8] |= (1 << ((_i_)%8)) )
+/// Clear bit \a _i_ of the byte array \a _bm_
+#define BIT_CLR( _bm_, _i_ ) ( (_bm_)[(_i_)/8] &= ~(1 << ((_i_)%8)) )
+
+/// Bit in globals_t::lib_dirty for magnitude \a _i_
+#define LIB_MAG_BIT( _i_ ) ( (uint16_t)1 << (_i_) )
+/// Bit in globals_t::lib_dirty for rhythm \a _i_
+#define LIB_RHY_BIT( _i_ ) ( (uint16_t)1 << (MAX_MAGNITUDE + (_i_)) )
+
+/// TWI clock rate of a segment, and how well the segment copes with it
+typedef struct {
+	uint8_t rate;		///<Rate in use; see TWI_KHZ()
+	uint8_t cal;		///<Rate chosen by the last calibration
+	uint8_t drops;		///<Times \a rate was lowered since; saturates
+	uint8_t win;		///<Transactions in the current error window
+	uint8_t win_err;	///<Failures in the current error window
+	uint16_t errs;		///<Failures since the last calibration; saturates
+	uint32_t txn;		///<Transactions since the last calibration
+} bus_stat_t;
 
 /// Possible belt operation modes
 typedef enum {
 	M_LEARN,	///<Learning mode: ASCII commands. See parse_step_t
-	M_ACTIVE	///<Active mode: raw byte stream. See active_command_t
+	M_ACTIVE,	///<Active mode: raw byte stream. See active_command_t
+	M_FRAMED	///<Framed mode: active commands in frames. See frame.h
 } mode_t;
 
 /// Globals used on the Funnel I/O board
@@ -36,19 +163,170 @@ typedef struct {
 	 */
 	char cmd[ PARSE_MAX_LEN ];
 
+	/** \brief Number of extra reply bytes left in \a cmd by an active
+	 *  command, to be sent after its status byte
+	 */
+	uint8_t rsp_len;
+
+	/// Number of bytes (or hex digits) of the current command received
+	uint8_t rx_len;
+
+	/// Number of blank lines received in a row, see loop()
+	uint8_t blanks;
+
 	/// Used to receive active commands over serial and relay over TWI
 	active_command_t acmd;
 
-	/// Mapping of motor numbers to TWI addresses, with flag for TWI error
-	struct { uint8_t addr:7, err:1; } mtrs[ MAX_MOTORS+1 ];
+	/** \brief Copy of the learned magnitudes and rhythms, laid out exactly
+	 *  as they are stored in EEPROM.
+	 *
+	 *  Loaded once at startup so that queries and motor refreshes never
+	 *  read EEPROM. Costs MAX_MAGNITUDE*4 + MAX_RHYTHM*9 = 88 bytes.
+	 */
+	struct {
+		magnitude_t mag[ MAX_MAGNITUDE ];
+		rhythm_t rhy[ MAX_RHYTHM ];
+	} lib;
+
+	/// Entries of \a lib changed since the last write back to EEPROM
+	uint16_t lib_dirty;
+
+	/// Generation tag of what the motor slots hold; see lib_gen()
+	uint16_t gen;
+
+	/// Motor slots caching the rhythm and magnitude library; see lib_slot()
+	struct {
+		uint8_t lib[ LIB_SLOTS ];	///<Library entry held; 0xff if none
+		uint8_t age[ LIB_SLOTS ];	///<Lookups since its last use; saturates
+		uint16_t hit;		///<Lookups already taught; saturates
+		uint16_t miss;		///<Lookups that taught a motor; saturates
+	} slot;
+
+	/// Slots of \a slot taught to each motor, one bit each
+	uint16_t taught[ MAX_MOTORS ];
+
+	/// Motors still to be taught the rest of their slots; refresh_service()
+	uint8_t stale[ MOTOR_BITMAP ];
+
+	/** \brief Motor that last lost what it was taught, or MOTOR_ALL if
+	 *  none did within BROWNOUT_WINDOW ms; see refresh_mark()
+	 */
+	motor_t lost;
+
+	/// Low 16 bits of millis() when \a lost lost what it was taught
+	uint16_t lost_at;
+
+	/** \brief Mapping of motor numbers to TWI segments and addresses,
+	 *  with a flag that is set while the motor is quarantined; see
+	 *  motor_health(). Kept in segment, then address, order.
+	 */
+	struct {
+		uint8_t addr:7, err:1;
+#if TWI_SEGMENTS > 1
+		uint8_t seg;
+#endif
+	} mtrs[ MAX_MOTORS+1 ];
+
+	/// Health of each motor in \a mtrs, reset by detect_motors()
+	struct {
+		uint8_t fails;		///<TWI failures; saturates
+		uint8_t last:5,		///<error_t of the most recent failure
+			streak:3;	///<Failures in a row; saturates
+		uint8_t since;		///<HLT_TICK() at the last failure
+	} hlt[ MAX_MOTORS ];
+
+	/// Motors written by send_queue() whose status has not been read yet
+	uint8_t pend[ MOTOR_BITMAP ];
+
+	/// Motors added by the last detect_motors()
+	uint8_t fresh[ MOTOR_BITMAP ];
+
+	/// Number of motors that disappeared at the last detect_motors()
+	uint8_t removed;
+
+	/// TWI addresses that answered the background sweep, by TWI_INDEX()
+	uint8_t seen[ TWI_BITMAP * TWI_SEGMENTS ];
+
+	/// TWI_INDEX() for the background sweep to probe next; 0 between sweeps
+	uint16_t sweep;
+
+#if TWI_SEGMENTS > 1
+	/// Segment the multiplexer is switched to; see twi_segment()
+	uint8_t seg;
+#endif
+
+	/// TWI clock rate and error counts of each segment; see bus_count()
+	bus_stat_t bus[ TWI_SEGMENTS ];
+
+	/// Rate the TWI clock is set to; see bus_clock()
+	uint8_t clk;
+
+	/// High bits of the motor number of the next active command; ACX_WIDE
+	uint8_t wide;
+
+	/// High bits of the library entries of the next active command; ACX_LIB
+	uint8_t xlib;
+
+	/// Scheduled active commands; see sched_add()
+	struct {
+		sched_t q[ SCHED_MAX ];	///<Binary min-heap on \a at
+		uint8_t len;		///<Number of commands in \a q
+		uint8_t armed;		///<1 if the next command has an ACX_AT
+		uint16_t at;		///<Time given by the pending ACX_AT
+	} sch;
+
+	/// Cues waiting for the bus, oldest first; see cue_add()
+	struct {
+		cue_t q[ CUE_MAX ];	///<Ring of cues, at most one per motor
+		uint8_t head;		///<Index of the oldest cue in \a q
+		uint8_t len;		///<Number of cues in \a q
+		uint16_t coalesced;	///<Cues replaced before sending; saturates
+		uint16_t dropped;	///<Cues refused for want of room; saturates
+		uint16_t failed;	///<Cues that could not be sent; saturates
+	} cue;
+
+	/// Value of millis() when the last background sweep finished
+	unsigned long swept;
+
+	/// Playback state of each spatio-temporal pattern
+	spatio_play_t play[ MAX_SPATIO ];
 
 	/// Current belt mode
 	mode_t mode;
 
+	/// Framed mode receiver; see poll_frame()
+	struct {
+		uint8_t buf[ FRM_MAX_LEN ];	///<Data of the current frame
+		uint8_t state;	///<Receiver state, see frame_state_t
+		uint8_t seq;	///<Sequence number of the current frame
+		uint8_t len;	///<Data length of the current frame
+		uint8_t pos;	///<Number of data bytes received so far
+		uint8_t next;	///<Sequence number of the next frame expected
+		uint8_t naked;	///<Non-zero once \a next has been NAKed
+		uint16_t crc;	///<CRC of the current frame so far
+		uint16_t rx;	///<CRC received with the current frame
+		uint16_t last;	///<Low 16 bits of millis() at the last byte
+	} frm;
+
+	/// Serial rate to switch to once the current reply is sent; 0 if none
+	unsigned long baud;
+
+#ifdef STATS
+	/// Latency histograms; see QRY STA
+	stats_t sta;
+#endif
+
+#if TRACE_LEN
+	/// Event trace; see QRY TRC
+	trace_ring_t trc;
+#endif
+
 	// various global flags
 	uint8_t in_menu:1,	///<Set to 1 if user is in the debug menu
 		echo:1,		///<If 1, echo all serial input back to user
-		fuel_gauge:1;	///<Set to 1 when the fuel gauge IC is present
+		fuel_gauge:1,	///<Set to 1 when the fuel gauge IC is present
+		rx_over:1,	///<Set to 1 when the current line is too long
+		brownout:1;	///<Set to 1 while every motor is taught again
 
 	/// (Sub)menu currently being displayed to the user
 	menu_step_t menustep;
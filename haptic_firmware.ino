@@ -13,16 +13,21 @@
 #include <ctype.h>
 #include <string.h>
 #include <avr/power.h>
+#include <util/crc16.h>
 //#include <avr/eeprom.h>	// arduino apparently breaks this
 
 #include "error.h"
 #include "parse.h"
 #include "rhythm.h"
 #include "magnitude.h"
+#include "spatio.h"
 #include "vibration.h"
 #include "wire_err.h"
 #include "globals_main.h"
 #include "menu.h"
+#include "frame.h"
+#include "stats.h"
+#include "trace.h"
 //#include "fuelgauge.h"
 
 #include "debug_main.h"
@@ -33,6 +38,9 @@
 #include "error.c"
 #include "parse.c"
 
+/// Serial link rate, in bits per second, except while in framed mode
+#define SERIAL_BAUD 9600
+
 /// Time to wait for a status response from a motor, in ms
 #define TWI_TIMEOUT 100
 
@@ -45,10 +53,104 @@
 /// Support motor slave addresses between 0 and this number, exclusive
 #define MAX_TWI_ADDR 0x7f
 
+/// Time between background sweeps of the TWI address space, in ms
+#define SWEEP_PERIOD 1000
+
+/// Number of TWI failures in a row after which a motor is quarantined
+#define HLT_QUARANTINE 3
+
+/// Coarse clock for motor health, in units of 256 ms; wraps after 65 s
+#define HLT_TICK() ((uint8_t)(millis() >> 8))
+
+/** \brief Motors that lose what they were taught within this many ms of
+ *  each other are taken to have browned out together; see refresh_mark()
+ */
+#define BROWNOUT_WINDOW 500
+
+/** \brief Generation tag that a motor reports when it holds none, e.g. since
+ *  it was last powered up; see lib_gen()
+ */
+#define GEN_NONE 0xffff
+
+/// TWI clock rate \a _r_, in kHz: 50, 100, 200 or 400
+#define TWI_KHZ( _r_ ) ( 50UL << (_r_) )
+/// Number of TWI clock rates; see TWI_KHZ()
+#define TWI_RATES 4
+/// TWI clock rate that Wire.begin() sets, 100 kHz
+#define TWI_RATE_DEF 1
+/// Times each motor is sent the test command at each rate; see bus_test()
+#define BUS_ROUNDS 4
+/// Transactions over which the failures on a segment are counted
+#define BUS_WINDOW 128
+/// Failures within BUS_WINDOW transactions that slow a segment down
+#define BUS_ERR_MAX 8
+
 /// Offset of magnitude storage in the EEPROM
 #define EE_MAG ((magnitude_t*)0)
 /// Offset of rhythm storage in the EEPROM
 #define EE_RHY ((rhythm_t*)(EE_MAG + MAX_MAGNITUDE))
+/// Offset of spatio-temporal pattern storage in the EEPROM
+#define EE_SPT ((spatio_t*)(EE_RHY + MAX_RHYTHM))
+/** \brief Offset of the saved motor address map in the EEPROM.
+ *  Addresses in motor order, with each change of segment marked by a byte
+ *  0x80 + segment, and a 0 after the last; see load_motors().
+ */
+#define EE_MTR ((uint8_t*)(EE_SPT + MAX_SPATIO))
+/// Size of the saved motor address map; a bigger map is not saved
+#define EE_MTR_LEN 64
+/// Offset of motor group storage in the EEPROM
+#define EE_GRP ((group_t*)(EE_MTR + EE_MTR_LEN))
+/// Offset of the library rhythms past the first MAX_RHYTHM in the EEPROM
+#define EE_XRHY ((rhythm_t*)(EE_GRP + MAX_GROUPS))
+/// Offset of the library magnitudes past the first MAX_MAGNITUDE
+#define EE_XMAG ((magnitude_t*)(EE_XRHY + LIB_RHYTHMS-MAX_RHYTHM))
+/// End of the library in the EEPROM
+#define EE_XEND ((uint8_t*)(EE_XMAG + LIB_MAGNITUDES-MAX_MAGNITUDE))
+/// Offset of the calibrated TWI rate of each segment; 0xff if none
+#define EE_BUS ((uint8_t*)EE_XEND)
+
+/// Version of the LRN CFG / QRY CFG image layout, sent as its first byte
+#define CFG_VER 1
+/** \brief Number of bytes in the LRN CFG / QRY CFG image: CFG_VER, then
+ *  the EEPROM from EE_MAG to EE_SPT, then from EE_XRHY to EE_XEND. Tables
+ *  added later go at the end, with CFG_VER bumped.
+ */
+#define CFG_LEN ( 1 + sizeof(glbl.lib) \
+	+ (LIB_RHYTHMS-MAX_RHYTHM)*sizeof(rhythm_t) \
+	+ (LIB_MAGNITUDES-MAX_MAGNITUDE)*sizeof(magnitude_t) )
+/// Time after which a partly received LRN CFG image is abandoned, in ms
+#define CFG_TIMEOUT 250
+/// Bytes of a LRN CFG image the host sends for each CFG_XON
+#define CFG_CHUNK 16
+/// Byte that asks the host for the next CFG_CHUNK bytes of a LRN CFG image
+#define CFG_XON 0x11
+/** \brief Offset of the EEPROM scratch area a LRN CFG image is staged in,
+ *  without its CFG_VER byte, until it has been checked; see learn_config()
+ */
+#define EE_CFG ((uint8_t*)(EE_BUS + TWI_SEGMENTS))
+/** \brief Offset of the byte after the staged LRN CFG image, CFG_OK while
+ *  the image is being copied into place; see cfg_install()
+ */
+#define EE_CFG_OK ( EE_CFG + CFG_LEN-1 )
+/// Value of the byte at EE_CFG_OK while a checked image is copied into place
+#define CFG_OK 0x5a
+/// Size of the EEPROM, which must hold everything up to EE_CFG_OK
+#ifndef EE_SIZE
+#	define EE_SIZE 1024
+#endif
+static_assert( LIB_MAGNITUDES*sizeof(magnitude_t) + LIB_RHYTHMS*sizeof(rhythm_t)
+	+ MAX_SPATIO*sizeof(spatio_t) + EE_MTR_LEN + MAX_GROUPS*sizeof(group_t)
+	+ TWI_SEGMENTS + CFG_LEN <= EE_SIZE, "EEPROM layout too big" );
+
+/// Number of batched tuples read in before they are dispatched by segment
+#define BATCH_CHUNK 16
+
+/** \brief Nonzero to have send_queue() wait for each status as it is sent,
+ *  as activations did before send_drain(); only for comparing the two
+ */
+#ifndef SEND_BLOCKING
+#	define SEND_BLOCKING 0
+#endif
 
 /// Funnel globals, defined in globals_main.h
 globals_t glbl;
@@ -66,347 +168,2309 @@ static inline void eeprom_read( void* into, void* from, size_t len )
 }
 
 /// Write a chunk of data to the EEPROM
+// bytes that already hold the right value are skipped; a write takes ~3.3ms
+// and wears the cell, while a read is nearly free
 static inline void eeprom_write( void* into, void* from, size_t len )
 {
 	size_t i;
 	for( i=0; i<len; ++i )
-		EEPROM.write( (size_t)into+i, *((uint8_t*)from+i) );
+		if( EEPROM.read((size_t)into+i) != *((uint8_t*)from+i) )
+			EEPROM.write( (size_t)into+i, *((uint8_t*)from+i) );
+}
+
+/// Copy a chunk of the EEPROM to another place in it, a few bytes at a time
+static void eeprom_copy( void* into, void* from, size_t len )
+{
+	uint8_t buf[ 16 ];
+	size_t n;
+
+	for( ; len; len-=n ) {
+		n = len < sizeof(buf)? len : sizeof(buf);
+		eeprom_read( buf, from, n );
+		eeprom_write( into, buf, n );
+		into = (uint8_t*)into + n;
+		from = (uint8_t*)from + n;
+	}
 }
 
 /// Zero a chunk of the EEPROM
 static inline void eeprom_zero( void* start, void* end )
 {
 	while( start < end ) {
-		EEPROM.write( (size_t)start, 0 );
+		if( EEPROM.read((size_t)start) )
+			EEPROM.write( (size_t)start, 0 );
 //		eeprom_write_byte( (uint8_t*)start, 0 );
 		start = (uint8_t*)start + 1;
 	}
 }
 
-/// Convert an unsigned byte to two ASCII hex digits plus null terminator
-void itoh( char *into, uint8_t val )
+/// Load the shadow copy of the learned rhythms and magnitudes from EEPROM
+/** Also starts the motor slots off holding the first MAX_RHYTHM rhythms and
+ *  MAX_MAGNITUDE magnitudes of the library, in order, as teach_motor() will
+ *  teach them.
+ */
+static void lib_gen( void );
+
+static inline void lib_load( void )
 {
-	into[0] = val >> 4;
-	into[0] += ( into[0]<10? '0' : 'A'-10 );
-	into[1] = val & 0xf;
-	into[1] += ( into[1]<10? '0' : 'A'-10 );
-	into[2] = '\0';
+	uint8_t i;
+
+	eeprom_read( &glbl.lib, EE_MAG, sizeof(glbl.lib) );
+	glbl.lib_dirty = 0;
+
+	for( i=0; i<LIB_SLOTS; ++i )
+		glbl.slot.lib[ i ] = i<MAX_RHYTHM? i : i-MAX_RHYTHM;
+	lib_gen();
 }
 
-/// Send the command in the global command buffer to the specified motor
-// if motor is specified as -1, send command to all motors via a general call
-error_t send_command( int8_t motor, uint8_t *buf = NULL, int8_t length = 0 )
+/// Read rhythm \a which of the library into \a into
+/** The first MAX_RHYTHM come from the shadow copy, the rest from EEPROM.
+ *  \return ENOR if the rhythm is not defined, else ESUCCESS.
+ */
+static error_t lib_rhy( uint8_t which, rhythm_t *into )
 {
-	unsigned long start;
-	uint8_t status;
+	if( which >= LIB_RHYTHMS ) return ENOR;
+	if( which < MAX_RHYTHM )
+		*into = glbl.lib.rhy[ which ];
+	else	eeprom_read( into, EE_XRHY + which-MAX_RHYTHM, sizeof(*into) );
 
-	// make sure the requested motor is present
-	if( motor >= MAX_MOTORS ) return ENOMOTOR;
+	if( !into->bits || into->bits>MAX_RBITS ) return ENOR;
+	return ESUCCESS;
+}
 
-	if( motor < 0 )
-		motor = 0;	// general call
-	else {
-		// find the actual TWI address of the given motor
-		motor = glbl.mtrs[ motor ].addr;
-		if( !motor ) return ENOMOTOR;
+/// Read magnitude \a which of the library into \a into; see lib_rhy()
+static error_t lib_mag( uint8_t which, magnitude_t *into )
+{
+	if( which >= LIB_MAGNITUDES ) return ENOM;
+	if( which < MAX_MAGNITUDE )
+		*into = glbl.lib.mag[ which ];
+	else	eeprom_read( into, EE_XMAG + which-MAX_MAGNITUDE, sizeof(*into) );
+
+	// unprogrammed EEPROM reads back as 0xffff
+	if( !into->period || into->period == 0xffff ) return ENOM;
+	return ESUCCESS;
+}
+
+/// Work out the generation tag of what the motor slots hold, into glbl.gen
+/** The tag is a CRC of the rhythm or magnitude in each slot, so it changes
+ *  whenever what teach_motor() would teach does, and comes back the same
+ *  after a reboot. It is never GEN_NONE, nor 0, which an older motor that
+ *  sends only its status byte, or one that has just reset, might report;
+ *  see teach_stale().
+ */
+static void lib_gen( void )
+{
+	rhythm_t rhy;
+	magnitude_t mag;
+	const uint8_t *p;
+	uint8_t i, n, ok;
+	uint16_t crc = 0;
+
+	for( i=0; i<LIB_SLOTS; ++i ) {
+		if( i < MAX_RHYTHM ) {
+			ok = lib_rhy( glbl.slot.lib[i], &rhy ) == ESUCCESS;
+			p = (const uint8_t*)&rhy;
+			n = sizeof(rhy);
+		}else {
+			ok = lib_mag( glbl.slot.lib[i], &mag ) == ESUCCESS;
+			p = (const uint8_t*)&mag;
+			n = sizeof(mag);
+		}
+
+		crc = _crc_xmodem_update( crc, ok );
+		for( ; ok && n; --n )
+			crc = _crc_xmodem_update( crc, *p++ );
 	}
 
-	// send the command over TWI
-	// choose which buffer to send based on the current belt mode
-	Wire.beginTransmission( motor );
-	if( glbl.mode == M_ACTIVE )
+	if( !crc || crc == GEN_NONE ) crc = 1;
+	glbl.gen = crc;
+}
+
+/// Write the entries of the shadow copy that have changed back to EEPROM
+static void lib_flush( void )
+{
+	uint8_t i;
+
+	for( i=0; i<MAX_MAGNITUDE; ++i )
+		if( glbl.lib_dirty & LIB_MAG_BIT(i) )
+			eeprom_write( EE_MAG+i, glbl.lib.mag+i, sizeof(magnitude_t) );
+	for( i=0; i<MAX_RHYTHM; ++i )
+		if( glbl.lib_dirty & LIB_RHY_BIT(i) )
+			eeprom_write( EE_RHY+i, glbl.lib.rhy+i, sizeof(rhythm_t) );
+
+	glbl.lib_dirty = 0;
+}
+
+#ifdef STATS
+/// Count a phase that took \a us microseconds in the histogram for \a phase
+static void stats_add( uint8_t phase, unsigned long us )
+{
+	uint16_t *hist = glbl.sta.hist[ phase ];
+	uint8_t bucket = 0;
+
+	if( us > glbl.sta.max[phase] )
+		glbl.sta.max[ phase ] = us > 0xffff? 0xffff : us;
+
+	for( us >>= STA_SHIFT; us && bucket < STA_BUCKETS-1; us >>= 1 )
+		++bucket;
+	if( hist[bucket] != 0xffff )
+		++hist[ bucket ];
+}
+#endif
+
+#if TRACE_LEN
+/// Record an event in the trace ring; use TRC() rather than calling this
+/** Only copies the arguments; all formatting is left to QRY TRC and the
+ *  host, so that tracing barely changes the timing it is there to show.
+ */
+static void trace_add( uint8_t ev, uint8_t a, uint16_t b )
+{
+	trace_t *e = glbl.trc.buf + glbl.trc.head;
+
+	e->us = micros();
+	e->ev = ev;
+	e->a = a;
+	e->b = b;
+
+	if( ++glbl.trc.head == TRACE_LEN ) glbl.trc.head = 0;
+	if( glbl.trc.len < TRACE_LEN ) ++glbl.trc.len;
+	else if( glbl.trc.lost != 0xffff ) ++glbl.trc.lost;
+}
+#endif
+
+/// Set the TWI clock to rate \a rate, see TWI_KHZ(), unless it is already
+static inline void bus_clock( uint8_t rate )
+{
+	if( rate == glbl.clk ) return;
+
+	Wire.setClock( TWI_KHZ(rate) * 1000 );
+	glbl.clk = rate;
+}
+
+/// Switch the TWI multiplexer to segment \a seg, unless it is there already
+/** The clock follows the rate of the segment switched to. */
+static inline void twi_segment( uint8_t seg )
+{
+#if TWI_SEGMENTS > 1
+	if( seg == glbl.seg ) return;
+
+	// the segment switched from hears the switch, so it goes at that
+	// segment's rate, or the slowest if it is not known
+	bus_clock( glbl.seg == 0xff? 0 : glbl.bus[glbl.seg].rate );
+	Wire.beginTransmission( TWI_MUX_ADDR );
+	Wire.write( 1 << seg );
+	if( Wire.endTransmission() == WE_SUCCESS ) {
+		glbl.seg = seg;
+		bus_clock( glbl.bus[seg].rate );
+	}else	glbl.seg = 0xff;	// unknown; switch again next time
+#else
+	(void)seg;	// a single segment is never switched
+#endif
+}
+
+/// Switch to the TWI segment of \a motor and return its address
+static inline uint8_t twi_motor( motor_t motor )
+{
+	twi_segment( MTR_SEG(motor) );
+	return glbl.mtrs[ motor ].addr;
+}
+
+/// Write a command to a TWI address
+/** Sends \a len bytes from \a data, or if \a data is NULL, the command in the
+ *  global command buffer chosen by the current belt mode. If \a stop is zero
+ *  the bus is held with a repeated start for a following status read.
+ */
+static error_t send_payload( uint8_t addr, uint8_t stop,
+	const uint8_t *data = NULL, uint8_t len = 0
+) {
+	uint8_t status;
+	STA_START( t );
+
+	Wire.beginTransmission( addr );
+	if( data )
+		Wire.write( data, len );
+	else if( glbl.mode != M_LEARN )
 		Wire.write( *((uint8_t*)&glbl.acmd.v) );
 	else	// learning mode
 		Wire.write( glbl.cmd );
-	status = Wire.endTransmission( false ); //repeated start
+	status = Wire.endTransmission( stop );
+	STA_STOP( STP_TX, t );
 
 	// if the TWI transmission failed, return a specific bus error status
 	if( status ) {
-		Wire.endTransmission( true );//we're done here
+		if( !stop )
+			Wire.endTransmission( true );//we're done here
 		if( status >= 4 )
 			return EBUS;
 		else	return (error_t)(EBUS + status);
 	}
 
-	// must not try to request data with a general call...
-	// FIXME? anything else to do?
-	if( motor == 0 ){
-		Wire.endTransmission( true );//we're done here
-		return ESUCCESS;
-	}		 
+	return ESUCCESS;
+}
+
+/// Read a status byte plus \a length reply bytes from a TWI address
+static error_t read_status( uint8_t addr, uint8_t *buf, int8_t length )
+{
+	uint8_t status;
+	STA_START( t );
 
 	// without a delay the tiny misses the status request...
 	// wait for at most TWI_TIMEOUT milliseconds
 	//for( start=millis(); millis()-start < TWI_TIMEOUT; )
-	int numberReturned = Wire.requestFrom(motor, length+1, true);//we're done here
+	int numberReturned = Wire.requestFrom((int)addr, length+1, true);//we're done here
+	if( !numberReturned ) {
+		STA_STOP( STP_STATUS, t );
+		return EBUSAN;	// nobody answered
+	}
 	status = Wire.read();
 	for(int i=0; i<numberReturned-1; i++)
 		buf[ i ] = Wire.read();
+	STA_STOP( STP_STATUS, t );
 
 	return (error_t)status;
 }
 
-/// Send a command to each attached motor in turn
-// mark any motor that returns an error
-// FIXME: do something when an error occurs
-error_t send_command_all( void )
+/// Drop segment \a seg to the next slower TWI rate, if there is one
+/** The segment stays there until it is calibrated again; see bus_start().
+ *  Its quarantined motors are let out, to be tried again at the new rate.
+ *  Must be called while the bus is on \a seg.
+ */
+static void bus_fallback( uint8_t seg )
 {
-	uint8_t i, errors = 0;
+	bus_stat_t *b = glbl.bus + seg;
+	motor_t i;
 
-	for( i=0; glbl.mtrs[i].addr; ++i ) {
-		error_t ret = send_command(i);
-		glbl.mtrs[i].err = ret != ESUCCESS;
-		errors |= glbl.mtrs[i].err;
-		DBGC(" ");
-		DBGC( ret, DEC );
-	}
-	DBGCN("");
+	b->win = b->win_err = 0;
+	if( !b->rate ) return;
 
-	if( errors ) return EBUS;
+	--b->rate;
+	if( b->drops != 0xff ) ++b->drops;
+	bus_clock( b->rate );
 
-	return ESUCCESS;
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( MTR_SEG(i) == seg && glbl.mtrs[i].err ) {
+			glbl.mtrs[ i ].err = 0;
+			glbl.hlt[ i ].streak = 0;
+		}
 }
 
-/// Detect the addresses of all motors present on the TWI bus
-uint8_t detect_motors( void )
+/// Find out whether any motor on segment \a seg is not quarantined
+static uint8_t bus_answering( uint8_t seg )
 {
-	uint8_t i, j = 0;
+	motor_t i;
 
-	// send a command on every address
-	// if the command is ACKed, then a motor is present
-	DBG( "dm:" );
-	for( i=1; i<MAX_TWI_ADDR && j<MAX_MOTORS; ++i ) {
-		wire_err_t ret;
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( MTR_SEG(i) == seg && !glbl.mtrs[i].err )
+			return 1;
+	return 0;
+}
 
-		DBGC( i, HEX );
-		Wire.beginTransmission(i);
-		Wire.write(0);
-		ret = (wire_err_t)Wire.endTransmission();
+/// Count a TWI transaction on segment \a seg towards its failure rate
+/** Once BUS_ERR_MAX transactions within BUS_WINDOW have failed, the segment
+ *  falls back to the next slower rate; see bus_fallback().
+ */
+static void bus_count( uint8_t seg, uint8_t failed )
+{
+	bus_stat_t *b = glbl.bus + seg;
 
-		if( ret != WE_ANACK ) {
-			glbl.mtrs[j].addr = i;
-			if( ret != WE_SUCCESS ) {
-				DBGC("/");
-				glbl.mtrs[j].err = 1;
-			}else {
-				DBGC("+");
-			}
-			++j;
-		}else {
-			DBGC("-");
-		}
+	++b->txn;
+	if( failed ) {
+		if( b->errs != 0xffff ) ++b->errs;
+		++b->win_err;
 	}
-	DBGCN("");
-	for( i=j; i<=MAX_MOTORS; ++i )
-		glbl.mtrs[i].addr = 0;
 
-	// print a debug message that shows addresses of all detected motors
-#ifdef DEBUG
-	DBG( j, DEC ); DBGC( " motors:" );
-	for( int i=0; glbl.mtrs[i].addr; ++i ) {
-		DBGC( " " );
-		DBGC( glbl.mtrs[i].addr, HEX );
+	if( b->win_err >= BUS_ERR_MAX )
+		bus_fallback( seg );
+	else if( ++b->win == BUS_WINDOW )
+		b->win = b->win_err = 0;
+}
+
+/// Record the outcome of a TWI transaction with a motor
+/** Only bus errors count against a motor; any other status means that it
+ *  answered. After HLT_QUARANTINE bus errors in a row the motor is
+ *  quarantined: commands to it fail at once with its last error instead of
+ *  costing a TWI transaction, until health_service() finds it answering
+ *  again. A segment on which every motor is quarantined falls back to a
+ *  slower rate at once, since that leaves nothing to count failures with;
+ *  see bus_fallback().
+ */
+static void motor_health( motor_t motor, error_t status )
+{
+	uint8_t seg = MTR_SEG( motor );
+
+	// a quarantined motor failing again only says something about the
+	// bus if no motor on the segment answers, e.g. on a small segment
+	bus_count( seg, status >= EBUS && status <= EBUSDN &&
+		(!glbl.mtrs[motor].err || !bus_answering(seg)) );
+
+	if( status < EBUS || status > EBUSDN ) {
+		glbl.hlt[ motor ].streak = 0;
+		glbl.mtrs[ motor ].err = 0;
+		return;
 	}
-	DBGCN("");
-#endif
 
-	return j;
+	if( glbl.hlt[motor].fails != 0xff )
+		++glbl.hlt[ motor ].fails;
+	if( glbl.hlt[motor].streak != 7 )
+		++glbl.hlt[ motor ].streak;
+	glbl.hlt[ motor ].last = status;
+	glbl.hlt[ motor ].since = HLT_TICK();
+	if( glbl.hlt[motor].streak >= HLT_QUARANTINE ) {
+		glbl.mtrs[ motor ].err = 1;
+		if( !bus_answering(seg) )
+			bus_fallback( seg );
+	}
 }
 
-/// Generate an ASCII representation of a rhythm
-error_t rtos( char *into, uint8_t which )
+static void refresh_mark( motor_t motor );
+
+/// Collect the status of a motor written by send_queue()
+/** Reconciles the status into motor_health(). A motor that no longer knows
+ *  a rhythm or magnitude is taught again; see refresh_mark(). Returns
+ *  ESUCCESS without touching the bus if no status is outstanding for
+ *  \a motor.
+ */
+error_t send_collect( motor_t motor )
 {
-	rhythm_t rhy;
-	uint8_t i;
+	error_t ret;
 
-	// retrieve the specified rhythm from EEPROM
-	eeprom_read( &rhy, EE_RHY+which, sizeof(rhy) );
-	if( !rhy.bits || rhy.bits>MAX_RBITS )
-		return ENOR;
+	if( !BIT_GET(glbl.pend, motor) ) return ESUCCESS;
+	BIT_CLR( glbl.pend, motor );
 
-	strcpy( into, "RHY " );
-	into += 4;
-	*into++ = itol( which );
-	*into++ = ' ';
-	for( i=0; i<sizeof(rhy.pattern); ++i, into+=2 )
-		itoh( into, rhy.pattern[i] );
-	*into++ = ' ';
-	utoa( rhy.bits, into, 10 );
+	ret = read_status( twi_motor(motor), NULL, 0 );
+	motor_health( motor, ret );
+	if( ret == ENOR || ret == ENOM )
+		refresh_mark( motor );
 
-	return ESUCCESS;
+	return ret;
 }
 
-/// Generate an ASCII representation of a magnitude
-error_t mtos( char *into, uint8_t which )
+/// Collect one outstanding motor status, if any
+/** Called while waiting for serial input, so that statuses left behind by
+ *  send_queue() drain in the background.
+ *
+ *  \return 1 if a status was collected, 0 if none were outstanding.
+ */
+uint8_t send_drain( void )
 {
-	magnitude_t mag;
+	motor_t i;
 
-	// retrieve the specified magnitude from EEPROM
-	eeprom_read( &mag, EE_MAG+which, sizeof(mag) );
-	if( !mag.period ) return ENOM;
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( BIT_GET(glbl.pend, i) ) {
+			send_collect( i );
+			return 1;
+		}
 
-	strcpy( into, "MAG " );
-	into += 4;
-	*into++ = itol( which );
-	*into++ = ' ';
-	utoa( mag.period, into, 10 );
-	into += strlen( into );
-	*into++ = ' ';
-	utoa( mag.duty, into, 10 );
+	return 0;
+}
 
-	return ESUCCESS;
+#if SEND_BLOCKING
+error_t send_command( motor_t motor, uint8_t *buf, int8_t length,
+	const uint8_t *data, uint8_t len );
+#endif
+
+/// Write a command to a motor, without waiting for its status
+/** Sends the command in the global command buffer, or \a len bytes from
+ *  \a data if given; background work passes its own data because the global
+ *  buffers may be in use by the foreground.
+ *
+ *  The status is read later by send_collect() or send_drain(), which lets
+ *  the tiny process the command while the bus is used for other motors. A
+ *  status still outstanding from an earlier write is collected first, since
+ *  the tiny would otherwise overwrite it.
+ *
+ *  Only activations go through here. Learning relays still wait for every
+ *  status with send_command_gcl(), since their result is sent back.
+ */
+error_t send_queue( motor_t motor, const uint8_t *data = NULL,
+	uint8_t len = 0
+) {
+	error_t ret;
+
+#if SEND_BLOCKING
+	return send_command( motor, NULL, 0, data, len );
+#endif
+	if( motor >= MAX_MOTORS || !glbl.mtrs[motor].addr ) return ENOMOTOR;
+	if( glbl.mtrs[motor].err ) return (error_t)glbl.hlt[motor].last;
+
+	send_collect( motor );
+
+	ret = send_payload( twi_motor(motor), true, data, len );
+	if( ret == ESUCCESS )
+		BIT_SET( glbl.pend, motor );
+	else	motor_health( motor, ret );
+
+	return ret;
 }
 
-/// Load all rhythms and magnitudes from EEPROM and relay them to a motor
-// if motor is specified as -1, send to all motors
-void teach_motor( uint8_t motor )
+/// Send a command to all motors with a general call
+/** Sends \a len bytes from \a data, or the command in the global command
+ *  buffer if \a data is NULL; see send_payload(). Goes out once on each
+ *  segment that has motors.
+ */
+static error_t send_general( const uint8_t *data = NULL, uint8_t len = 0 )
 {
-	uint8_t i;
+	// every motor will overwrite its status, so collect them all
+	while( send_drain() );
 
-	DBGN( "rhy" );
-	strcpy( glbl.cmd, "LRN " );
-	for( i=0; i<MAX_RHYTHM; ++i ) {
-		if( rtos(glbl.cmd+4, i) != ESUCCESS )
-			continue;
-		DBGN( glbl.cmd );
-		if( motor == -1 )
-			send_command_all();
-		else
-			send_command( motor );
+	// must not try to request data with a general call...
+	// FIXME? anything else to do?
+#if TWI_SEGMENTS > 1
+	uint8_t seg = 0xff;
+	error_t ret = ESUCCESS;
+	motor_t motor;
+
+	for( motor=0; glbl.mtrs[motor].addr; ++motor ) {
+		// the motors are in segment order
+		if( glbl.mtrs[motor].seg == seg ) continue;
+		seg = glbl.mtrs[ motor ].seg;
+
+		twi_segment( seg );
+		error_t status = send_payload( 0, true, data, len );
+		if( ret == ESUCCESS )
+			ret = status;
 	}
+	return ret;
+#else
+	return send_payload( 0, true, data, len );
+#endif
+}
 
-	DBGN( "mag" );
-	for( i=0; i<MAX_MAGNITUDE; ++i ) {
-		if( mtos(glbl.cmd+4, i) != ESUCCESS )
-			continue;
-		DBGN( glbl.cmd );
-		if( motor == -1 )
-			send_command_all();
-		else
-			send_command( motor );
+/// Send the command in the global command buffer to the specified motor
+// if motor is specified as MOTOR_ALL, send command to all motors via a
+// general call, on each segment that has motors
+// if data is given, send len bytes from it instead, as send_queue() does
+error_t send_command( motor_t motor, uint8_t *buf = NULL, int8_t length = 0,
+	const uint8_t *data = NULL, uint8_t len = 0
+) {
+	error_t ret;
+	uint8_t addr;
+
+	if( motor == MOTOR_ALL ) {
+		ret = send_general( data, len );
+		TRC( TRE_SEND, ret, motor );
+		return ret;
 	}
+
+	// make sure the requested motor is present
+	if( motor >= MAX_MOTORS ) return ENOMOTOR;
+
+	// find the actual TWI address of the given motor
+	if( !glbl.mtrs[ motor ].addr ) return ENOMOTOR;
+	if( glbl.mtrs[ motor ].err ) return (error_t)glbl.hlt[motor].last;
+
+	send_collect( motor );
+
+	addr = twi_motor( motor );
+	ret = send_payload( addr, false, data, len ); //repeated start
+	if( ret == ESUCCESS )
+		ret = read_status( addr, buf, length );
+	motor_health( motor, ret );
+	TRC( TRE_SEND, ret, motor );
+
+	return ret;
 }
 
-/// Read a single character from the serial link
-/** Busy wait until a character arrives. Convert '\\r' to '\\n'. If \a echo is
- *  non-zero, echo the character back over the serial link, converting '\\r'
- *  to "\r\n" in the echo only.
+/// Send a command to every attached motor with a single general call
+/** Every motor is then polled once for its status, and only the motors that
+ *  did not report success are sent the command again individually. This
+ *  costs one write plus one read per motor, instead of a write and a read
+ *  per motor. If no motor acknowledges the general call at all, every motor
+ *  is sent the command individually. Quarantined motors are not polled or
+ *  retried, so that a dead motor costs nothing here.
  */
-static inline char read_char( uint8_t echo )
+error_t send_command_gcl( void )
 {
-	char ch;
+	uint8_t errors = 0;
+	motor_t i;
+	error_t ret;
 
-	while( !Serial.available() );
+	ret = send_command( MOTOR_ALL );
 
-	ch =  Serial.read() ;
-	if( echo ) {
-		Serial.print(ch);
-		if( ch == '\r' ) Serial.print( '\n' );
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		error_t status = ret;
+
+		if( glbl.mtrs[i].err ) {
+			errors = 1;
+			continue;
+		}
+
+		if( status == ESUCCESS ) {
+			status = read_status( twi_motor(i), NULL, 0 );
+			motor_health( i, status );
+		}
+		if( status != ESUCCESS ) {
+			DBGC(" r");
+			status = send_command( i );
+		}
+		errors |= status != ESUCCESS;
+		DBGC(" ");
+		DBGC( status, DEC );
 	}
+	DBGCN("");
 
-	return ch=='\r'? '\n' : ch;
+	if( errors ) return EBUS;
+
+	return ESUCCESS;
 }
 
-/// Print an error_t status value to the serial link, in the form "STS x\n"
-static inline void print_status( error_t status )
+/// Send a probe command to a TWI address; see detect_motors()
+static wire_err_t probe_addr( uint8_t addr )
 {
-	Serial.print( "STS " );
-	Serial.println( status, DEC );
+	Wire.beginTransmission( addr );
+	Wire.write( 0 );
+	return (wire_err_t)Wire.endTransmission();
 }
 
-/// Read a line of text from serial link into the global ASCII command buffer
-void read_line( void )
+/// Re-probe one quarantined motor whose backoff has run out, if any
+/** The backoff starts at one HLT_TICK() and doubles with every failed
+ *  re-probe, up to 16 ticks. A motor that answers leaves quarantine; if it
+ *  lost its rhythms and magnitudes meanwhile, reliable_activate() teaches
+ *  them again at its next activation.
+ *
+ *  \return 1 if a motor was probed, 0 if none were due.
+ */
+static uint8_t health_service( void )
 {
-	uint8_t i;
-	char ch;
+	uint8_t now = HLT_TICK();
+	motor_t i;
 
-	// erghhh...
-	do{
-		// read characters until a newline
-		i = 0;
-		while( (ch=read_char(glbl.echo)) != '\n' )
-			if( i < sizeof(glbl.cmd) )
-				glbl.cmd[ i++ ] = ch;
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		uint8_t wait = 1 << ( glbl.hlt[i].streak - HLT_QUARANTINE );
 
-		// if the line was too long, return an error
-		if( i >= sizeof(glbl.cmd) ) {
-			if( glbl.echo )
-				print_flash( errstr(ETOOBIG) );
-			else
-				print_status( ETOOBIG );
+		if( !glbl.mtrs[i].err ||
+			(uint8_t)(now - glbl.hlt[i].since) < wait
+		)
+			continue;
+
+		switch( probe_addr(twi_motor(i)) ) {
+		case WE_SUCCESS:	motor_health( i, ESUCCESS );	break;
+		case WE_ANACK:		motor_health( i, EBUSAN );	break;
+		case WE_DNACK:		motor_health( i, EBUSDN );	break;
+		default:		motor_health( i, EBUS );	break;
 		}
-	}while( i >= sizeof(glbl.cmd) );
+		return 1;
+	}
 
-	glbl.cmd[i] = '\0';
+	return 0;
 }
 
-/// Read two raw bytes from serial link into global activate command buffer
-void read_active( void )
+/// Send the test command to each motor on segment \a seg at rate \a rate
+/** The test command is a vibration of duration 0, which stops the motor and
+ *  is answered with ESUCCESS; each motor is sent it BUS_ROUNDS times, and
+ *  its status read back each time. Motors marked in \a skip are left out.
+ *
+ *  \return The number of motors that failed; they are marked in \a skip.
+ */
+static uint8_t bus_test( uint8_t seg, uint8_t rate, uint8_t *skip )
 {
-	uint8_t i = 0;
+	static const uint8_t stop = 0;
+	uint8_t n, failed = 0, addr;
+	motor_t i;
 
-	while( i < sizeof(active_command_t) )
-		if( Serial.available() )
-			*((uint8_t*)&glbl.acmd + i++) = Serial.read();
-}
-
-/// Same as read_active(), but read 4 ASCII hex digits instead of 2 raw bytes
-void read_active_hex( void )
-{
-	uint8_t *into = (uint8_t*)&glbl.acmd, i = 0;
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		if( MTR_SEG(i) != seg || BIT_GET(skip, i) ) continue;
+
+		addr = twi_motor( i );
+		bus_clock( rate );
+		for( n=0; n<BUS_ROUNDS; ++n )
+			if( send_payload(addr, false, &stop, 1) != ESUCCESS ||
+				read_status(addr, NULL, 0) != ESUCCESS
+			)
+				break;
+		if( n < BUS_ROUNDS ) {
+			BIT_SET( skip, i );
+			++failed;
+		}
+	}
 
-	while( i++ < sizeof(active_command_t) )
-		*into++ = htoi(read_char(1))<<4 | htoi(read_char(1));
+	return failed;
 }
 
-// command handlers
-
-/// Handle the LRN RHY command. Stores a rhythm in EEPROM and teaches motors.
-error_t learn_rhythm( int argc, const char *const *argv )
+/// Find the fastest TWI rate at which every motor on segment \a seg answers
+/** Motors that fail even at the slowest rate have a fault of their own and
+ *  are left out, so that one bad motor does not slow down the segment. If
+ *  none answer at all, there is nothing to go on, and TWI_RATE_DEF is used.
+ */
+static uint8_t bus_calibrate( uint8_t seg )
 {
-	rhythm_t rhy;
-	error_t ret;
+	uint8_t skip[ MOTOR_BITMAP ], rate, motors = 0;
+	motor_t i;
 
-	// parse the rhythm and store it in EEPROM
-	ret = parse_rhythm( argc, argv, &rhy );
-	if( ret != ESUCCESS ) return ret;
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		motors += MTR_SEG(i) == seg;
 
-	eeprom_write( EE_RHY+(ltoi(0)), &rhy, sizeof(rhy) );
-
-	// relay the learn to all connected motors
-	DBG( "relaying rhythm:" );
-	send_command_all();
+	memset( skip, 0, sizeof(skip) );
+	if( bus_test(seg, 0, skip) == motors ) return TWI_RATE_DEF;
+	for( rate=1; rate<TWI_RATES && !bus_test(seg, rate, skip); ++rate );
 
-	return ret;
+	return rate - 1;
 }
 
-/// Handle the LRN MAG command. Stores magnitude in EEPROM and teaches motors.
-error_t learn_magnitude( int argc, const char *const *argv )
+/// Settle the TWI rate of each segment, and start its counts over
+/** The rate saved in EEPROM is kept if every motor on the segment still
+ *  answers at it. Otherwise, or if \a force is set, the segment is
+ *  calibrated and the new rate saved. A segment without motors runs at
+ *  TWI_RATE_DEF, and keeps what was saved for it.
+ */
+static void bus_start( uint8_t force )
+{
+	uint8_t skip[ MOTOR_BITMAP ], seg, rate;
+	motor_t i;
+
+	// the test command overwrites any status still outstanding
+	while( send_drain() );
+
+	for( seg=0; seg<TWI_SEGMENTS; ++seg ) {
+		for( i=0; glbl.mtrs[i].addr && MTR_SEG(i) != seg; ++i );
+
+		eeprom_read( &rate, EE_BUS+seg, sizeof(rate) );
+		memset( skip, 0, sizeof(skip) );
+		if( !glbl.mtrs[i].addr )
+			rate = TWI_RATE_DEF;
+		else if( force || rate >= TWI_RATES ||
+			bus_test(seg, rate, skip)
+		) {
+			rate = bus_calibrate( seg );
+			eeprom_write( EE_BUS+seg, &rate, sizeof(rate) );
+		}
+		DBG( "bus " ); DBGC( seg, DEC ); DBGC( ' ' );
+		DBGCN( TWI_KHZ(rate), DEC );
+
+		memset( glbl.bus+seg, 0, sizeof(*glbl.bus) );
+		glbl.bus[ seg ].rate = glbl.bus[ seg ].cal = rate;
+	}
+
+#if TWI_SEGMENTS > 1
+	bus_clock( glbl.seg == 0xff? 0 : glbl.bus[glbl.seg].rate );
+#else
+	bus_clock( glbl.bus[0].rate );
+#endif
+}
+
+/// Probe the next address of the background motor sweep
+/** Addresses that answer are only recorded in glbl.seen; they become motors
+ *  at the next detect_motors(), so that motor numbers never change under the
+ *  host without it asking. Each segment is swept in turn.
+ */
+void sweep_motors( void )
+{
+	uint16_t at = glbl.sweep;
+	uint8_t addr = at & 0x7f, seg = at >> 7;
+	motor_t i;
+
+	if( !at ) {
+		// start a new pass every so often, so that hot-added motors
+		// are already known by the time the host asks
+		if( millis() - glbl.swept >= SWEEP_PERIOD )
+			glbl.sweep = 1;
+		return;
+	}
+	if( addr+1 < MAX_TWI_ADDR )
+		glbl.sweep = at+1;
+	else if( seg+1 < TWI_SEGMENTS )
+		glbl.sweep = TWI_INDEX( seg+1, 1 );
+	else {
+		glbl.sweep = 0;
+		glbl.swept = millis();
+	}
+
+#if TWI_SEGMENTS > 1
+	// the multiplexer answers on every segment
+	if( addr == TWI_MUX_ADDR ) return;
+#endif
+
+	// motors already known are re-probed by detect_motors() itself
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( glbl.mtrs[i].addr == addr && MTR_SEG(i) == seg ) return;
+
+	twi_segment( seg );
+	if( probe_addr(addr) != WE_ANACK )
+		BIT_SET( glbl.seen, at );
+	else	BIT_CLR( glbl.seen, at );
+}
+
+/// Load the motor addresses found at the last detect_motors() from EEPROM
+void load_motors( void )
+{
+	uint8_t pos, addr, seg = 0;
+	motor_t i = 0;
+
+	for( pos=0; pos<EE_MTR_LEN && i<MAX_MOTORS; ++pos ) {
+		eeprom_read( &addr, EE_MTR+pos, sizeof(addr) );
+
+		// a change of segment
+		if( addr & 0x80 ) {
+			seg = addr & 0x7f;
+			if( seg >= TWI_SEGMENTS ) break;
+			continue;
+		}
+
+		if( !addr || addr >= MAX_TWI_ADDR ) break;
+		glbl.mtrs[i].addr = addr;
+#if TWI_SEGMENTS > 1
+		glbl.mtrs[i].seg = seg;
+#endif
+		++i;
+	}
+	for( ; i<=MAX_MOTORS; ++i )
+		glbl.mtrs[i].addr = 0;
+}
+
+/// Save the motor address map for load_motors()
+/** A map too big for EE_MTR_LEN is saved as empty, so that the next start
+ *  sweeps the whole bus instead of trusting part of the map.
+ */
+static void save_motors( void )
+{
+	uint8_t pos = 0, seg = 0, len = 0, zero = 0;
+	motor_t i;
+
+	// work out whether the map fits before writing any of it
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		if( MTR_SEG(i) != seg ) {
+			seg = MTR_SEG( i );
+			++len;
+		}
+		if( ++len > EE_MTR_LEN ) {
+			eeprom_write( EE_MTR, &zero, sizeof(zero) );
+			return;
+		}
+	}
+
+	for( i=0, seg=0; glbl.mtrs[i].addr; ++i ) {
+		uint8_t addr = glbl.mtrs[i].addr;
+
+		if( MTR_SEG(i) != seg ) {
+			uint8_t mark;
+
+			seg = MTR_SEG( i );
+			mark = 0x80 | seg;
+			eeprom_write( EE_MTR+pos++, &mark, sizeof(mark) );
+		}
+		eeprom_write( EE_MTR+pos++, &addr, sizeof(addr) );
+	}
+	if( pos < EE_MTR_LEN )
+		eeprom_write( EE_MTR+pos, &zero, sizeof(zero) );
+}
+
+/// Detect the addresses of all motors present on the TWI bus
+/** Re-probes the motors already known, merges in any new ones found by the
+ *  background sweep (finishing the sweep first, unless \a boot is set and
+ *  some motors are already known), and rebuilds glbl.mtrs in segment, then
+ *  address, order. Motors that were not known before are marked in
+ *  glbl.fresh, and the number of motors that disappeared is kept in
+ *  glbl.removed. If anything changed, the new address map is saved to
+ *  EEPROM.
+ */
+motor_t detect_motors( uint8_t boot )
+{
+	uint8_t changed = 0;
+	uint8_t known[ TWI_BITMAP*TWI_SEGMENTS ], bad[ TWI_BITMAP*TWI_SEGMENTS ];
+	motor_t j = 0;
+	uint16_t i;
+
+	// the motor numbers are about to change, so settle any statuses
+	// still outstanding under the old numbering
+	while( send_drain() );
+
+	// re-probe the known motors
+	memset( known, 0, sizeof(known) );
+	memset( bad, 0, sizeof(bad) );
+	DBG( "dm:" );
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		uint16_t at = TWI_INDEX( MTR_SEG(i), glbl.mtrs[i].addr );
+		wire_err_t ret = probe_addr( twi_motor(i) );
+
+		DBGC( glbl.mtrs[i].addr, HEX );
+		BIT_SET( known, at );
+		if( ret != WE_ANACK ) {
+			BIT_SET( glbl.seen, at );
+			if( ret != WE_SUCCESS ) {
+				DBGC("/");
+				BIT_SET( bad, at );
+			}else {
+				DBGC("+");
+			}
+		}else {
+			DBGC("-");
+			BIT_CLR( glbl.seen, at );
+		}
+	}
+	DBGCN("");
+
+	// probe whatever the background sweep has not reached yet, or the
+	// whole address space if there is nothing to go on
+	if( !boot || !glbl.mtrs[0].addr ) {
+		if( !glbl.mtrs[0].addr )
+			glbl.sweep = 1;
+		while( glbl.sweep )
+			sweep_motors();
+	}
+
+	// rebuild the motor table in segment and address order
+	memset( glbl.fresh, 0, sizeof(glbl.fresh) );
+	glbl.removed = 0;
+	for( i=1; i<TWI_INDEX(TWI_SEGMENTS, 0); ++i ) {
+		if( !BIT_GET(glbl.seen, i) || j >= MAX_MOTORS ) {
+			if( BIT_GET(known, i) ) {
+				++glbl.removed;
+				changed = 1;
+			}
+			continue;
+		}
+
+		if( !BIT_GET(known, i) ) {
+			BIT_SET( glbl.fresh, j );
+			changed = 1;
+		}
+		// a fresh probe is the best evidence of a motor's health
+		memset( glbl.hlt+j, 0, sizeof(*glbl.hlt) );
+		glbl.mtrs[j].addr = i & 0x7f;
+		glbl.mtrs[j].err = 0;
+#if TWI_SEGMENTS > 1
+		glbl.mtrs[j].seg = i >> 7;
+#endif
+		if( BIT_GET(bad, i) )
+			motor_health( j, EBUSDN );
+		++j;
+	}
+	for( i=j; i<=MAX_MOTORS; ++i )
+		glbl.mtrs[i].addr = 0;
+
+	// remember the motors for a fast start next time; the motor numbers
+	// may have moved, so what each was taught is no longer known
+	if( changed ) {
+		save_motors();
+		memset( glbl.taught, 0, sizeof(glbl.taught) );
+		memset( glbl.stale, 0, sizeof(glbl.stale) );
+	}
+
+	// print a debug message that shows addresses of all detected motors
+#ifdef DEBUG
+	DBG( j, DEC ); DBGC( " motors:" );
+	for( int i=0; glbl.mtrs[i].addr; ++i ) {
+		DBGC( " " );
+		DBGC( glbl.mtrs[i].addr, HEX );
+	}
+	DBGCN("");
+#endif
+	TRC( TRE_DETECT, boot, j );
+
+	return j;
+}
+
+/// Generate an ASCII representation of library rhythm \a which
+/** The rhythm is given the ID \a id, written as a decimal number from 1 (see
+ *  parse_id()), so that it can be taught to a motor slot.
+ */
+static error_t rhy_text( char *into, uint8_t which, uint8_t id )
+{
+	rhythm_t rhy;
+
+	if( lib_rhy(which, &rhy) != ESUCCESS )
+		return ENOR;
+
+	rhythm_text( into, &rhy, id );
+	return ESUCCESS;
+}
+
+/// Generate an ASCII representation of library magnitude \a which
+/** The magnitude is given the ID \a id; see rhy_text(). */
+static error_t mag_text( char *into, uint8_t which, uint8_t id )
+{
+	magnitude_t mag;
+
+	if( lib_mag(which, &mag) != ESUCCESS )
+		return ENOM;
+
+	magnitude_text( into, &mag, id );
+	return ESUCCESS;
+}
+
+/// Generate an ASCII representation of a rhythm
+error_t rtos( char *into, uint8_t which )
+{ return rhy_text( into, which, which ); }
+
+/// Generate an ASCII representation of a magnitude
+error_t mtos( char *into, uint8_t which )
+{ return mag_text( into, which, which ); }
+
+/// Generate the LRN command that teaches motor slot \a slot its library entry
+/** \a slot counts the rhythm slots first, then the magnitude slots. */
+static error_t slot_text( char *into, uint8_t slot )
+{
+	uint8_t which = glbl.slot.lib[ slot ];
+
+	strcpy( into, "LRN " );
+	if( slot < MAX_RHYTHM )
+		return rhy_text( into+4, which, slot );
+	return mag_text( into+4, which, slot-MAX_RHYTHM );
+}
+
+/// Mark motor slot \a slot as taught to every motor, or to none
+static void slot_taught( uint8_t slot, uint8_t taught )
+{
+	motor_t i;
+
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( taught )
+			glbl.taught[ i ] |= 1 << slot;
+		else	glbl.taught[ i ] &= ~(1 << slot);
+}
+
+/// Find the motor slot holding a library entry, or make one hold it
+/** Looks through the \a n slots starting at \a base. If none holds entry
+ *  \a which, the empty or least recently used one is given it, and is no
+ *  longer taught to any motor, and the generation tag changes.
+ *
+ *  \return The slot, counting from \a base.
+ */
+static uint8_t slot_find( uint8_t base, uint8_t n, uint8_t which )
+{
+	uint8_t i, slot = 0, age, oldest = 0;
+
+	for( i=0; i<n; ++i ) {
+		if( glbl.slot.lib[base+i] == which ) {
+			slot = i;
+			break;
+		}
+
+		age = glbl.slot.lib[base+i] == 0xff? 0xff :
+			glbl.slot.age[base+i];
+		if( age >= oldest ) {
+			oldest = age;
+			slot = i;
+		}
+	}
+
+	if( i == n ) {
+		glbl.slot.lib[ base+slot ] = which;
+		slot_taught( base+slot, 0 );
+		lib_gen();
+	}
+	glbl.slot.age[ base+slot ] = 0;
+
+	return slot;
+}
+
+/// Find out whether \a motor (or every motor) has been taught motor slot \a slot
+/** \return 0 if it has, 1 if not (some motors have not, for MOTOR_ALL), or 2
+ *  if no motor has.
+ */
+static uint8_t slot_lacking( motor_t motor, uint8_t slot )
+{
+	uint16_t bit = 1 << slot;
+	uint8_t have = 0, lack = 0;
+	motor_t i;
+
+	if( motor != MOTOR_ALL )
+		return glbl.taught[motor] & bit? 0 : 1;
+
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( glbl.taught[i] & bit ) have = 1;
+		else	lack = 1;
+
+	return !lack? 0 : have? 1 : 2;
+}
+
+/// Make sure that \a motor (or every motor) has been taught motor slot \a slot
+/** A slot that no motor has is taught with one general call; otherwise the
+ *  motors without it are taught one at a time. Teaching every motor only
+ *  fails if a general call does.
+ */
+static error_t slot_teach( motor_t motor, uint8_t slot )
+{
+	// not glbl.cmd, which the foreground may be using
+	char text[ PARSE_MAX_LEN ];
+	uint16_t bit = 1 << slot;
+	uint8_t lacking = slot_lacking( motor, slot );
+	error_t ret;
+	motor_t i;
+
+	if( !lacking ) return ESUCCESS;
+
+	ret = slot_text( text, slot );
+	if( ret != ESUCCESS ) return ret;
+	STA_START( t );
+
+	if( motor == MOTOR_ALL && lacking == 2 ) {
+		ret = send_command( MOTOR_ALL, NULL, 0, (uint8_t*)text,
+			strlen(text) );
+		if( ret == ESUCCESS )
+			slot_taught( slot, 1 );
+	}else if( motor == MOTOR_ALL ) {
+		ret = ESUCCESS;
+		for( i=0; glbl.mtrs[i].addr; ++i )
+			if( !(glbl.taught[i] & bit) &&
+				send_command(i, NULL, 0, (uint8_t*)text,
+					strlen(text)) == ESUCCESS
+			)
+				glbl.taught[ i ] |= bit;
+	}else {
+		ret = send_command( motor, NULL, 0, (uint8_t*)text,
+			strlen(text) );
+		if( ret == ESUCCESS )
+			glbl.taught[ motor ] |= bit;
+	}
+	STA_STOP( STP_TEACH, t );
+
+	return ret;
+}
+
+/// Teach \a motor (or every motor) a motor slot needed right now
+/** As slot_teach(), counting the lookup in the QRY LIB hits or misses. */
+static error_t slot_need( motor_t motor, uint8_t slot )
+{
+	uint16_t *count = slot_lacking( motor, slot )?
+		&glbl.slot.miss : &glbl.slot.hit;
+
+	if( *count != 0xffff ) ++*count;
+
+	return slot_teach( motor, slot );
+}
+
+/// Find out whether motor slot \a slot holds a defined library entry
+static uint8_t slot_defined( uint8_t slot )
+{
+	rhythm_t rhy;
+	magnitude_t mag;
+
+	if( slot < MAX_RHYTHM )
+		return lib_rhy( glbl.slot.lib[slot], &rhy ) == ESUCCESS;
+	return lib_mag( glbl.slot.lib[slot], &mag ) == ESUCCESS;
+}
+
+/// Tell \a motor (or every motor) the generation tag of its motor slots
+/** Only a motor that has been taught every defined slot is told, so that a
+ *  motor reporting glbl.gen holds all of them; see teach_stale(). A motor
+ *  forgets its tag when taught any one slot, and along with everything else
+ *  when it browns out. Every motor is told with one general call if they
+ *  all qualify, else one at a time.
+ */
+static void gen_send( motor_t motor )
+{
+	// not glbl.cmd, which the foreground may be using
+	char text[ 13 ];
+	uint16_t need = 0;
+	uint8_t slot, all = 1;
+	motor_t i;
+
+	for( slot=0; slot<LIB_SLOTS; ++slot )
+		if( slot_defined(slot) )
+			need |= 1 << slot;
+
+	strcpy( text, "LRN GEN " );
+	itoh( text+8, glbl.gen >> 8 );
+	itoh( text+10, glbl.gen & 0xff );
+
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( (glbl.taught[i] & need) != need || glbl.mtrs[i].err )
+			all = 0;
+
+	if( motor == MOTOR_ALL && all ) {
+		send_command( MOTOR_ALL, NULL, 0, (uint8_t*)text,
+			strlen(text) );
+		return;
+	}
+
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( (motor == MOTOR_ALL || motor == i) &&
+			(glbl.taught[i] & need) == need
+		)
+			send_command( i, NULL, 0, (uint8_t*)text, strlen(text) );
+}
+
+/// Note that a motor has lost everything it was taught, e.g. to a brown-out
+/** The rest of its slots are then taught again by refresh_service(). If a
+ *  different motor did the same less than BROWNOUT_WINDOW ms before, the
+ *  motors most likely browned out together, and probably all of them did,
+ *  so every motor is taught again, with one general call per slot. Until a
+ *  first motor is marked, and again once refresh_service() sees the window
+ *  lapse, glbl.lost is MOTOR_ALL, so that neither boot nor lost_at coming
+ *  round again when millis() wraps looks like a brown-out.
+ */
+static void refresh_mark( motor_t motor )
+{
+	uint16_t now = millis();
+
+	if( glbl.lost != MOTOR_ALL && motor != glbl.lost &&
+		(uint16_t)(now - glbl.lost_at) < BROWNOUT_WINDOW
+	) {
+		memset( glbl.taught, 0, sizeof(glbl.taught) );
+		glbl.brownout = 1;
+	}
+
+	glbl.taught[ motor ] = 0;
+	BIT_SET( glbl.stale, motor );
+	glbl.lost = motor;
+	glbl.lost_at = now;
+}
+
+/// Teach one slot again to a motor that lost what it was taught, if any
+/** After a brown-out the slot goes to every motor with one general call;
+ *  otherwise to the first motor marked by refresh_mark() that lacks one. A
+ *  motor that fails to learn is left to be taught on demand instead. Motors
+ *  left holding every slot are told the generation tag; see gen_send().
+ *
+ *  \return 1 if there was anything to do, 0 if not.
+ */
+static uint8_t refresh_service( void )
+{
+	uint8_t slot;
+	motor_t i;
+
+	// close the brown-out window before lost_at can come round again
+	if( glbl.lost != MOTOR_ALL && (uint16_t)((uint16_t)millis() -
+		glbl.lost_at) >= BROWNOUT_WINDOW
+	)
+		glbl.lost = MOTOR_ALL;
+
+	if( glbl.brownout ) {
+		for( slot=0; slot<LIB_SLOTS; ++slot ) {
+			if( !slot_lacking(MOTOR_ALL, slot) ||
+				!slot_defined(slot)
+			)
+				continue;
+
+			// a general call even for motors taught it since
+			slot_taught( slot, 0 );
+			if( slot_teach(MOTOR_ALL, slot) != ESUCCESS )
+				glbl.brownout = 0;
+			return 1;
+		}
+
+		glbl.brownout = 0;
+		memset( glbl.stale, 0, sizeof(glbl.stale) );
+		gen_send( MOTOR_ALL );
+		return 1;
+	}
+
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		if( !BIT_GET(glbl.stale, i) ) continue;
+
+		for( slot=0; slot<LIB_SLOTS; ++slot ) {
+			if( !slot_lacking(i, slot) || !slot_defined(slot) )
+				continue;
+
+			if( slot_teach(i, slot) != ESUCCESS )
+				BIT_CLR( glbl.stale, i );
+			return 1;
+		}
+
+		BIT_CLR( glbl.stale, i );
+		gen_send( i );
+		return 1;
+	}
+
+	return 0;
+}
+
+/// Turn the library entries of a vibration into motor slots
+/** Changes \a v from the rhythm and magnitude of the library to the motor
+ *  slots that hold them, first teaching \a motor (or every motor) any it has
+ *  not been taught; \a xlib holds the library bits above those in \a v, as
+ *  for ACX_LIB. A vibration of no cycles is left as it is, since it only
+ *  stops the motor.
+ */
+static error_t lib_slot( motor_t motor, vibration_t *v, uint8_t xlib )
+{
+	uint8_t rhy = (xlib >> 4) << 3 | v->rhythm;
+	uint8_t mag = (xlib & 0xf) << 2 | v->magnitude;
+	rhythm_t r;
+	magnitude_t m;
+	error_t ret;
+	uint8_t i;
+
+	if( !v->duration ) return ESUCCESS;
+	if( motor != MOTOR_ALL && (motor >= MAX_MOTORS ||
+		!glbl.mtrs[motor].addr)
+	)
+		return ENOMOTOR;
+
+	// an undefined entry must not take a slot from a defined one
+	ret = lib_rhy( rhy, &r );
+	if( ret != ESUCCESS ) return ret;
+	ret = lib_mag( mag, &m );
+	if( ret != ESUCCESS ) return ret;
+
+	// ages saturate rather than wrap, so a slot left unused for long
+	// never looks recently used
+	for( i=0; i<LIB_SLOTS; ++i )
+		if( glbl.slot.age[i] < SLOT_AGE_MAX ) ++glbl.slot.age[ i ];
+	v->rhythm = slot_find( 0, MAX_RHYTHM, rhy );
+	v->magnitude = slot_find( MAX_RHYTHM, MAX_MAGNITUDE, mag );
+
+	ret = slot_need( motor, v->rhythm );
+	if( ret != ESUCCESS ) return ret;
+	return slot_need( motor, MAX_RHYTHM + v->magnitude );
+}
+
+/// Generate an ASCII representation of the health of a motor
+/** The form is "HLT <MOTOR> <ADDR> <FAILS> <LAST> <STREAK> <Q>", with the
+ *  motor number in decimal from 1, since there may be more motors than ID
+ *  letters, the TWI address in hex (preceded by "<SEGMENT>:" if there is
+ *  more than one segment), and Q 1 while the motor is quarantined.
+ */
+error_t htos( char *into, motor_t which )
+{
+	if( !glbl.mtrs[which].addr ) return ENOMOTOR;
+
+	strcpy( into, "HLT " );
+	into += 4;
+	utoa( which+1, into, 10 );
+	into += strlen( into );
+	*into++ = ' ';
+#if TWI_SEGMENTS > 1
+	*into++ = '0' + glbl.mtrs[which].seg;
+	*into++ = ':';
+#endif
+	itoh( into, glbl.mtrs[which].addr );
+	into += 2;
+	*into++ = ' ';
+	utoa( glbl.hlt[which].fails, into, 10 );
+	into += strlen( into );
+	*into++ = ' ';
+	utoa( glbl.hlt[which].last, into, 10 );
+	into += strlen( into );
+	*into++ = ' ';
+	*into++ = '0' + glbl.hlt[which].streak;
+	*into++ = ' ';
+	*into++ = '0' + glbl.mtrs[which].err;
+	*into = '\0';
+
+	return ESUCCESS;
+}
+
+/// Read the number of steps in a spatio-temporal pattern from EEPROM
+static uint8_t spatio_steps( uint8_t which )
+{
+	uint8_t steps;
+
+	eeprom_read( &steps, &EE_SPT[which].steps, sizeof(steps) );
+
+	// unprogrammed EEPROM reads back as 0xff
+	return steps > MAX_SSTEPS? 0 : steps;
+}
+
+/// Generate an ASCII representation of one step of a spatio-temporal pattern
+error_t stos( char *into, uint8_t which, uint8_t num )
+{
+	spatio_step_t step;
+
+	if( num >= spatio_steps(which) ) return ENOS;
+
+	// retrieve the specified step from EEPROM
+	eeprom_read( &step, &EE_SPT[which].step[num], sizeof(step) );
+
+	strcpy( into, "SPT " );
+	into += 4;
+	*into++ = itol( which );
+	*into++ = ' ';
+	*into++ = itol( num );
+	*into++ = ' ';
+	utoa( step.offset, into, 10 );
+	into += strlen( into );
+	*into++ = ' ';
+	*into++ = itol( step.motor );
+	*into++ = itol( step.v.rhythm );
+	*into++ = itol( step.v.magnitude );
+	*into++ = '0' + step.v.duration;
+	*into = '\0';
+
+	return ESUCCESS;
+}
+
+/// Read the member bitmap of a motor group from EEPROM
+/** \return ENOG if the group is not defined, else ESUCCESS. */
+static error_t group_read( uint8_t which, uint8_t *bits )
+{
+	uint8_t used;
+
+	eeprom_read( &used, &EE_GRP[which].used, sizeof(used) );
+
+	// unprogrammed EEPROM reads back as 0xff
+	if( used != 1 ) return ENOG;
+
+	eeprom_read( bits, EE_GRP[which].bits, MOTOR_BITMAP );
+
+	return ESUCCESS;
+}
+
+/// Generate an ASCII representation of 64 motors' worth of a motor group
+/** The form is "GRP <ID> <FIRST> <HEX>", where FIRST is the number of the
+ *  first motor covered, in decimal from 1, and each bit of HEX is a motor,
+ *  most significant first. Part \a num covers motors 64*num and up.
+ */
+error_t gtos( char *into, const uint8_t *bits, uint8_t which, uint8_t num )
+{
+	uint8_t i, len = MOTOR_BITMAP - num*8;
+
+	if( len > 8 ) len = 8;
+	bits += num*8;
+
+	strcpy( into, "GRP " );
+	into += 4;
+	*into++ = itol( which );
+	*into++ = ' ';
+	utoa( num*64 + 1, into, 10 );
+	into += strlen( into );
+	*into++ = ' ';
+	for( i=0; i<len; ++i, into+=2 ) {
+		// the bitmap is LSB first; the hex is MSB first, like rhythms
+		uint8_t b = bits[i], r = 0, k;
+
+		for( k=0; k<8; ++k, b>>=1 )
+			r = r<<1 | (b & 1);
+		itoh( into, r );
+	}
+
+	return ESUCCESS;
+}
+
+/// Send the vibration in glbl.acmd.v to every motor with a general call
+/** Every motor is taught the rhythm and magnitude first, if need be. */
+static error_t general_activate( void )
+{
+	vibration_t v = glbl.acmd.v;
+	error_t ret;
+
+	ret = lib_slot( MOTOR_ALL, &glbl.acmd.v, glbl.xlib );
+	if( ret == ESUCCESS )
+		ret = send_command( MOTOR_ALL );
+	glbl.acmd.v = v;
+
+	return ret;
+}
+
+/// Activate every motor in a group with the vibration in glbl.acmd.v
+/** A group of every motor present goes out as a single general call (per
+ *  segment). Otherwise the members are written with send_queue(), so the
+ *  bus is never held waiting on one motor's status, and only failed writes
+ *  are reported.
+ */
+static error_t group_activate( uint8_t which )
+{
+	uint8_t bits[ MOTOR_BITMAP ], errors = 0, all = 1;
+	vibration_t v;
+	motor_t i;
+	error_t ret;
+
+	ret = group_read( which, bits );
+	if( ret != ESUCCESS ) return ret;
+	if( !glbl.mtrs[0].addr ) return ENOMOTOR;
+
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( !BIT_GET(bits, i) ) {
+			all = 0;
+			break;
+		}
+	if( all ) return general_activate();
+
+	for( i=0; glbl.mtrs[i].addr; ++i ) {
+		if( !BIT_GET(bits, i) ) continue;
+
+		v = glbl.acmd.v;
+		if( lib_slot(i, &v, glbl.xlib) != ESUCCESS ||
+			send_queue(i, (uint8_t*)&v, sizeof(v)) != ESUCCESS
+		)
+			errors = 1;
+	}
+
+	return errors? EBUS : ESUCCESS;
+}
+
+/// Stop playback of a spatio-temporal pattern
+static inline void spatio_stop( uint8_t which )
+{
+	glbl.play[ which ].next = glbl.play[ which ].steps;
+}
+
+/// Fire any steps of the playing spatio-temporal patterns that have come due
+/** Steps are sent with send_queue() so that the status reads drain in the
+ *  background instead of delaying the next step. If this is called late, all
+ *  of the steps that are due fire at once, so lateness never accumulates
+ *  from one step to the next. Only a motor that must first be taught the
+ *  rhythm or magnitude of a step holds things up; see lib_slot().
+ */
+void spatio_service( void )
+{
+	unsigned long now = millis();
+	uint8_t i;
+
+	for( i=0; i<MAX_SPATIO; ++i ) {
+		spatio_play_t *p = glbl.play + i;
+
+		while( p->next < p->steps && now-p->start >= p->step.offset ) {
+			vibration_t v = p->step.v;
+
+			if( lib_slot(p->step.motor, &v, 0) == ESUCCESS )
+				send_queue( p->step.motor, (uint8_t*)&v,
+					sizeof(v) );
+
+			// cache the following step so polling needs no EEPROM
+			if( ++p->next < p->steps )
+				eeprom_read( &p->step, &EE_SPT[i].step[p->next],
+					sizeof(p->step) );
+		}
+	}
+}
+
+/// Start (or restart) playback of a spatio-temporal pattern
+error_t spatio_start( uint8_t which )
+{
+	spatio_play_t *p;
+
+	if( which >= MAX_SPATIO ) return ENOS;
+	p = glbl.play + which;
+
+	p->steps = spatio_steps( which );
+	if( !p->steps ) return ENOS;
+
+	eeprom_read( &p->step, &EE_SPT[which].step[0], sizeof(p->step) );
+	p->next = 0;
+	p->start = millis();
+
+	// fire any steps at offset 0 right away
+	spatio_service();
+
+	return ESUCCESS;
+}
+
+/// Relay the rhythms and magnitudes the motor slots hold to a motor
+// if motor is specified as MOTOR_ALL, send to all motors
+// must be called in learning mode, since the commands go in glbl.cmd
+// motors that learn all of them are then told the generation tag
+void teach_motor( motor_t motor )
+{
+	uint8_t i, ok, n = 0;
+
+	if( motor != MOTOR_ALL && glbl.mtrs[motor].err ) return;
+
+	for( i=0; i<LIB_SLOTS; ++i ) {
+		if( slot_text(glbl.cmd, i) != ESUCCESS )
+			continue;
+		DBGN( glbl.cmd );
+		if( motor == MOTOR_ALL )
+		{
+			ok = send_command_gcl() == ESUCCESS;
+			slot_taught( i, ok );
+		}else {
+			ok = send_command( motor ) == ESUCCESS;
+			glbl.taught[ motor ] &= ~(1 << i);
+			glbl.taught[ motor ] |= ok << i;
+		}
+		n += ok;
+	}
+	gen_send( motor );
+	TRC( TRE_TEACH, n, motor );
+}
+
+/// Teach the motors that do not hold what the motor slots do
+/** Each motor reports the generation tag it was last told after its status
+ *  byte; see gen_send(). One that reports glbl.gen is known to hold every
+ *  slot, so a boot or a change of motors costs one read per motor, plus
+ *  teaching only the rest. They are taught one at a time if they are no
+ *  more than half of the motors; otherwise every motor is taught, with a
+ *  general call per slot. Must be called in learning mode; see
+ *  teach_motor().
+ */
+static void teach_stale( void )
+{
+	uint8_t tag[ 2 ], lack[ MOTOR_BITMAP ], slot;
+	uint16_t need = 0;
+	motor_t i, n, stale = 0;
+
+	for( slot=0; slot<LIB_SLOTS; ++slot )
+		if( slot_defined(slot) )
+			need |= 1 << slot;
+
+	memset( lack, 0, sizeof(lack) );
+	for( n=0; glbl.mtrs[n].addr; ++n ) {
+		// a motor that does not answer keeps 0xff, i.e. GEN_NONE
+		memset( tag, 0xff, sizeof(tag) );
+		if( !glbl.mtrs[n].err )
+			read_status( twi_motor(n), tag, sizeof(tag) );
+
+		if( (uint16_t)(tag[0] << 8 | tag[1]) == glbl.gen )
+			glbl.taught[ n ] = need;
+		else {
+			glbl.taught[ n ] = 0;
+			BIT_SET( lack, n );
+			++stale;
+		}
+	}
+	DBG( "stale motors " );
+	DBGCN( stale, DEC );
+
+	if( 2*stale > n ) {
+		teach_motor( MOTOR_ALL );
+		return;
+	}
+	for( i=0; i<n; ++i )
+		if( BIT_GET(lack, i) )
+			teach_motor( i );
+}
+
+/// Queue the command in glbl.acmd to be sent at the time of the last ACX_AT
+/** The queue is a binary min-heap on the due time. All of the times in it
+ *  are within 8 s of now, so comparing them by their 16-bit difference is
+ *  safe across the wrap of millis().
+ */
+static error_t sched_add( motor_t motor )
+{
+	sched_t *q = glbl.sch.q;
+	uint8_t i, up;
+
+	if( motor != MOTOR_ALL && !glbl.mtrs[motor].addr ) return ENOMOTOR;
+	if( glbl.sch.len >= SCHED_MAX ) return EQFULL;
+
+	// sift the hole up from the end until the new command fits in it
+	for( i=glbl.sch.len++; i; i=up ) {
+		up = (i-1) / 2;
+		if( (int16_t)(q[up].at - glbl.sch.at) <= 0 ) break;
+		q[ i ] = q[ up ];
+	}
+	q[ i ].at = glbl.sch.at;
+	q[ i ].motor = motor;
+	q[ i ].v = glbl.acmd.v;
+	q[ i ].xlib = glbl.xlib;
+
+	return ESUCCESS;
+}
+
+/// Remove the earliest command from the schedule queue
+static void sched_pop( void )
+{
+	sched_t *q = glbl.sch.q, last = q[ --glbl.sch.len ];
+	uint8_t i, down;
+
+	// sift the hole down from the top until the last command fits in it
+	for( i=0; (down = 2*i+1) < glbl.sch.len; i=down ) {
+		if( down+1 < glbl.sch.len &&
+			(int16_t)(q[down+1].at - q[down].at) < 0
+		)
+			++down;
+		if( (int16_t)(last.at - q[down].at) <= 0 ) break;
+		q[ i ] = q[ down ];
+	}
+	q[ i ] = last;
+}
+
+/// Send any scheduled commands that have come due
+/** Like spatio_service(), each is sent with its own copy of the vibration,
+ *  and individual motors with send_queue(), so that nothing here touches
+ *  the foreground's buffers or waits for a status, unless a motor has to be
+ *  taught a rhythm or magnitude first. The library entries are looked up
+ *  only now, so that the motor slots may change while a command waits.
+ *  Lateness is counted in the STP_SCHED histogram.
+ */
+void sched_service( void )
+{
+	uint16_t now;
+	sched_t e;
+
+	if( !glbl.sch.len ) return;
+	now = millis();
+
+	while( glbl.sch.len && (int16_t)(now - glbl.sch.q[0].at) >= 0 ) {
+		e = glbl.sch.q[ 0 ];
+		sched_pop();
+#ifdef STATS
+		stats_add( STP_SCHED, (uint16_t)(now - e.at) * 1000UL );
+#endif
+
+		if( lib_slot(e.motor, &e.v, e.xlib) != ESUCCESS )
+			continue;
+		if( e.motor == MOTOR_ALL )
+			send_general( (uint8_t*)&e.v, sizeof(e.v) );
+		else	send_queue( e.motor, (uint8_t*)&e.v, sizeof(e.v) );
+	}
+}
+
+static error_t reliable_send( motor_t motor, vibration_t v, uint8_t xlib );
+
+/// Send the oldest cue and take it out of line; see cue_add()
+/** The cue goes out the way an activation that was not held back would,
+ *  through reliable_send(), so that a motor that browned out is taught
+ *  again and sent the cue once more. The host has had a status for it
+ *  already, so a cue that fails even so is counted in glbl.cue.failed, and
+ *  traced with its status.
+ */
+static void cue_send( void )
+{
+	cue_t e = glbl.cue.q[ glbl.cue.head ];
+	error_t ret;
+
+	glbl.cue.head = ( glbl.cue.head + 1 ) % CUE_MAX;
+	--glbl.cue.len;
+
+	ret = reliable_send( e.motor, e.v, e.xlib );
+	if( ret != ESUCCESS ) {
+		if( glbl.cue.failed != 0xffff ) ++glbl.cue.failed;
+		TRC( TRE_CUE, ret, e.motor );
+	}
+}
+
+/// Hold the vibration in glbl.acmd for \a motor until the bus is free
+/** Used once more than CUE_BACKLOG commands are waiting on the serial link,
+ *  and for as long as any cue is held, so that they are read in without
+ *  waiting for the bus. A motor holds at most one cue:
+ *  a newer vibration replaces one not yet sent, latest wins, and EOVRLD
+ *  tells the host that it is sending faster than the bus can keep up. A
+ *  replaced cue keeps its place in line.
+ *
+ *  A cue is checked the way reliable_activate() would check it, and its
+ *  status given at once; see cue_service() for what happens to it after.
+ *  With CUE_MAX motors holding cues, a vibration for another motor is
+ *  refused with EQFULL and counted as dropped, rather than waiting for the
+ *  bus behind the rest.
+ */
+static error_t cue_add( motor_t motor )
+{
+	uint8_t rhy = (glbl.xlib >> 4) << 3 | glbl.acmd.v.rhythm;
+	uint8_t mag = (glbl.xlib & 0xf) << 2 | glbl.acmd.v.magnitude;
+	rhythm_t r;
+	magnitude_t m;
+	error_t ret;
+	cue_t *c;
+	uint8_t i;
+
+	if( !glbl.mtrs[motor].addr ) return ENOMOTOR;
+	if( glbl.mtrs[motor].err ) return (error_t)glbl.hlt[motor].last;
+	if( glbl.acmd.v.duration ) {
+		ret = lib_rhy( rhy, &r );
+		if( ret != ESUCCESS ) return ret;
+		ret = lib_mag( mag, &m );
+		if( ret != ESUCCESS ) return ret;
+	}
+
+	for( i=0; i<glbl.cue.len; ++i ) {
+		c = glbl.cue.q + ( glbl.cue.head + i ) % CUE_MAX;
+		if( c->motor != motor ) continue;
+
+		c->v = glbl.acmd.v;
+		c->xlib = glbl.xlib;
+		if( glbl.cue.coalesced != 0xffff ) ++glbl.cue.coalesced;
+		return EOVRLD;
+	}
+
+	if( glbl.cue.len >= CUE_MAX ) {
+		if( glbl.cue.dropped != 0xffff ) ++glbl.cue.dropped;
+		return EQFULL;
+	}
+	c = glbl.cue.q + ( glbl.cue.head + glbl.cue.len++ ) % CUE_MAX;
+	c->motor = motor;
+	c->v = glbl.acmd.v;
+	c->xlib = glbl.xlib;
+
+	return ESUCCESS;
+}
+
+/// Send the oldest cue, unless another command is waiting to be read
+/** Commands on the serial link come first, since they may replace a cue. */
+void cue_service( void )
+{
+	if( glbl.cue.len &&
+		Serial.available() < (int)sizeof(active_command_t)
+	)
+		cue_send();
+}
+
+/// Send every cue still held, oldest first
+/** Done before any command that is not a single vibration, so that a cue
+ *  never goes out after a command that came in after it.
+ */
+static void cue_flush( void )
+{
+	while( glbl.cue.len )
+		cue_send();
+}
+
+/// Background work: the cooperative tasks that share the main loop
+/** Each task does a small, bounded piece of work and returns, so that serial
+ *  input is never kept waiting for long. Called from every pass of loop(),
+ *  and from anything that has to wait for the serial link.
+ */
+static inline void background( void )
+{
+	sched_service();
+	cue_service();
+	spatio_service();
+	if( !send_drain() && !refresh_service() && !health_service() )
+		sweep_motors();
+}
+
+/// Convert a character read from the serial link, echoing it if requested
+/** Converts '\\r' to '\\n'. If \a echo is non-zero, echo the character back
+ *  over the serial link, converting '\\r' to "\r\n" in the echo only.
+ */
+static inline char take_char( char ch, uint8_t echo )
+{
+	if( echo ) {
+		Serial.print(ch);
+		if( ch == '\r' ) Serial.print( '\n' );
+	}
+
+	return ch=='\r'? '\n' : ch;
+}
+
+/// Read a single character from the serial link
+/** Waits until a character arrives, doing background() work meanwhile. See
+ *  take_char() for the conversions done.
+ */
+static inline char read_char( uint8_t echo )
+{
+	while( !Serial.available() )
+		background();
+
+	return take_char( Serial.read(), echo );
+}
+
+/// Switch the serial link to the rate in glbl.baud, if one is waiting
+/** Done only once everything sent at the old rate has gone out. */
+static inline void set_baud( void )
+{
+	if( !glbl.baud ) return;
+
+	Serial.flush();
+	Serial.begin( glbl.baud );
+	glbl.baud = 0;
+}
+
+/// Print an error_t status value to the serial link, in the form "STS x\n"
+static inline void print_status( error_t status )
+{
+	Serial.print( "STS " );
+	Serial.println( status, DEC );
+}
+
+/// Add whatever serial input is waiting to the line in glbl.cmd
+/** Never waits for input. Lines that are too long are discarded up to their
+ *  newline and reported with ETOOBIG.
+ *
+ *  \return 1 once a whole line is in glbl.cmd, null-terminated; else 0.
+ */
+uint8_t poll_line( void )
+{
+	while( Serial.available() ) {
+		char ch = take_char( Serial.read(), glbl.echo );
+
+		if( ch != '\n' ) {
+			if( glbl.rx_len < sizeof(glbl.cmd) )
+				glbl.cmd[ glbl.rx_len++ ] = ch;
+			else	glbl.rx_over = 1;
+			continue;
+		}
+
+		// if the line was too long, return an error
+		if( glbl.rx_over || glbl.rx_len >= sizeof(glbl.cmd) ) {
+			if( glbl.echo )
+				print_flash( errstr(ETOOBIG) );
+			else
+				print_status( ETOOBIG );
+			glbl.rx_len = glbl.rx_over = 0;
+			continue;
+		}
+
+		glbl.cmd[ glbl.rx_len ] = '\0';
+		glbl.rx_len = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/// Add whatever serial input is waiting to the active command in glbl.acmd
+/** Never waits for input. Reads 2 raw bytes, or in raw command mode (echo
+ *  on) 4 ASCII hex digits.
+ *
+ *  \return 1 once a whole command is in glbl.acmd; else 0.
+ */
+uint8_t poll_active( void )
+{
+	uint8_t *into = (uint8_t*)&glbl.acmd;
+
+	while( Serial.available() ) {
+		if( !glbl.rx_len )
+			STA_MARK( glbl.sta.rx );
+
+		if( glbl.echo ) {
+			// two hex digits per byte, most significant first
+			uint8_t digit = htoi( take_char(Serial.read(), 1) );
+
+			if( glbl.rx_len & 1 )
+				into[ glbl.rx_len/2 ] |= digit;
+			else	into[ glbl.rx_len/2 ] = digit << 4;
+			if( ++glbl.rx_len < 2*sizeof(active_command_t) )
+				continue;
+		}else {
+			into[ glbl.rx_len ] = Serial.read();
+			if( ++glbl.rx_len < sizeof(active_command_t) )
+				continue;
+		}
+
+		glbl.rx_len = 0;
+		STA_STOP( STP_RX, glbl.sta.rx );
+		return 1;
+	}
+
+	return 0;
+}
+
+/// Send a frame to the host; see frame.h
+static void frame_send( uint8_t type, uint8_t seq, const uint8_t *data,
+	uint8_t len
+) {
+	uint8_t hdr[] = { type, seq, len }, i;
+	uint16_t crc = 0;
+
+	for( i=0; i<sizeof(hdr); ++i )
+		crc = _crc_xmodem_update( crc, hdr[i] );
+	for( i=0; i<len; ++i )
+		crc = _crc_xmodem_update( crc, data[i] );
+
+	Serial.write( FRM_SOF );
+	Serial.write( hdr, sizeof(hdr) );
+	Serial.write( data, len );
+	Serial.write( crc >> 8 );
+	Serial.write( crc & 0xff );
+}
+
+/// Ask the host to resend from the next frame expected
+/** Only one NAK is sent per missing frame, so that a burst of frames sent
+ *  after a lost one does not turn into a burst of NAKs.
+ */
+static void frame_nak( void )
+{
+	if( glbl.frm.naked ) return;
+
+	glbl.frm.naked = 1;
+	frame_send( FRT_NAK, glbl.frm.next, NULL, 0 );
+}
+
+/// Add whatever serial input is waiting to the frame in glbl.frm
+/** Never waits for input. Damaged, stalled and out-of-sequence frames are
+ *  dropped and NAKed, and repeats of frames already handled are acked
+ *  again; see frame.h.
+ *
+ *  \return 1 once the next frame in sequence is in glbl.frm; else 0.
+ */
+uint8_t poll_frame( void )
+{
+	uint16_t now = millis();
+
+	// give up on a frame that stopped part way, e.g. at a dropped byte
+	if( glbl.frm.state != FRS_SOF &&
+		(uint16_t)(now - glbl.frm.last) > FRM_TIMEOUT
+	) {
+		glbl.frm.state = FRS_SOF;
+		frame_nak();
+	}
+
+	while( Serial.available() ) {
+		uint8_t ch = Serial.read();
+
+		glbl.frm.last = now;
+		if( glbl.frm.state > FRS_SOF && glbl.frm.state < FRS_CRCH )
+			glbl.frm.crc = _crc_xmodem_update( glbl.frm.crc, ch );
+
+		switch( glbl.frm.state ) {
+		case FRS_SOF:
+			if( ch == FRM_SOF ) {
+				glbl.frm.crc = 0;
+				glbl.frm.state = FRS_TYPE;
+				STA_MARK( glbl.sta.rx );
+			}
+			break;
+		case FRS_TYPE:
+			if( ch == FRT_CMD )
+				glbl.frm.state = FRS_SEQ;
+			else if( ch == FRM_SOF )
+				glbl.frm.crc = 0;
+			else	glbl.frm.state = FRS_SOF;
+			break;
+		case FRS_SEQ:
+			glbl.frm.seq = ch;
+			glbl.frm.state = FRS_LEN;
+			break;
+		case FRS_LEN:
+			if( ch > FRM_MAX_LEN || ch % sizeof(active_command_t) ) {
+				glbl.frm.state = FRS_SOF;
+				frame_nak();
+				break;
+			}
+			glbl.frm.len = ch;
+			glbl.frm.pos = 0;
+			glbl.frm.state = ch? FRS_DATA : FRS_CRCH;
+			break;
+		case FRS_DATA:
+			glbl.frm.buf[ glbl.frm.pos++ ] = ch;
+			if( glbl.frm.pos == glbl.frm.len )
+				glbl.frm.state = FRS_CRCH;
+			break;
+		case FRS_CRCH:
+			glbl.frm.rx = ch << 8;
+			glbl.frm.state = FRS_CRCL;
+			break;
+		case FRS_CRCL:
+			glbl.frm.state = FRS_SOF;
+			if( (glbl.frm.rx | ch) != glbl.frm.crc )
+				frame_nak();
+			else if( glbl.frm.seq == glbl.frm.next ) {
+				glbl.frm.naked = 0;
+				STA_STOP( STP_RX, glbl.sta.rx );
+				return 1;
+			}else if( (uint8_t)(glbl.frm.next-glbl.frm.seq) <= FRM_WINDOW )
+				// already handled, but the ack went missing
+				frame_send( FRT_ACK, glbl.frm.seq, NULL, 0 );
+			else
+				frame_nak();
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/// Read a line of text from serial link into the global ASCII command buffer
+void read_line( void )
+{
+	while( !poll_line() )
+		background();
+}
+
+/// Read the next active command into glbl.acmd, in raw or hex form
+/** Used where a command has to finish reading more input before it can
+ *  complete, e.g. the tuples of a batched frame. See poll_active().
+ */
+void read_active( void )
+{
+	while( !poll_active() )
+		background();
+}
+
+// command handlers
+
+/// Teach all motors library entry \a which again, if a motor slot holds it
+/** The slot is searched for among the \a n starting at \a base, and the
+ *  motors that learn it are then told the new generation tag. Otherwise the
+ *  entry is only taught once it is used; see lib_slot().
+ */
+static void learn_relay( uint8_t base, uint8_t n, uint8_t which )
+{
+	uint8_t i;
+
+	for( i=base; i<base+n; ++i ) {
+		if( glbl.slot.lib[i] != which ) continue;
+
+		slot_text( glbl.cmd, i );
+		slot_taught( i, send_command_gcl() == ESUCCESS );
+		gen_send( MOTOR_ALL );
+		return;
+	}
+}
+
+/// Handle the LRN RHY command. Stores a rhythm in EEPROM and teaches motors.
+error_t learn_rhythm( const char *line, int argc, const parse_span_t *argv )
+{
+	rhythm_t rhy;
+	uint8_t which;
+	error_t ret;
+
+	// parse the rhythm and store it in EEPROM
+	ret = parse_rhythm( line, argc, argv, LIB_RHYTHMS, &rhy );
+	if( ret != ESUCCESS ) return ret;
+
+	which = parse_id( argp(0), argl(0) );
+	if( which < MAX_RHYTHM ) {
+		glbl.lib.rhy[ which ] = rhy;
+		glbl.lib_dirty |= LIB_RHY_BIT( which );
+		lib_flush();
+	}else	eeprom_write( EE_XRHY + which-MAX_RHYTHM, &rhy, sizeof(rhy) );
+	lib_gen();
+
+	// relay the learn to all connected motors
+	DBG( "relaying rhythm:" );
+	learn_relay( 0, MAX_RHYTHM, which );
+
+	return ret;
+}
+
+/// Handle the LRN MAG command. Stores magnitude in EEPROM and teaches motors.
+error_t learn_magnitude( const char *line, int argc, const parse_span_t *argv )
 {
 	magnitude_t mag;
+	uint8_t which;
+	error_t ret;
+
+	// parse the magnitude and store it in EEPROM
+	ret = parse_magnitude( line, argc, argv, LIB_MAGNITUDES, &mag );
+	if( ret != ESUCCESS ) return ret;
+
+	which = parse_id( argp(0), argl(0) );
+	if( which < MAX_MAGNITUDE ) {
+		glbl.lib.mag[ which ] = mag;
+		glbl.lib_dirty |= LIB_MAG_BIT( which );
+		lib_flush();
+	}else	eeprom_write( EE_XMAG + which-MAX_MAGNITUDE, &mag, sizeof(mag) );
+	lib_gen();
+
+	// relay the learn to all connected motors
+	DBG( "relaying magnitude:" );
+	learn_relay( MAX_RHYTHM, MAX_MAGNITUDE, which );
+
+	return ret;
+}
+
+/// Handle the LRN SPT command. Stores one step of a pattern in EEPROM.
+/** With two arguments, \<ID> \<STEPS>, shortens the pattern to the given
+ *  number of steps instead; 0 erases it. Steps must be defined in order, and
+ *  the offset of each step must lie between the offsets of its neighbours.
+ */
+error_t learn_spatio( const char *line, int argc, const parse_span_t *argv )
+{
+	spatio_step_t step, near;
+	uint8_t which, num, steps;
+	error_t ret;
+
+	if( argc == 2 ) {
+		if( argl(0) != 1 || ltoi(0) >= MAX_SPATIO ) return EARG;
+		which = ltoi(0);
+		steps = atoi( argp(1) );
+		if( steps > spatio_steps(which) ) return EINVS;
+
+		spatio_stop( which );
+		eeprom_write( &EE_SPT[which].steps, &steps, sizeof(steps) );
+
+		return ESUCCESS;
+	}
+
+	ret = parse_spatio( line, argc, argv, &num, &step );
+	if( ret != ESUCCESS ) return ret;
+	if( step.motor >= MAX_MOTORS ) return EINVS;
+
+	which = ltoi(0);
+	steps = spatio_steps( which );
+	if( num > steps ) return EINVS;
+
+	// keep the steps in firing order
+	if( num > 0 ) {
+		eeprom_read( &near, &EE_SPT[which].step[num-1], sizeof(near) );
+		if( near.offset > step.offset ) return EINVS;
+	}
+	if( num+1 < steps ) {
+		eeprom_read( &near, &EE_SPT[which].step[num+1], sizeof(near) );
+		if( near.offset < step.offset ) return EINVS;
+	}
+
+	spatio_stop( which );
+	eeprom_write( &EE_SPT[which].step[num], &step, sizeof(step) );
+	if( num == steps ) {
+		++steps;
+		eeprom_write( &EE_SPT[which].steps, &steps, sizeof(steps) );
+	}
+
+	return ESUCCESS;
+}
+
+/// Handle the LRN GRP command. Adds motors to a group, or erases it.
+/** The arguments are \<ID> \<FIRST> \<HEX>, where FIRST is the number of a
+ *  motor in decimal from 1, and each bit of HEX sets or clears one motor
+ *  from FIRST on, most significant bit first. Motors not covered by HEX are
+ *  left as they were. With \<ID> alone, the group is erased.
+ */
+error_t learn_group( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t bits[ MOTOR_BITMAP ], which, i, one = 1;
+	uint16_t first;
+
+	if( argc != 1 && argc != 3 ) return EARG;
+	if( argl(0) != 1 || ltoi(0) >= MAX_GROUPS ) return EARG;
+	which = ltoi(0);
+
+	if( argc == 1 ) {
+		eeprom_zero( EE_GRP+which, EE_GRP+which+1 );
+		return ESUCCESS;
+	}
+
+	first = atoi( argp(1) );
+	if( !first || first-1 + argl(2)*4 > MAX_MOTORS ) return EARG;
+	for( i=0; i<argl(2); ++i )
+		if( htoi(argp(2)[i]) == -1 ) return EARG;
+
+	if( group_read(which, bits) != ESUCCESS )
+		memset( bits, 0, sizeof(bits) );
+	for( i=0; i<argl(2)*4; ++i ) {
+		uint16_t motor = first-1 + i;
+
+		if( htoi(argp(2)[i/4]) & (8 >> (i%4)) )
+			BIT_SET( bits, motor );
+		else	BIT_CLR( bits, motor );
+	}
+
+	eeprom_write( EE_GRP[which].bits, bits, sizeof(bits) );
+	eeprom_write( &EE_GRP[which].used, &one, sizeof(one) );
+
+	return ESUCCESS;
+}
+
+/// Byte \a i of the EEPROM image sent by QRY CFG, after CFG_VER
+static uint8_t cfg_byte( uint16_t i )
+{
+	if( i < sizeof(glbl.lib) )
+		return ((uint8_t*)&glbl.lib)[ i ];
+	return EEPROM.read( (size_t)EE_XRHY + i-sizeof(glbl.lib) );
+}
+
+/// Check every rhythm and magnitude of the LRN CFG image staged at EE_CFG
+/** Each must be undefined (see lib_rhy() and lib_mag()) or pass the same
+ *  checks as parse_rhythm() and parse_magnitude(). Entries are read one at
+ *  a time, so the image is never all in SRAM.
+ */
+static error_t cfg_check( void )
+{
+	uint8_t *xrhy = EE_CFG + sizeof(glbl.lib);
+	uint8_t *xmag = xrhy + (LIB_RHYTHMS-MAX_RHYTHM)*sizeof(rhythm_t);
+	rhythm_t r;
+	magnitude_t m;
+	uint8_t i;
+
+	for( i=0; i<LIB_RHYTHMS; ++i ) {
+		eeprom_read( &r, i<MAX_RHYTHM?
+			EE_CFG + sizeof(glbl.lib.mag) + i*sizeof(r) :
+			xrhy + (i-MAX_RHYTHM)*sizeof(r), sizeof(r) );
+		if( r.bits > MAX_RBITS && r.bits != 0xff ) return EINVR;
+	}
+	for( i=0; i<LIB_MAGNITUDES; ++i ) {
+		eeprom_read( &m, i<MAX_MAGNITUDE? EE_CFG + i*sizeof(m) :
+			xmag + (i-MAX_MAGNITUDE)*sizeof(m), sizeof(m) );
+		if( !m.period || m.period == 0xffff ) continue;
+		if( m.duty > m.period || m.duty < 2 ) return EINVM;
+	}
+
+	return ESUCCESS;
+}
+
+/// Copy the LRN CFG image staged at EE_CFG into place, then clear EE_CFG_OK
+/** learn_config() sets EE_CFG_OK once the image has been checked, and calls
+ *  this; setup() calls it again if EE_CFG_OK is still set, because a reset
+ *  came in the middle of the copy. The staged image is left as it was, so
+ *  copying it again finishes the job.
+ */
+static void cfg_install( void )
+{
+	uint8_t done = 0;
+
+	eeprom_copy( EE_MAG, EE_CFG, sizeof(glbl.lib) );
+	eeprom_copy( EE_XRHY, EE_CFG + sizeof(glbl.lib),
+		CFG_LEN-1-sizeof(glbl.lib) );
+	eeprom_write( EE_CFG_OK, &done, 1 );
+}
+
+/// Wait for the next byte of a LRN CFG image; 0 if none came in CFG_TIMEOUT
+static uint8_t cfg_wait( void )
+{
+	unsigned long last;
+
+	for( last=millis(); !Serial.available(); background() )
+		if( millis() - last > CFG_TIMEOUT ) return 0;
+	return 1;
+}
+
+/// Handle the LRN CFG command. Replaces the whole library in one transfer.
+/** The arguments are \<LEN> \<CRC>: LEN in decimal is the number of bytes
+ *  of the image, which must be CFG_LEN, and CRC is their CRC-16/XMODEM in
+ *  four hex digits. The bytes are the image sent by QRY CFG.
+ *
+ *  The host sends the image after the end of the line, CFG_CHUNK bytes at a
+ *  time, each time the controller sends CFG_XON; it sends nothing more once
+ *  the status line arrives instead. Each chunk is staged in EEPROM at EE_CFG
+ *  before the next is asked for, so the 64-byte RX buffer never overruns
+ *  and the image never has to fit in SRAM: a fresh image takes about 3.3 ms
+ *  a byte to stage, and as long again to copy into place.
+ *
+ *  If the host stops partway through a chunk for longer than CFG_TIMEOUT,
+ *  the rest of that chunk is read and dropped as it comes, so that it is
+ *  not taken for learning mode lines.
+ *
+ *  Nothing is stored unless the whole image arrives intact and every entry
+ *  in it checks out; then the library is copied into place, and the motor
+ *  slots are set back to the first MAX_RHYTHM rhythms and MAX_MAGNITUDE
+ *  magnitudes and taught to every motor at once, one general call each.
+ *  EE_CFG_OK is set for the length of the copy, so that a reset in the
+ *  middle of it cannot leave half of each library in place; see
+ *  cfg_install().
+ */
+error_t learn_config( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t buf[ CFG_CHUNK ], j, n, ok = CFG_OK;
+	uint16_t i, crc = 0, want = 0;
 	error_t ret;
 
-	// parse the magnitude and store it in EEPROM
-	ret = parse_magnitude( argc, argv, &mag );
+	if( argc != 2 || argl(1) != 4 ) return EARG;
+	for( i=0; i<4; ++i ) {
+		if( htoi(argp(1)[i]) == -1 ) return EARG;
+		want = want << 4 | htoi( argp(1)[i] );
+	}
+	if( atoi(argp(0)) != CFG_LEN ) return ECFG;
+
+	// argp() points into glbl.cmd, which background() may reuse from here
+	for( i=0; i<CFG_LEN; i+=n ) {
+		n = CFG_LEN-i < CFG_CHUNK? CFG_LEN-i : CFG_CHUNK;
+		Serial.write( CFG_XON );
+		for( j=0; j<n; ++j ) {
+			if( !cfg_wait() ) {
+				for( ; j<n && cfg_wait(); ++j )
+					Serial.read();
+				return ECFG;
+			}
+			buf[ j ] = Serial.read();
+			crc = _crc_xmodem_update( crc, buf[j] );
+		}
+
+		if( i )
+			eeprom_write( EE_CFG + i-1, buf, n );
+		else if( buf[0] == CFG_VER )
+			eeprom_write( EE_CFG, buf+1, n-1 );
+		else	return ECFG;
+	}
+
+	if( crc != want ) return ECFG;
+	ret = cfg_check();
 	if( ret != ESUCCESS ) return ret;
 
-	eeprom_write( EE_MAG+(ltoi(0)), &mag, sizeof(mag) );
+	eeprom_write( EE_CFG_OK, &ok, 1 );
+	cfg_install();
+	lib_load();
 
-	// relay the learn to all connected motors
-	DBG( "relaying magnitude:" );
-	send_command_all();
+	DBG( "teaching library:" );
+	memset( glbl.taught, 0, sizeof(glbl.taught) );
+	memset( glbl.stale, 0, sizeof(glbl.stale) );
+	teach_motor( MOTOR_ALL );
 
-	return ret;
+	return ESUCCESS;
 }
 
-error_t learn_spatio( int argc, const char *const *argv )
-{ return EMISSING; }
+/// Handle the LRN BUS command. Calibrates the TWI rate of every segment.
+/** Every motor is sent the bus_test() command at each rate in turn, which
+ *  stops any that are vibrating. The rates found are saved, and used from
+ *  then on; see QRY BUS.
+ */
+error_t learn_bus( const char *line, int argc, const parse_span_t *argv )
+{
+	if( argc ) return EARG;
+
+	bus_start( 1 );
+
+	return ESUCCESS;
+}
 
-error_t learn_address( int argc, const char *const *argv )
+error_t learn_address( const char *line, int argc, const parse_span_t *argv )
 { return EMISSING; }
 
 /// Common work shared by query_rhythm() / query_magnitude()
-error_t query_generic( int argc, const char *const *argv,
+error_t query_generic( const char *line, int argc, const parse_span_t *argv,
 	uint8_t max, error_t (*func)( char*, uint8_t )
 ) {
 	uint8_t start, finish;
@@ -414,7 +2478,7 @@ error_t query_generic( int argc, const char *const *argv,
 	if( argc > 1 ) return EARG;
 
 	if( argc > 0 ) {
-		start = ltoi(0);
+		start = parse_id( argp(0), argl(0) );
 		finish = start + 1;
 		if( start >= max )
 			return EARG;
@@ -434,20 +2498,81 @@ error_t query_generic( int argc, const char *const *argv,
 }
 
 /// Handle the QRY RHY command. Prints all stored rhythms to the serial link.
-error_t query_rhythm( int argc, const char *const *argv )
-{ return query_generic( argc, argv, MAX_RHYTHM, rtos ); }
+error_t query_rhythm( const char *line, int argc, const parse_span_t *argv )
+{ return query_generic( line, argc, argv, LIB_RHYTHMS, rtos ); }
 
 /// Handle the QRY MAG command. Prints all stored magnitudes to serial link.
-error_t query_magnitude( int argc, const char *const *argv )
-{ return query_generic( argc, argv, MAX_MAGNITUDE, mtos ); }
+error_t query_magnitude( const char *line, int argc, const parse_span_t *argv )
+{ return query_generic( line, argc, argv, LIB_MAGNITUDES, mtos ); }
 
-error_t query_spatio( int argc, const char *const *argv )
-{ return EMISSING; }
+/// Handle the QRY SPT command. Prints every step of the stored patterns.
+error_t query_spatio( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t start, finish, num;
+
+	if( argc > 1 ) return EARG;
+
+	if( argc > 0 ) {
+		start = ltoi(0);
+		finish = start + 1;
+		if( start >= MAX_SPATIO )
+			return EARG;
+	}else {
+		start = 0;
+		finish = MAX_SPATIO;
+	}
+
+	strcpy( glbl.cmd, "RSP " );
+	for( ; start<finish; ++start )
+		for( num=0; stos(glbl.cmd+4, start, num) == ESUCCESS; ++num )
+			Serial.println( glbl.cmd );
+
+	return ESUCCESS;
+}
+
+/// Handle the QRY GRP command. Prints the members of the stored groups.
+/** Each group is printed 64 motors to a line, see gtos(), leaving out lines
+ *  with no members after the first.
+ */
+error_t query_group( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t bits[ MOTOR_BITMAP ], start, finish, num, i;
+
+	if( argc > 1 ) return EARG;
+
+	if( argc > 0 ) {
+		start = ltoi(0);
+		finish = start + 1;
+		if( start >= MAX_GROUPS )
+			return EARG;
+	}else {
+		start = 0;
+		finish = MAX_GROUPS;
+	}
+
+	strcpy( glbl.cmd, "RSP " );
+	for( ; start<finish; ++start ) {
+		if( group_read(start, bits) != ESUCCESS ) continue;
+
+		for( num=0; num*8 < MOTOR_BITMAP; ++num ) {
+			uint8_t any = !num;
+
+			for( i=num*8; i<num*8+8 && i<MOTOR_BITMAP; ++i )
+				any |= bits[ i ];
+			if( !any ) continue;
+
+			gtos( glbl.cmd+4, bits, start, num );
+			Serial.println( glbl.cmd );
+		}
+	}
+
+	return ESUCCESS;
+}
 
 /// Handle the QRY MTR command. Prints the number of attached motors.
-error_t query_motors( int argc, const char *const *argv )
+error_t query_motors( const char *line, int argc, const parse_span_t *argv )
 {
-	uint8_t num_motors, old_num;
+	motor_t num_motors, i;
 
 	if( argc ) return EARG;
 
@@ -455,10 +2580,13 @@ error_t query_motors( int argc, const char *const *argv )
 	// do it here instead of automatically with a periodic TWI poll,
 	// because the high-level app will have to change its behavior to
 	// accommodate the hardware change
-	for( old_num=0; glbl.mtrs[old_num].addr; ++old_num );
-	num_motors = detect_motors();
-	if( num_motors != old_num )
-		teach_motor(-1);
+	// the address space is swept in the background, so this only has
+	// to re-probe the known motors and teach the new ones, if they do
+	// not already hold the library from before
+	num_motors = detect_motors( 0 );
+	for( i=0; i<num_motors && !BIT_GET(glbl.fresh, i); ++i );
+	if( i < num_motors || glbl.removed )
+		teach_stale();
 
 	strcpy( glbl.cmd, "RSP MTR " );
 	utoa( num_motors, glbl.cmd+8, 10 );
@@ -468,8 +2596,106 @@ error_t query_motors( int argc, const char *const *argv )
 	return ESUCCESS;
 }
 
+/// Handle the QRY HLT command. Prints the health of every motor, see htos().
+/** An optional argument gives the number of a single motor, in decimal. */
+error_t query_health( const char *line, int argc, const parse_span_t *argv )
+{
+	motor_t start = 0, finish = MAX_MOTORS;
+
+	if( argc > 1 ) return EARG;
+
+	if( argc ) {
+		start = atoi( argp(0) ) - 1;
+		if( start >= MAX_MOTORS || !glbl.mtrs[start].addr )
+			return EARG;
+		finish = start + 1;
+	}
+
+	strcpy( glbl.cmd, "RSP " );
+	for( ; start<finish && htos(glbl.cmd+4, start) == ESUCCESS; ++start )
+		Serial.println( glbl.cmd );
+
+	return ESUCCESS;
+}
+
+/// Handle the QRY DLT command. Prints the motors added/removed by QRY MTR.
+error_t query_delta( const char *line, int argc, const parse_span_t *argv )
+{
+	motor_t i, added = 0;
+
+	if( argc ) return EARG;
+
+	for( i=0; glbl.mtrs[i].addr; ++i )
+		if( BIT_GET(glbl.fresh, i) )
+			++added;
+
+	Serial.print( "RSP DLT " );
+	Serial.print( added, DEC );
+	Serial.print( ' ' );
+	Serial.println( glbl.removed, DEC );
+
+	return ESUCCESS;
+}
+
+/// Handle the QRY BUS command. Prints the TWI rate of each segment.
+/** One line per segment, "RSP BUS <SEG> <KHZ> <CAL> <TXN> <ERR> <DROPS>":
+ *  the segment from 0, the rate in use and the rate calibrated, in kHz,
+ *  then the transactions with motors and the failures among them since the
+ *  calibration, and the times the rate has been lowered since because of
+ *  them. See bus_count().
+ */
+error_t query_bus( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t seg;
+
+	if( argc ) return EARG;
+
+	for( seg=0; seg<TWI_SEGMENTS; ++seg ) {
+		Serial.print( "RSP BUS " );
+		Serial.print( seg, DEC );
+		Serial.print( ' ' );
+		Serial.print( TWI_KHZ(glbl.bus[seg].rate), DEC );
+		Serial.print( ' ' );
+		Serial.print( TWI_KHZ(glbl.bus[seg].cal), DEC );
+		Serial.print( ' ' );
+		Serial.print( glbl.bus[seg].txn, DEC );
+		Serial.print( ' ' );
+		Serial.print( glbl.bus[seg].errs, DEC );
+		Serial.print( ' ' );
+		Serial.println( glbl.bus[seg].drops, DEC );
+	}
+
+	return ESUCCESS;
+}
+
+/// Handle the QRY CUE command. Prints what overload has cost since a clear.
+/** The form is "RSP CUE <COALESCED> <DROPPED> <FAILED>": the vibrations
+ *  replaced by a newer one for the same motor before they were sent, those
+ *  refused because CUE_MAX other motors were waiting, and those that could
+ *  not be sent after all; see cue_add() and cue_send(). All stop at 65535.
+ *  QRY CUE CLR prints them, then clears them.
+ */
+error_t query_cue( const char *line, int argc, const parse_span_t *argv )
+{
+	if( argc > 1 ) return EARG;
+	if( argc && parse_key(argp(0), argl(0)) != PARSE_KEY('C','L','R') )
+		return EARG;
+
+	Serial.print( "RSP CUE " );
+	Serial.print( glbl.cue.coalesced, DEC );
+	Serial.print( ' ' );
+	Serial.print( glbl.cue.dropped, DEC );
+	Serial.print( ' ' );
+	Serial.println( glbl.cue.failed, DEC );
+
+	if( argc )
+		glbl.cue.coalesced = glbl.cue.dropped = glbl.cue.failed = 0;
+
+	return ESUCCESS;
+}
+
 /// Handle the QRY VER command. Prints contents of FUNNEL_VER.
-error_t query_version( int argc, const char *const *argv )
+error_t query_version( const char *line, int argc, const parse_span_t *argv )
 {
 	if( argc ) return EARG;
 
@@ -479,7 +2705,7 @@ error_t query_version( int argc, const char *const *argv )
 }
 
 /// Handle the QRY BAT command. Prints percent battery remaining, in decimal.
-// error_t query_battery( int argc, const char *const *argv )
+// error_t query_battery( const char *line, int argc, const parse_span_t *argv )
 // {
 // 	int32_t bat;
 
@@ -497,31 +2723,179 @@ error_t query_version( int argc, const char *const *argv )
 // }
 
 /// Handle the QRY ALL command. Issues QRY VER,MTR,RHY,MAG,BAT.
-error_t query_all( int argc, const char *const *argv )
+error_t query_all( const char *line, int argc, const parse_span_t *argv )
+{
+	if( argc ) return EARG;
+
+	query_version( NULL, 0, NULL );
+	query_motors( NULL, 0, NULL );
+	query_rhythm( NULL, 0, NULL );
+	query_magnitude( NULL, 0, NULL );
+//	query_battery( NULL, 0, NULL );
+
+	return ESUCCESS;
+}
+
+/// Handle the QRY LIB command. Prints how well the motor slots cache.
+/** The form is "RSP LIB <HITS> <MISSES> <SLOT>...", where HITS counts the
+ *  rhythm and magnitude lookups of lib_slot() that found every motor already
+ *  taught, MISSES the ones that had to teach one, and each SLOT is the
+ *  library ID held by a motor slot, rhythms first, or 0 if none. QRY LIB CLR
+ *  prints them, then clears the counts.
+ */
+error_t query_library( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t i;
+
+	if( argc > 1 ) return EARG;
+	if( argc && parse_key(argp(0), argl(0)) != PARSE_KEY('C','L','R') )
+		return EARG;
+
+	Serial.print( "RSP LIB " );
+	Serial.print( glbl.slot.hit, DEC );
+	Serial.print( ' ' );
+	Serial.print( glbl.slot.miss, DEC );
+	for( i=0; i<LIB_SLOTS; ++i ) {
+		Serial.print( ' ' );
+		Serial.print( (uint8_t)(glbl.slot.lib[i] + 1), DEC );
+	}
+	Serial.println();
+
+	if( argc )
+		glbl.slot.hit = glbl.slot.miss = 0;
+
+	return ESUCCESS;
+}
+
+/// Handle the QRY CFG command. Sends the whole library as one binary image.
+/** The form is "RSP CFG <LEN> <CRC>" followed by LEN raw bytes, then the
+ *  status line as usual. CRC is the CRC-16/XMODEM of the bytes, in four hex
+ *  digits. The bytes are CFG_VER, then the library exactly as it is laid out
+ *  in EEPROM; see CFG_LEN. They can be sent back unchanged with LRN CFG.
+ */
+error_t query_config( const char *line, int argc, const parse_span_t *argv )
 {
+	uint16_t i, crc;
+	char hex[3];
+
 	if( argc ) return EARG;
 
-	query_version( 0, NULL );
-	query_motors( 0, NULL );
-	query_rhythm( 0, NULL );
-	query_magnitude( 0, NULL );
-//	query_battery( 0, NULL );
+	crc = _crc_xmodem_update( 0, CFG_VER );
+	for( i=0; i<CFG_LEN-1; ++i )
+		crc = _crc_xmodem_update( crc, cfg_byte(i) );
+
+	Serial.print( "RSP CFG " );
+	Serial.print( (unsigned)CFG_LEN, DEC );
+	Serial.print( ' ' );
+	itoh( hex, crc >> 8 );
+	Serial.print( hex );
+	itoh( hex, crc & 0xff );
+	Serial.println( hex );
+
+	Serial.write( CFG_VER );
+	for( i=0; i<CFG_LEN-1; ++i )
+		Serial.write( cfg_byte(i) );
+
+	return ESUCCESS;
+}
+
+#if TRACE_LEN
+/// Handle the QRY TRC command. Prints the trace ring, or starts/stops it.
+/** The form is "RSP TRC <ON> <LOST> <EVENT>...", where ON is 1 while events
+ *  are recorded, LOST counts the events overwritten before they could be
+ *  printed, and each EVENT is 16 hex digits, oldest first: micros() (8), the
+ *  trace_event_t (2), then its two arguments (2 and 4). Use
+ *  tools/trace_decode.py to turn them into text. QRY TRC 1 empties the ring
+ *  and starts recording; QRY TRC 0 stops, keeping what was recorded. The
+ *  ring holds the last TRACE_LEN events; see trace.h.
+ */
+error_t query_trace( const char *line, int argc, const parse_span_t *argv )
+{
+	const trace_t *e;
+	uint8_t i;
+	char hex[3];
+
+	if( argc > 1 ) return EARG;
+	if( argc ) {
+		if( argl(0) != 1 || (argp(0)[0] != '0' && argp(0)[0] != '1') )
+			return EARG;
+		glbl.trc.on = argp(0)[0] - '0';
+		if( glbl.trc.on )
+			glbl.trc.head = glbl.trc.len = glbl.trc.lost = 0;
+		return ESUCCESS;
+	}
+
+	Serial.print( "RSP TRC " );
+	Serial.print( glbl.trc.on, DEC );
+	Serial.print( ' ' );
+	Serial.print( glbl.trc.lost, DEC );
+	for( i=0; i<glbl.trc.len; ++i ) {
+		e = glbl.trc.buf +
+			(glbl.trc.head + TRACE_LEN - glbl.trc.len + i) % TRACE_LEN;
+		Serial.print( ' ' );
+		itoh( hex, e->us >> 24 );	Serial.print( hex );
+		itoh( hex, e->us >> 16 );	Serial.print( hex );
+		itoh( hex, e->us >> 8 );	Serial.print( hex );
+		itoh( hex, e->us );		Serial.print( hex );
+		itoh( hex, e->ev );		Serial.print( hex );
+		itoh( hex, e->a );		Serial.print( hex );
+		itoh( hex, e->b >> 8 );		Serial.print( hex );
+		itoh( hex, e->b );		Serial.print( hex );
+	}
+	Serial.println();
+
+	return ESUCCESS;
+}
+#endif
+
+#ifdef STATS
+/// Handle the QRY STA command. Prints the latency histograms.
+/** One line per phase (see stats_phase_t), in the form
+ *  "RSP STA <PHASE> <MAX> <COUNT>...", with the phase as an ID letter, the
+ *  longest time seen in us, and the count in each bucket, shortest first.
+ *  QRY STA CLR prints them, then clears them.
+ */
+error_t query_stats( const char *line, int argc, const parse_span_t *argv )
+{
+	uint8_t phase, bucket;
+
+	if( argc > 1 ) return EARG;
+	if( argc && parse_key(argp(0), argl(0)) != PARSE_KEY('C','L','R') )
+		return EARG;
+
+	for( phase=0; phase<STP_MAX; ++phase ) {
+		Serial.print( "RSP STA " );
+		Serial.print( (char)itol(phase) );
+		Serial.print( ' ' );
+		Serial.print( glbl.sta.max[phase], DEC );
+		for( bucket=0; bucket<STA_BUCKETS; ++bucket ) {
+			Serial.print( ' ' );
+			Serial.print( glbl.sta.hist[phase][bucket], DEC );
+		}
+		Serial.println();
+	}
+
+	if( argc ) {
+		memset( glbl.sta.hist, 0, sizeof(glbl.sta.hist) );
+		memset( glbl.sta.max, 0, sizeof(glbl.sta.max) );
+	}
 
 	return ESUCCESS;
 }
+#endif
 
 /// Handle the QRY ALL command. Issues QRY VER,MTR,RHY,MAG,BAT.
-error_t query_test( int argc, const char *const *argv )
+error_t query_test( const char *line, int argc, const parse_span_t *argv )
 {	
 	return ESUCCESS;
 }
 
 /// TST command, tries rhythm/magnitude without learning. Not implemented.
-error_t test( int argc, const char *const *argv )
+error_t test( const char *line, int argc, const parse_span_t *argv )
 { return EMISSING; }
 
 /// Handle the BGN command. Switches from learning mode to activate mode.
-error_t begin( int argc, const char *const *argv )
+error_t begin( const char *line, int argc, const parse_span_t *argv )
 {
 	if( argc ) return EARG;
 
@@ -530,116 +2904,371 @@ error_t begin( int argc, const char *const *argv )
 	return ESUCCESS;
 }
 
-/// Handle the ZAP command. Erases all rhythms and magnitudes from EEPROM.
-error_t erase_all_learned( int argc, const char *const *argv )
+/// Handle the FRM command. Switches from learning mode to framed mode.
+/** An optional argument gives the serial rate to use in framed mode; the
+ *  link switches to it as soon as the status of this command has been sent.
+ *  See frame.h.
+ */
+error_t begin_framed( const char *line, int argc, const parse_span_t *argv )
+{
+	unsigned long baud = 0;
+
+	if( argc > 1 ) return EARG;
+
+	if( argc ) {
+		baud = strtoul( argp(0), NULL, 10 );
+		if( baud < 1200 || baud > 250000 ) return EARG;
+	}
+
+	memset( &glbl.frm, 0, sizeof(glbl.frm) );
+	glbl.baud = baud;
+	glbl.mode = M_FRAMED;
+
+	return ESUCCESS;
+}
+
+/// Handle the ZAP command. Erases all rhythms, magnitudes, patterns, groups.
+error_t erase_all_learned( const char *line, int argc, const parse_span_t *argv )
 {
+	uint8_t i;
+
 	if( argc != 3 ) return EARG;
 
-	eeprom_zero( EE_MAG, EE_RHY+MAX_RHYTHM );
+	for( i=0; i<MAX_SPATIO; ++i )
+		spatio_stop( i );
+	eeprom_zero( EE_MAG, EE_SPT+MAX_SPATIO );
+	eeprom_zero( EE_GRP, EE_GRP+MAX_GROUPS );
+	eeprom_zero( EE_XRHY, EE_XEND );
+	memset( &glbl.lib, 0, sizeof(glbl.lib) );
+	glbl.lib_dirty = 0;
+	lib_gen();
 
 	return ESUCCESS;
 }
 
 // parse table definitions
 // PROGMEM is supposed to come *after* the variable name, but then doxygen
-// can't figure it out
-
+// can't figure it out. Each table is a list of words, hashed into a
+// parse_table_t by the compiler.
+
+/// Words recognized after a LRN word is parsed
+static PROGMEM constexpr parse_step_t pt_learn_steps[] = {
+	{ PARSE_KEY('R','H','Y'), NULL, learn_rhythm },
+	{ PARSE_KEY('M','A','G'), NULL, learn_magnitude },
+	{ PARSE_KEY('S','P','T'), NULL, learn_spatio },
+	{ PARSE_KEY('A','D','D'), NULL, learn_address },
+	{ PARSE_KEY('G','R','P'), NULL, learn_group },
+	{ PARSE_KEY('C','F','G'), NULL, learn_config },
+	{ PARSE_KEY('B','U','S'), NULL, learn_bus },
+};
+PARSE_CHECK( pt_learn_steps );
 /// Table of recognized learn commands. Hit after a LRN word is parsed.
-static PROGMEM const parse_step_t pt_learn[] = {
-	{ "RHY", NULL, learn_rhythm },
-	{ "MAG", NULL, learn_magnitude },
-	{ "SPT", NULL, learn_spatio },
-	{ "ADD", NULL, learn_address },
-	{ "", NULL, NULL }
+static PROGMEM constexpr parse_table_t pt_learn = PARSE_TABLE(pt_learn_steps);
+
+/// Words recognized after a QRY word is parsed
+static PROGMEM constexpr parse_step_t pt_query_steps[] = {
+	{ PARSE_KEY('R','H','Y'), NULL, query_rhythm },
+	{ PARSE_KEY('M','A','G'), NULL, query_magnitude },
+	{ PARSE_KEY('S','P','T'), NULL, query_spatio },
+	{ PARSE_KEY('M','T','R'), NULL, query_motors },
+	{ PARSE_KEY('D','L','T'), NULL, query_delta },
+	{ PARSE_KEY('H','L','T'), NULL, query_health },
+	{ PARSE_KEY('G','R','P'), NULL, query_group },
+	{ PARSE_KEY('L','I','B'), NULL, query_library },
+	{ PARSE_KEY('C','F','G'), NULL, query_config },
+	{ PARSE_KEY('B','U','S'), NULL, query_bus },
+	{ PARSE_KEY('C','U','E'), NULL, query_cue },
+	{ PARSE_KEY('V','E','R'), NULL, query_version },
+//	{ PARSE_KEY('B','A','T'), NULL, query_battery },
+	{ PARSE_KEY('A','L','L'), NULL, query_all },
+	{ PARSE_KEY('T','S','T'), NULL, query_test },
+#ifdef STATS
+	{ PARSE_KEY('S','T','A'), NULL, query_stats },
+#endif
+#if TRACE_LEN
+	{ PARSE_KEY('T','R','C'), NULL, query_trace },
+#endif
 };
-
+PARSE_CHECK( pt_query_steps );
 /// Table of recognized query commands. Hit after a QRY word is parsed.
-static PROGMEM const parse_step_t pt_query[] = {
-	{ "RHY", NULL, query_rhythm },
-	{ "MAG", NULL, query_magnitude },
-	{ "SPT", NULL, query_spatio },
-	{ "MTR", NULL, query_motors },
-	{ "VER", NULL, query_version },
-//	{ "BAT", NULL, query_battery },
-	{ "ALL", NULL, query_all },
-	{ "TST", NULL, query_test },
-	{ "", NULL, NULL }
+static PROGMEM constexpr parse_table_t pt_query = PARSE_TABLE(pt_query_steps);
+
+/// Words recognized as the first word of a command
+static PROGMEM constexpr parse_step_t pt_top_steps[] = {
+	{ PARSE_KEY('L','R','N'), &pt_learn, NULL },
+	{ PARSE_KEY('Q','R','Y'), &pt_query, NULL },
+	{ PARSE_KEY('T','S','T'), NULL, test },
+	{ PARSE_KEY('B','G','N'), NULL, begin },
+	{ PARSE_KEY('F','R','M'), NULL, begin_framed },
+	{ PARSE_KEY('Z','A','P'), NULL, erase_all_learned },
 };
-
+PARSE_CHECK( pt_top_steps );
 /// Top-level parse table. Used to recognize the first word of a command.
-static PROGMEM const parse_step_t pt_top[] = {
-	{ "LRN", pt_learn, NULL },
-	{ "QRY", pt_query, NULL },
-	{ "TST", NULL, test },
-	{ "BGN", NULL, begin },
-	{ "ZAP", NULL, erase_all_learned },
-	{ "", NULL, NULL }
-};
+static PROGMEM constexpr parse_table_t pt_top = PARSE_TABLE(pt_top_steps);
 
 /// Try very hard to make a particular motor vibrate even with flaky hardware
-/** Retransmits an activate command if the initial transmission results in
- *  status of unrecognized rhythm/magnitude/spatio-temporal. Usual/expected
- *  reason for such a status is that the power connection was temporarily
- *  lost, due to unreliable cable connectors.
+/** Teaches the motor the rhythm and magnitude first if it has not been
+ *  taught them; see lib_slot(). Retransmits an activate command if the
+ *  initial transmission results in status of unrecognized
+ *  rhythm/magnitude/spatio-temporal. Usual/expected reason for such a
+ *  status is that the power connection was temporarily lost, due to
+ *  unreliable cable connectors. Only the rhythm and magnitude needed are
+ *  taught before the retry; see refresh_mark() for the rest.
+ *
+ *  Sends vibration \a v of the library, with the high library bits
+ *  \a xlib, from a copy of its own, so that it can be used for vibrations
+ *  held back from the command in glbl.acmd; see cue_send().
  */
-static error_t reliable_activate( void )
+static error_t reliable_send( motor_t motor, vibration_t v, uint8_t xlib )
 {
+	vibration_t sent = v;
+	error_t status;
+
+	// lib_slot() has already checked that the rhythm/magnitude is
+	// defined, so it is only a motor that answers that it isn't
+	status = lib_slot( motor, &sent, xlib );
+	if( status != ESUCCESS )
+		return status;
+
 	// try to send the activate command
-	error_t status = send_command( glbl.acmd.motor );
+	status = send_command( motor, NULL, 0, (uint8_t*)&sent, sizeof(sent) );
+
 	DBG( "status " );
 	DBGCN( (int)status );
 
 	// if the motor doesn't know about the rhythm/magnitude, but we think
-	// it should, then the motor probably just lost power temporarily
-	//
-	// but checking to see whether the rhythm/magnitude is defined
-	// requires reading EEPROM, so just assume that it is defined and
-	// refresh the motor--this is faster in the expected case (the motor
-	// lost power), and the user knows which rhythms/magnitudes are
-	// defined and so can easily avoid trying to activate undefined ones
+	// it should, then the motor probably just lost power temporarily, and
+	// everything it was taught with it
 	switch( status ) {
 	case ENOR:
 	case ENOM:
 	case ENOS:
-		// resend the learn commands to the motor
+		// teach the motor just what this command needs, and retry the
+		// activate command; the rest is taught in the background
 		DBG( "refreshing motor " );
-		DBGCN( glbl.acmd.motor, DEC );
-		glbl.mode = M_LEARN;
-		teach_motor( glbl.acmd.motor );
-		glbl.mode = M_ACTIVE;
-
-		// and retry the activate command
-		return send_command( glbl.acmd.motor );
+		DBGCN( motor, DEC );
+		refresh_mark( motor );
+		sent = v;
+		status = lib_slot( motor, &sent, xlib );
+		if( status == ESUCCESS )
+			status = send_command( motor, NULL, 0, (uint8_t*)&sent,
+				sizeof(sent) );
+		break;
 	default:
 		// some "real" failure, not just an unrecognized rhythm/etc.
 		// on the motor, so no sense in retrying the command
-		return status;
+		break;
+	}
+
+	return status;
+}
+
+/// Make a motor vibrate as the command in glbl.acmd says; see reliable_send()
+static error_t reliable_activate( motor_t motor )
+{ return reliable_send( motor, glbl.acmd.v, glbl.xlib ); }
+
+/// Handle an ACX_BATCH command: activate each of the motors that follow
+/** The count comes from the argument byte of the command, and the tuples
+ *  are read in BATCH_CHUNK at a time. Each chunk is dispatched one TWI
+ *  segment at a time, so that the multiplexer switches at most once per
+ *  segment per chunk; the order of the activations within a chunk is not
+ *  kept. Every tuple is consumed even if an earlier one failed, so that the
+ *  host and the controller stay in step. A bitmap of failed tuples is left
+ *  in glbl.cmd as the extra reply bytes.
+ *
+ *  \return ESUCCESS, or the status of the first tuple that failed.
+ */
+static error_t batch_activate( void )
+{
+	uint8_t count = *((uint8_t*)&glbl.acmd.v), wide = 0, i, n, k, seg;
+	error_t ret = ESUCCESS;
+	motor_t mtr[ BATCH_CHUNK ];
+	vibration_t vib[ BATCH_CHUNK ];
+	uint8_t sts[ BATCH_CHUNK ];
+
+	// build the bitmap on the stack, because refreshing a motor uses
+	// glbl.cmd; 256 bits is enough for any count
+	uint8_t failed[ sizeof(glbl.cmd) ];
+	memset( failed, 0, sizeof(failed) );
+
+	for( i=0; i<count; i+=n ) {
+		// read in a chunk, settling the tuples that need no TWI
+		for( n=0; n<BATCH_CHUNK && i+n<count; ++n ) {
+			uint16_t motor;
+
+			read_active();
+			motor = (uint16_t)wide << 6 | glbl.acmd.motor;
+			mtr[ n ] = MOTOR_ALL;
+			sts[ n ] = ESUCCESS;
+
+			if( glbl.acmd.mode == ACM_LRN &&
+				glbl.acmd.motor == ACX_WIDE
+			) {
+				wide = *((uint8_t*)&glbl.acmd.v);
+				continue;
+			}
+			wide = 0;
+
+			if( glbl.acmd.mode != ACM_VIB )
+				sts[ n ] = EBADCMD;
+			else if( motor >= MAX_MOTORS )
+				sts[ n ] = ENOMOTOR;
+			else {
+				mtr[ n ] = motor;
+				vib[ n ] = glbl.acmd.v;
+			}
+		}
+
+		// dispatch the chunk, one segment at a time
+		for( seg=0; seg<TWI_SEGMENTS; ++seg )
+			for( k=0; k<n; ++k ) {
+				if( mtr[k] == MOTOR_ALL || MTR_SEG(mtr[k]) != seg )
+					continue;
+				glbl.acmd.v = vib[ k ];
+				sts[ k ] = reliable_activate( mtr[k] );
+			}
+
+		for( k=0; k<n; ++k ) {
+			if( sts[k] == ESUCCESS ) continue;
+
+			failed[ (i+k)/8 ] |= 1 << ((i+k)%8);
+			if( ret == ESUCCESS )
+				ret = (error_t)sts[ k ];
+		}
+	}
+
+	glbl.rsp_len = ( count + 7 ) / 8;
+	memcpy( glbl.cmd, failed, glbl.rsp_len );
+
+	return ret;
+}
+
+/// Handle an extended command (an ACM_LRN with a non-zero motor field)
+static error_t parse_extended( void )
+{
+	switch( glbl.acmd.motor ) {
+	case ACX_LRN:	glbl.mode = M_LEARN;
+			return ESUCCESS;
+	case ACX_BATCH:	// a frame already batches its commands
+			if( glbl.mode == M_FRAMED ) return EBADCMD;
+			return batch_activate();
+	case ACX_WIDE:	glbl.wide = *((uint8_t*)&glbl.acmd.v);
+			return ESUCCESS;
+	case ACX_LIB:	glbl.xlib = *((uint8_t*)&glbl.acmd.v);
+			return ESUCCESS;
+	case ACX_SYNC: {
+			uint16_t now = millis();
+
+			// a frame has no room for reply bytes
+			if( glbl.mode == M_FRAMED ) return EBADCMD;
+			glbl.cmd[ 0 ] = now >> 8;
+			glbl.cmd[ 1 ] = now;
+			glbl.rsp_len = 2;
+			return ESUCCESS;
+		}
+	}
+
+	if( glbl.acmd.motor >= ACX_AT ) {
+		uint16_t now = millis(), late;
+
+		// resolve the 13-bit time to the nearest full one
+		glbl.sch.at = (uint16_t)(glbl.acmd.motor - ACX_AT) << 8 |
+			*((uint8_t*)&glbl.acmd.v);
+		late = ( now - glbl.sch.at ) & 0x1fff;
+		glbl.sch.at = late <= SCHED_LATE? now - late : now + 0x2000 - late;
+		glbl.sch.armed = 1;
+		return ESUCCESS;
 	}
+
+	if( glbl.acmd.motor >= ACX_GROUP &&
+		glbl.acmd.motor < ACX_GROUP+MAX_GROUPS
+	)
+		return group_activate( glbl.acmd.motor - ACX_GROUP );
+
+	return EBADCMD;
 }
 
 /// Handle a command in activate mode
+/** Any extra reply bytes are left in glbl.cmd, with their count in
+ *  glbl.rsp_len, to be sent after the returned status.
+ */
 error_t parse_active( void )
 {
+	uint16_t motor = (uint16_t)glbl.wide << 6 | glbl.acmd.motor;
+	error_t status;
+	STA_START( t );
+
+	// ACX_WIDE, ACX_LIB and ACX_AT prefixes apply to the next command
+	// that is not itself a prefix
+	uint8_t prefix = glbl.acmd.mode == ACM_LRN &&
+		( glbl.acmd.motor == ACX_WIDE || glbl.acmd.motor == ACX_LIB ||
+		glbl.acmd.motor >= ACX_AT );
+
+	glbl.rsp_len = 0;
+	if( glbl.acmd.mode != ACM_VIB && !prefix )
+		cue_flush();
+
 	switch( glbl.acmd.mode ) {
-	case ACM_VIB:	return reliable_activate();
-	case ACM_SPT:	return EMISSING;
-	case ACM_GCL:	return send_command(-1);
-	case ACM_LRN:	glbl.mode = M_LEARN;
-			return ESUCCESS;
-	default:	return EBADCMD;
+	case ACM_VIB:	if( motor >= MAX_MOTORS )
+				status = ENOMOTOR;
+			else if( glbl.sch.armed )
+				status = sched_add( motor );
+			else if( glbl.cue.len || ( glbl.mode != M_FRAMED &&
+				Serial.available() >
+				CUE_BACKLOG*(int)sizeof(active_command_t) )
+			)
+				// behind the host; see cue_add(). A framed host
+				// is held back by its window instead, and the
+				// bytes waiting may be resent frames
+				status = cue_add( motor );
+			else	status = reliable_activate( motor );
+			break;
+	case ACM_SPT:	status = spatio_start( glbl.acmd.motor );	break;
+	case ACM_GCL:	status = glbl.sch.armed? sched_add( MOTOR_ALL ) :
+				general_activate();
+			break;
+	case ACM_LRN:	status = parse_extended();		break;
+	default:	status = EBADCMD;			break;
+	}
+	STA_STOP( STP_ACTIVE, t );
+	TRC( TRE_ACTIVE, status, (uint16_t)((uint8_t*)&glbl.acmd)[0] << 8 |
+		*((uint8_t*)&glbl.acmd.v) );
+
+	if( !prefix )
+		glbl.wide = glbl.xlib = glbl.sch.armed = 0;
+
+	return status;
+}
+
+/// Handle the commands in a frame received by poll_frame(), and ack it
+/** Leaving framed mode (ACX_LRN) ends the frame early, and the serial link
+ *  goes back to its normal rate once the ack has been sent.
+ */
+void handle_frame( void )
+{
+	uint8_t sts[ FRM_MAX_LEN/sizeof(active_command_t) ], i = 0;
+
+	while( glbl.mode == M_FRAMED &&
+		i*sizeof(active_command_t) < glbl.frm.len
+	) {
+		memcpy( &glbl.acmd, glbl.frm.buf + i*sizeof(active_command_t),
+			sizeof(active_command_t) );
+		sts[ i++ ] = parse_active();
 	}
+
+	frame_send( FRT_ACK, glbl.frm.next++, sts, i );
+
+	if( glbl.mode != M_FRAMED )
+		glbl.baud = SERIAL_BAUD;
 }
 
 /// Handle a command in learning mode
+/** parse() leaves glbl.cmd as it is, so the learn handlers can relay the
+ *  command to the motors as it was received.
+ */
 error_t handle_learn( void )
 {
-	char cpy[ sizeof(glbl.cmd) ];
-
-	// make a copy of the command, because parse() modifies its argument
-	// in place and the learn handlers expect an unmodified glbl.cmd
-	strcpy( cpy, glbl.cmd );
-
-	return parse( pt_top, cpy );
+	return parse( &pt_top, glbl.cmd );
 }
 
 // menu tables
@@ -664,6 +3293,9 @@ static PROGMEM const char menu_str_qry[] =
 //	"5. Query remaining battery\n\r"
 	"5. Query all belt information\n\r"
 	"6. Test Function\n\r"
+#ifdef STATS
+	"7. Query latency statistics\n\r"
+#endif
 ;
 
 /// Learn menu options.
@@ -671,7 +3303,7 @@ static PROGMEM const char menu_str_lrn[] =
 	"0. Return to main menu\n\r"
 	"1. Learn rhythm\n\r"
 	"2. Learn magnitude\n\r"
-	"3. Forget all rhythms and magnitudes\n\r"
+	"3. Forget all rhythms, magnitudes, patterns and groups\n\r"
 ;
 
 /// Instructions for the learn rhythm menu.
@@ -707,7 +3339,8 @@ static PROGMEM const char menu_str_lrn_mag[] =
 
 /// Confirmation prompt for the erase rhythms/magnitudes menu option.
 static PROGMEM const char menu_str_forget[] =
-	"All defined rhythms and magnitudes will be erased from EEPROM.\n\r"
+	"All defined rhythms, magnitudes, patterns and groups will be\n\r"
+	"erased from EEPROM.\n\r"
 	"Continue?\n\r"
 	"0. No\n\r"
 	"1. Yes\n\r"
@@ -729,32 +3362,44 @@ static PROGMEM const char menu_str_act[] =
 // menu handlers
 
 /// Issue the QRY VER command from the debug menu
-error_t menu_qry_ver( void ) { return query_version(0, NULL); }
+error_t menu_qry_ver( void ) { return query_version(NULL, 0, NULL); }
 /// Issue the QRY MTR command from the debug menu
-error_t menu_qry_mtr( void ) { return query_motors(0, NULL); }
+error_t menu_qry_mtr( void ) { return query_motors(NULL, 0, NULL); }
 /// Issue the QRY RHY command from the debug menu
-error_t menu_qry_rhy( void ) { return query_rhythm(0, NULL); }
+error_t menu_qry_rhy( void ) { return query_rhythm(NULL, 0, NULL); }
 /// Issue the QRY MAG command from the debug menu
-error_t menu_qry_mag( void ) { return query_magnitude(0, NULL); }
+error_t menu_qry_mag( void ) { return query_magnitude(NULL, 0, NULL); }
 /// Issue the QRY BAT command from the debug menu
-//error_t menu_qry_bat( void ) { return query_battery(0, NULL); }
+//error_t menu_qry_bat( void ) { return query_battery(NULL, 0, NULL); }
 /// Issue the QRY ALL command from the debug menu
-error_t menu_qry_all( void ) { return query_all(0, NULL); }
+error_t menu_qry_all( void ) { return query_all(NULL, 0, NULL); }
 
-error_t menu_qry_test( void ) { return query_test(0, NULL); }
+error_t menu_qry_test( void ) { return query_test(NULL, 0, NULL); }
+#ifdef STATS
+/// Issue the QRY STA command from the debug menu
+error_t menu_qry_sta( void ) { return query_stats(NULL, 0, NULL); }
+#endif
 	
 /// Common work shared by menu_lrn_rhy() / menu_lrn_mag()
 void menu_lrn_generic( const char *prepend )
 {
+	uint8_t len;
+
 	while(1) {
 		// read the rhythm/magnitude specification from the user
 		Serial.print( "Specification: " );
 		read_line();
-		if( glbl.cmd[0] == '\0' ) break;
-
-		// prepend the LRN RHY/MAG
-		memmove( glbl.cmd+8, glbl.cmd, sizeof(glbl.cmd)-8 );
-		glbl.cmd[ sizeof(glbl.cmd) - 1 ] = '\0';
+		len = strlen( glbl.cmd );
+		if( !len ) break;
+
+		// then put the LRN RHY/MAG in front of it, so that the whole
+		// command is in place; done here rather than before reading,
+		// because poll_line() starts over after a line that is too long
+		if( len >= sizeof(glbl.cmd) - 8 ) {
+			print_flash( errstr(ETOOBIG) );
+			continue;
+		}
+		memmove( glbl.cmd+8, glbl.cmd, len+1 );
 		memcpy( glbl.cmd, "LRN ", 4 );
 		memcpy( glbl.cmd+4, prepend, 4 );
 
@@ -779,7 +3424,7 @@ error_t menu_lrn_mag( void )
 	return ESUCCESS;
 }
 /// Issue the ZAP command from the debug menu
-error_t menu_lrn_forget( void ) { return erase_all_learned(3, NULL); }
+error_t menu_lrn_forget( void ) { return erase_all_learned(NULL, 3, NULL); }
 
 #define ARG( _dst_, _base_, _max_ ) \
 	val = glbl.cmd[ i++ ] - _base_; \
@@ -803,7 +3448,8 @@ error_t menu_act( void )
 		if( glbl.cmd[0] == '\0' ) break;
 
 		// convert it into a native activate command
-		ARG( glbl.acmd.motor, '1', MAX_MOTORS );
+		// the menu reaches the first 64 motors, like the motor field
+		ARG( glbl.acmd.motor, '1', (MAX_MOTORS<64? MAX_MOTORS : 64) );
 		ARG( glbl.acmd.v.rhythm, '1', MAX_RHYTHM );
 		ARG( glbl.acmd.v.magnitude, '1', MAX_MAGNITUDE );
 		ARG( glbl.acmd.v.duration, '0', MAX_DURATION+1 );
@@ -812,7 +3458,7 @@ error_t menu_act( void )
 		// send the command
 		save = glbl.mode;
 		glbl.mode = M_ACTIVE;
-		print_flash( errstr(reliable_activate()) );
+		print_flash( errstr(reliable_activate(glbl.acmd.motor)) );
 		glbl.mode = save;
 	}
 
@@ -821,11 +3467,11 @@ error_t menu_act( void )
 #undef ARG
 /** \brief Enter raw command mode. Exits the menu, turns on serial echo, and
  *  interprets activate mode commands as ASCII hex quads rather than 2 raw
- *  bytes. See read_active_hex().
+ *  bytes. See poll_active().
  */
 error_t menu_raw( void ) { glbl.echo = 1; glbl.in_menu = 0; return ESUCCESS; }
 /** \brief Exits the debug menu to normal command mode (echo off, activate
- *  commands read as 2 raw bytes). See read_active().
+ *  commands read as 2 raw bytes). See poll_active().
  */
 error_t menu_exit( void ) { glbl.in_menu = glbl.echo = 0; return ESUCCESS; }
 
@@ -846,6 +3492,9 @@ static PROGMEM const menu_step_t menu_choices_qry[] = {
 //	{ NULL, NULL, menu_qry_bat },
 	{ NULL, NULL, menu_qry_all },
 	{ NULL, NULL, menu_qry_test },
+#ifdef STATS
+	{ NULL, NULL, menu_qry_sta },
+#endif
 	{ NULL, NULL, menu_end }
 };
 
@@ -913,11 +3562,14 @@ void handle_menu( void )
 		Serial.println();
 		print_flash( glbl.menustep.menu );
 
-		// figure out the number of choices
-		// FIXME: (int) should be (uint16_t)
-		max = 0;
-		while( pgm_read_word(&choice[max].func) != (int)menu_end )
-			++max;
+		// figure out the number of choices; the handler pointers are
+		// in PROGMEM, and no wider than a word only on the AVR
+		for( max=0;; ++max ) {
+			menu_func_t func;
+
+			memcpy_P( &func, &choice[max].func, sizeof(func) );
+			if( func == menu_end ) break;
+		}
 
 		// wait for a valid selection
 		Serial.print( "Choice: " );
@@ -970,11 +3622,26 @@ void setup( void )
         digitalWrite(13,HIGH);
         
 	unsigned long start;
+	uint8_t i;
 
 	Wire.begin();
-	Serial.begin( 9600 );
+	Serial.begin( SERIAL_BAUD );
 
 	memset( &glbl, 0, sizeof(glbl) );
+#if TWI_SEGMENTS > 1
+	glbl.seg = 0xff;	// the multiplexer starts with every channel off
+#endif
+	// Wire.begin() leaves the clock at 100 kHz until bus_start()
+	glbl.clk = TWI_RATE_DEF;
+	for( i=0; i<TWI_SEGMENTS; ++i )
+		glbl.bus[ i ].rate = TWI_RATE_DEF;
+	glbl.lost = MOTOR_ALL;	// no motor has lost what it was taught yet
+
+	// finish putting a LRN CFG image in place if a reset stopped it
+	eeprom_read( &i, EE_CFG_OK, 1 );
+	if( i == CFG_OK )
+		cfg_install();
+	lib_load();
 
 #ifdef DEBUG
 	for( start=millis(); millis()-start < 3000; );
@@ -990,8 +3657,10 @@ void setup( void )
 //	glbl.fuel_gauge = fg_init( 0x7f ) == ESUCCESS;
 //	DBGN( fg_get(FGR_TEMP), HEX );
 
-	detect_motors();	// determine which motors are present on bus
-	teach_motor(-1);	// relay rhythms/magnitudes to attached motors
+	load_motors();		// start from the motors present last time
+	detect_motors(1);	// determine which motors are present on bus
+	bus_start(0);		// run each segment as fast as its motors allow
+	teach_stale();		// relay rhythms/magnitudes to motors lacking them
 
 	// initialize the menu to the top level
 	memcpy_P( &glbl.menustep, menu_top, sizeof(glbl.menustep) );
@@ -1004,34 +3673,57 @@ void setup( void )
 }
 
 /// Main firmware execution loop
+/** Never waits for the host: each pass runs the background() tasks, takes
+ *  whatever serial input is waiting, and handles a command only once all of
+ *  it has arrived.
+ */
 void loop( void )
 {
 	error_t status;
 
-	if( glbl.mode == M_ACTIVE ) {
+	background();
+
+	if( glbl.mode == M_FRAMED ) {
+		if( poll_frame() ) {
+			handle_frame();
+			set_baud();
+		}
+	}else if( glbl.mode == M_ACTIVE ) {
+		if( !poll_active() ) return;
+
 		if( glbl.echo ) {
-			// raw command mode; read the command as ASCII hex
-			// and print human-readable status response
-			read_active_hex();
+			// raw command mode; command was read as ASCII hex,
+			// so print human-readable status response
+			uint8_t i;
+			char hex[3];
+
+			status = parse_active();
 			Serial.write( ' ' );
-			print_flash( errstr(parse_active()) );
+			for( i=0; i<glbl.rsp_len; ++i ) {
+				itoh( hex, glbl.cmd[i] );
+				Serial.print( hex );
+				Serial.write( ' ' );
+			}
+			print_flash( errstr(status) );
 		}else {
-			// normal mode; read and reply machine-format bytes
-			read_active();
+			// normal mode; reply machine-format bytes
 			Serial.write( parse_active() );
+			Serial.write( (uint8_t*)glbl.cmd, glbl.rsp_len );
 		}
 	}else {
-		uint8_t count = 0;
+		if( !poll_line() ) return;
 
-		do{
-			read_line();
-			if( count < 2 )
-				++count;
+		// a few blank lines in a row bring up the debug menu
+		if( glbl.cmd[0] == '\0' ) {
+			if( glbl.blanks < 2 )
+				++glbl.blanks;
 			else {
 				handle_menu();
-				count = 0;
+				glbl.blanks = 0;
 			}
-		}while( glbl.cmd[0] == '\0' );
+			return;
+		}
+		glbl.blanks = 0;
 		DBGN( glbl.cmd );
 
 		// handle the command and return status
@@ -1044,6 +3736,7 @@ void loop( void )
 			// normal mode; return parsable status
 			print_status( status );
 		}
+		set_baud();
 	}
 }
 
@@ -24,10 +24,56 @@ int8_t htoi( char digit )
 	return -1;
 }
 
-/** Parse \a argv as a rhythm specification: \<ID> \<PATTERN> \<BITS>. If
- *  successful, store the rhythm into memory pointed to by \a into.
+/// Convert an unsigned byte to two ASCII hex digits plus null terminator
+void itoh( char *into, uint8_t val )
+{
+	into[0] = val >> 4;
+	into[0] += ( into[0]<10? '0' : 'A'-10 );
+	into[1] = val & 0xf;
+	into[1] += ( into[1]<10? '0' : 'A'-10 );
+	into[2] = '\0';
+}
+
+/// Write \a val in decimal plus null terminator; returns the terminator
+static char *utod( char *into, uint16_t val )
+{
+	char digits[ 5 ];
+	uint8_t n = 0;
+
+	do {
+		digits[ n++ ] = '0' + val % 10;
+		val /= 10;
+	}while( val );
+	while( n )
+		*into++ = digits[ --n ];
+	*into = '\0';
+
+	return into;
+}
+
+/** A rhythm or magnitude ID is a decimal number from 1, so the first nine
+ *  are the same as their ID letters. Returns the index the ID stands for,
+ *  from 0.
  */
-error_t parse_rhythm( int argc, const char *const *argv, rhythm_t *into )
+uint8_t parse_id( const char *word, uint8_t len )
+{
+	uint8_t id = 0;
+
+	if( !len || len > 2 || word[0] == '0' ) return 0xff;
+	for( ; len; --len, ++word ) {
+		if( *word < '0' || *word > '9' ) return 0xff;
+		id = id*10 + (*word - '0');
+	}
+
+	return id - 1;
+}
+
+/** Parse \a argv as a rhythm specification: \<ID> \<PATTERN> \<BITS>, where
+ *  ID must be below \a max (see parse_id()). If successful, store the rhythm
+ *  into memory pointed to by \a into.
+ */
+error_t parse_rhythm( const char *line, int argc, const parse_span_t *argv,
+	uint8_t max, rhythm_t *into )
 {
 	uint8_t bits;
 	const uint8_t len = sizeof( into->pattern ) * 2;
@@ -37,43 +83,43 @@ error_t parse_rhythm( int argc, const char *const *argv, rhythm_t *into )
 	if( argc != 3 ) return EARG;
 
 	// convert ID argument
-	if( argv[0][1] != '\0' ) return EARG;
-	if( ltoi(0) >= MAX_RHYTHM ) return EARG;
+	if( parse_id(argp(0), argl(0)) >= max ) return EARG;
 
 	// ensure PATTERN consists only of hex digits
-	if( strlen(argv[1]) != len ) return EINVR;
+	if( argl(1) != len ) return EINVR;
 	for( i=0; i<len; ++i )
-		if( htoi(argv[1][i]) == -1 ) return EINVR;
+		if( htoi(argp(1)[i]) == -1 ) return EINVR;
 
 	// convert BITS argument
-	bits = atoi( argv[2] );
+	bits = atoi( argp(2) );
 	if( bits<1 || bits>MAX_RBITS ) return EINVR;
 
 	// convert the ascii pattern into native format and store it in the
 	// given location
 	for( i=0; i<sizeof(into->pattern); ++i ) {
-		into->pattern[i] = htoi( argv[1][i*2] ) << 4;
-		into->pattern[i] |= htoi( argv[1][i*2+1] );
+		into->pattern[i] = htoi( argp(1)[i*2] ) << 4;
+		into->pattern[i] |= htoi( argp(1)[i*2+1] );
 	}
 	into->bits = bits;
 
 	return ESUCCESS;
 }
 
-/** Parse \a argv as a magnitude specification: \<ID> \<PERIOD> \<DUTY>. If
- *  successful, store the magnitude into memory pointed to by \a into.
+/** Parse \a argv as a magnitude specification: \<ID> \<PERIOD> \<DUTY>,
+ *  where ID must be below \a max (see parse_id()). If successful, store the
+ *  magnitude into memory pointed to by \a into.
  */
-error_t parse_magnitude( int argc, const char *const *argv, magnitude_t *into )
+error_t parse_magnitude( const char *line, int argc, const parse_span_t *argv,
+	uint8_t max, magnitude_t *into )
 {
 	uint16_t period, duty;
 
 	if( argc != 3 ) return EARG;
 
 	// convert arguments to integers
-	if( argv[0][1] != '\0' ) return EARG;
-	if( ltoi(0) >= MAX_MAGNITUDE ) return EARG;
-	period = atoi( argv[1] );
-	duty = atoi( argv[2] );
+	if( parse_id(argp(0), argl(0)) >= max ) return EARG;
+	period = atoi( argp(1) );
+	duty = atoi( argp(2) );
 
 	// ensure minimum duty because PWM TOP cannot be too small
 	if( duty>period || duty<2 ) return EINVM;
@@ -84,18 +130,113 @@ error_t parse_magnitude( int argc, const char *const *argv, magnitude_t *into )
 	return ESUCCESS;
 }
 
+/** Write \a rhy as "RHY \<ID> \<PATTERN> \<BITS>", the form parse_rhythm()
+ *  reads after the LRN, with the ID of index \a id (see parse_id()).
+ */
+void rhythm_text( char *into, const rhythm_t *rhy, uint8_t id )
+{
+	uint8_t i;
+
+	strcpy( into, "RHY " );
+	into = utod( into+4, id+1 );
+	*into++ = ' ';
+	for( i=0; i<sizeof(rhy->pattern); ++i, into+=2 )
+		itoh( into, rhy->pattern[i] );
+	*into++ = ' ';
+	utod( into, rhy->bits );
+}
+
+/** Write \a mag as "MAG \<ID> \<PERIOD> \<DUTY>", the form
+ *  parse_magnitude() reads after the LRN; see rhythm_text().
+ */
+void magnitude_text( char *into, const magnitude_t *mag, uint8_t id )
+{
+	strcpy( into, "MAG " );
+	into = utod( into+4, id+1 );
+	*into++ = ' ';
+	into = utod( into, mag->period );
+	*into++ = ' ';
+	utod( into, mag->duty );
+}
+
+/** Parse \a argv as one step of a spatio-temporal pattern:
+ *  \<ID> \<STEP> \<OFFSET> \<MRMD>. STEP is an ID letter, OFFSET is in ms
+ *  from the start of the pattern, and MRMD is the motor, rhythm, magnitude
+ *  and duration of the step in the same four-character form used by the
+ *  debug menu (e.g. 3216). If successful, store the step number into
+ *  \a step and the step itself into memory pointed to by \a into.
+ *
+ *  The motor number is not checked against the motors present, and the
+ *  offset is not checked against the neighbouring steps; that is up to the
+ *  caller.
+ */
+error_t parse_spatio( const char *line, int argc, const parse_span_t *argv,
+	uint8_t *step, spatio_step_t *into )
+{
+	unsigned long offset;
+	char *end;
+
+	if( argc != 4 ) return EARG;
+
+	// convert ID and STEP arguments
+	if( argl(0) != 1 || argl(1) != 1 ) return EARG;
+	if( ltoi(0) >= MAX_SPATIO ) return EARG;
+	if( ltoi(1) >= MAX_SSTEPS ) return EINVS;
+	*step = ltoi(1);
+
+	// convert OFFSET argument
+	offset = strtoul( argp(2), &end, 10 );
+	if( end != argp(2)+argl(2) || !argl(2) || offset > 0xffff )
+		return EINVS;
+
+	// convert MRMD argument
+	if( argl(3) != 4 ) return EINVS;
+	if( (uint8_t)(argp(3)[1]-'1') >= MAX_RHYTHM ) return EINVS;
+	if( (uint8_t)(argp(3)[2]-'1') >= MAX_MAGNITUDE ) return EINVS;
+	if( (uint8_t)(argp(3)[3]-'0') > MAX_DURATION ) return EINVS;
+
+	into->offset = offset;
+	into->motor = ltoi(3);
+	into->v.rhythm = argp(3)[1] - '1';
+	into->v.magnitude = argp(3)[2] - '1';
+	into->v.duration = argp(3)[3] - '0';
+
+	return ESUCCESS;
+}
+
+/** \param word
+ *	The first character of the word; need not be null-terminated.
+ *  \param len
+ *	The number of characters in the word.
+ */
+uint16_t parse_key( const char *word, uint8_t len )
+{
+	uint8_t i;
+
+	if( len != 3 ) return 0;
+	for( i=0; i<3; ++i )
+		if( (uint8_t)((word[i] | 0x20) - 'a') >= 26 )
+			return 0;
+
+	return PARSE_KEY( word[0], word[1], word[2] );
+}
+
 /** \param table
  *	Tree that specifies the set of valid commands.
  *  \param line
- *	The command line to be parsed. Its contents will be modified in place.
+ *	The null-terminated command line to be parsed. It is not modified.
  *
- *  The parser begins by iterating through \a table, looking for an entry with
- *  a \a str member that matches the first word of \a line. If such an entry
- *  is found, the parser iterates through the array pointed to by the \a next
- *  field of that entry, attempting to match the second word of \a line to the
- *  \a str field of each entry in that array. This continues until either no
- *  entry matches the next word in \a line, or the next word matches an entry
- *  whose \a next field is NULL.
+ *  The line is split at each space into words, each kept as a parse_span_t
+ *  of \a line. The parser begins by looking up the first word in \a table.
+ *  If an entry with a matching \a key is found, the parser looks up the
+ *  second word in the table pointed to by the \a next field of that entry.
+ *  This continues until either no entry matches the next word in \a line,
+ *  or the next word matches an entry whose \a next field is NULL; the words
+ *  after it are passed to its \a func as spans.
+ *
+ *  Each lookup hashes the word into a slot of the table (see PARSE_TABLE()),
+ *  so it costs the same few program space reads however many words the
+ *  table holds.
  *
  *  \retval EBADCMD
  *	Invalid command; the next word did not match any parse_step_t entry.
@@ -104,52 +245,50 @@ error_t parse_magnitude( int argc, const char *const *argv, magnitude_t *into )
  *  \retval x
  *	Where \a x is any status code that can be returned by the callback
  *	function specified by the \a func field of the parse_step_t entry that
- *	terminated the parse (the \a str field matched the next word of
+ *	terminated the parse (the \a key field matched the next word of
  *	\a line, but the \a next field was NULL).
  */
-error_t parse( const parse_step_t *table, char *line )
+error_t parse( const parse_table_t *table, const char *line )
 {
-	static const char **argv, *words[ PARSE_MAX_WORDS+1 ];
-	parse_step_t step = { "", NULL, NULL };
-	int argc = 1;
+	parse_span_t words[ PARSE_MAX_WORDS ];
+	const parse_step_t *steps;
+	parse_step_t step;
+	uint8_t argc = 0, pos, i, slot;
+	uint16_t key;
 
 	if( *line == '\0' ) return EBADCMD;
 
-	*words = line;
-
 	// split the line into words
-	for( ; *line; ++line ) {
-		if( *line != ' ' ) continue;
+	words[ 0 ].off = 0;
+	for( pos=0; ; ++pos ) {
+		if( line[pos] != ' ' && line[pos] != '\0' ) continue;
 
-		*line = '\0';
+		words[ argc ].len = pos - words[ argc ].off;
+		++argc;
+		if( line[pos] == '\0' ) break;
 
-		if( argc+1 > PARSE_MAX_WORDS )
+		if( argc >= PARSE_MAX_WORDS )
 			return ETOOBIG;
-
-		words[ argc ] = line + 1;
-		++argc;
+		words[ argc ].off = pos + 1;
 	}
-	words[ argc ] = NULL;
-
-	// walk the table to determine which function to call
-	argv = words;
-	memcpy_P( &step, table, sizeof(step) );
-	while( step.str[0] != '\0' ) {
-		if( strcasecmp(step.str, *argv) )
-			++table;
-		else {
-			// this word matched something in the table, so move
-			// argv past it and decrement the argument count
-			++argv;
-			--argc;
-
-			// call the handler if this is the end of the chain
-			if( step.next )
-				table = step.next;
-			else
-				return step.func( argc, argv );
-		}
-		memcpy_P( &step, table, sizeof(step) );
+
+	// walk the tables to determine which function to call
+	for( i=0; i<argc; ++i ) {
+		key = parse_key( line + words[i].off, words[i].len );
+		if( !key ) break;
+
+		slot = pgm_read_byte( table->slot + PARSE_HASH(key) );
+		if( !slot ) break;
+
+		steps = (const parse_step_t*)pgm_read_word( &table->step );
+		memcpy_P( &step, steps + slot - 1, sizeof(step) );
+		if( step.key != key ) break;
+
+		// this word matched something in the table; call the handler
+		// if this is the end of the chain, with the words after it
+		if( !step.next )
+			return step.func( line, argc-i-1, words+i+1 );
+		table = step.next;
 	}
 
 	// no matching command found
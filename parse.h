@@ -14,46 +14,182 @@ extern "C" {
 #endif
 */
 
-#include<avr/pgmspace.h>
+#ifdef __AVR__
+#	include<avr/pgmspace.h>
+#else
+	// not compiling for AVR, e.g. exercising the parser on a host
+	// keep the tables in ordinary memory and read them directly, unless
+	// the host build brings its own readers, e.g. to count them
+#	include<string.h>
+#	define PROGMEM
+#	ifndef memcpy_P
+#		define memcpy_P memcpy
+#	endif
+#	ifndef pgm_read_byte
+#		define pgm_read_byte( _addr_ ) (*(const uint8_t*)(_addr_))
+#	endif
+#	ifndef pgm_read_word
+#		define pgm_read_word( _addr_ ) *(_addr_)
+#	endif
+#endif
 
 #include"rhythm.h"
 #include"magnitude.h"
+#include"spatio.h"
 #include"error.h"
 
 #define PARSE_MAX_WORDS 10	///<Maximum number of words in each command
 #define PARSE_MAX_LEN 32	///<Maximum length of a single command
 
 /// Convert an ASCII ID letter from the given argument number to an index
-#define ltoi( _argnum_ ) ((uint8_t)(*argv[_argnum_] - '1'))
+#define ltoi( _argnum_ ) ((uint8_t)(line[ argv[_argnum_].off ] - '1'))
+
+/// Pointer to the first character of the given argument number
+#define argp( _argnum_ ) ( line + argv[_argnum_].off )
+
+/// Length of the given argument number
+#define argl( _argnum_ ) ( argv[_argnum_].len )
 
 /// Convert an index to an ASCII ID letter
 #define itol( _id_ ) ('1' + _id_)
 
+/// Pack a three-letter command word into a 15-bit, case-insensitive key
+#define PARSE_KEY( _a_, _b_, _c_ ) \
+	( ((_a_)&0x1f)<<10 | ((_b_)&0x1f)<<5 | ((_c_)&0x1f) )
+
+/// Number of bits in the hash of a command word key; at most 8
+#ifndef PARSE_HASH_BITS
+#	define PARSE_HASH_BITS 5
+#endif
+/// Number of hash slots in each parse table
+#define PARSE_SLOTS (1<<PARSE_HASH_BITS)
+/** \brief Multiplier for PARSE_HASH(). If a new command word makes a
+ *  table fail to compile, pick another odd value that hashes every table
+ *  without collisions.
+ */
+#define PARSE_HASH_MUL 0x6f55u
+/// Hash a key from PARSE_KEY() into a slot of a parse table
+#define PARSE_HASH( _key_ ) \
+	( (uint16_t)((unsigned)(_key_) * PARSE_HASH_MUL) >> (16-PARSE_HASH_BITS) )
+
+/// One word of a command line, located by its offset and length
+/** Words are never null-terminated in place, so that the line itself can be
+ *  relayed to the motors as it was received.
+ */
+typedef struct {
+	uint8_t off;	///<Offset of the first character of the word
+	uint8_t len;	///<Number of characters in the word
+} parse_span_t;
+
 /// Function pointer type for individual command handlers
-typedef error_t (*parse_func_t)( int argc, const char *const *argv );
+/** \a argv holds the \a argc words of \a line that follow the command. */
+typedef error_t (*parse_func_t)( const char *line, int argc,
+	const parse_span_t *argv );
+
+struct parse_table_s;
 
 /** \brief Parse table constituent type. See parse() for details and
- *  learn_tiny.c for examples.
+ *  pt_top in haptic_firmware.ino for examples.
  */
 typedef struct parse_step_s {
-	/// A word that can occur as part of a valid command
-	const char str[4];
-	/// Array of words that can occur next if \a str was matched
-	const struct parse_step_s *next;
-	/// Function to call when \a str is matched and \a next is NULL
+	/// PARSE_KEY() of a word that can occur as part of a valid command
+	uint16_t key;
+	/// Table of words that can occur next if \a key was matched
+	const struct parse_table_s *next;
+	/// Function to call when \a key is matched and \a next is NULL
 	parse_func_t func;
 } parse_step_t;
 
+/// Parse table: a set of parse_step_t, indexed by the hash of their keys
+/** Build these with PARSE_TABLE() rather than by hand. */
+typedef struct parse_table_s {
+	/// For each hash slot, 1 + index into \a step of its word, or 0
+	uint8_t slot[ PARSE_SLOTS ];
+	/// The words themselves, in any order
+	const parse_step_t *step;
+} parse_table_t;
+
+#ifdef __cplusplus
+/// Find the step whose key hashes to \a slot; see PARSE_TABLE()
+constexpr uint8_t parse_slot( const parse_step_t *step, uint8_t n,
+	uint8_t slot
+) {
+	return !n? 0 :
+		PARSE_HASH(step[n-1].key) == slot? n :
+		parse_slot( step, n-1, slot );
+}
+
+/// Check that no two of the first \a n steps share a hash slot
+constexpr bool parse_perfect( const parse_step_t *step, uint8_t n )
+{
+	return n < 2 ||
+		( parse_slot(step, n-1, PARSE_HASH(step[n-1].key)) == 0 &&
+		parse_perfect(step, n-1) );
+}
+
+/// List of the slot numbers 0 to PARSE_SLOTS-1; see PARSE_TABLE()
+template< unsigned... I > struct parse_slots {};
+/// Build parse_slots<0, ..., N-1> as \a type
+template< unsigned N, unsigned... I > struct parse_slots_to
+	: parse_slots_to< N-1, N-1, I... > {};
+template< unsigned... I > struct parse_slots_to< 0, I... > {
+	typedef parse_slots< I... > type;
+};
+
+/// Fill in every hash slot of a parse table over the \a n steps at \a step
+template< unsigned... I >
+constexpr parse_table_t parse_table( const parse_step_t *step, uint8_t n,
+	parse_slots< I... >
+) {
+	return { { parse_slot(step, n, I)... }, step };
+}
+
+/// Number of elements in a constexpr array of steps
+#define PARSE_COUNT( _s_ ) ( sizeof(_s_) / sizeof(*(_s_)) )
+
+/** \brief Initializer for a parse_table_t over a constexpr array of steps.
+ *  The PARSE_SLOTS hash slots are filled in at compile time; use
+ *  PARSE_CHECK() on the array as well, to catch words that collide.
+ */
+#define PARSE_TABLE( _s_ ) parse_table( _s_, PARSE_COUNT(_s_), \
+	parse_slots_to< PARSE_SLOTS >::type() )
+
+/// Fail the build if two words of an array of steps share a hash slot
+#define PARSE_CHECK( _s_ ) static_assert( \
+	parse_perfect(_s_, PARSE_COUNT(_s_)), \
+	"parse table hash collision; change PARSE_HASH_MUL" )
+#endif
+
 /// Convert an ASCII hex digit into an integer (-1 if not a hex digit)
 int8_t htoi( char digit );
 
+/// Convert an unsigned byte to two ASCII hex digits plus null terminator
+void itoh( char *into, uint8_t val );
+
+/// Convert a rhythm or magnitude ID to an index; 0xff if it is not one
+uint8_t parse_id( const char *word, uint8_t len );
+
 /// Convert a rhythm specification into native format at the given location
-error_t parse_rhythm( int argc, const char *const *argv, rhythm_t *into );
+error_t parse_rhythm( const char *line, int argc,
+	const parse_span_t *argv, uint8_t max, rhythm_t *into );
 /// Convert a magnitude specification into native format at the given location
-error_t parse_magnitude( int argc, const char *const *argv, magnitude_t *into );
+error_t parse_magnitude( const char *line, int argc,
+	const parse_span_t *argv, uint8_t max, magnitude_t *into );
+
+/// Convert a rhythm into the text parse_rhythm() reads, with ID index \a id
+void rhythm_text( char *into, const rhythm_t *rhy, uint8_t id );
+/// Convert a magnitude into the text parse_magnitude() reads; see above
+void magnitude_text( char *into, const magnitude_t *mag, uint8_t id );
+
+/// Convert one step of a spatio-temporal pattern into native format
+error_t parse_spatio( const char *line, int argc,
+	const parse_span_t *argv, uint8_t *step, spatio_step_t *into );
+
+/// Main parser for learning mode commands; leaves \a line unchanged
+error_t parse( const parse_table_t *table, const char *line );
 
-/// Main parser for learning mode commands; modifies \a line in place
-error_t parse( const parse_step_t *table, char *line );
+/// Compute the PARSE_KEY() of a word; 0 if it is not three letters long
+uint16_t parse_key( const char *word, uint8_t len );
 
 /*
 #ifdef __cplusplus
@@ -0,0 +1,46 @@
+/*************************************************************************//**
+ * \file   Arduino.h
+ * \brief  The parts of the Arduino core the sketch uses, for the simulator.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/pgmspace.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+#define DEC 10
+#define HEX 16
+
+typedef uint8_t byte;
+
+/// Simulated time; see belt.h
+unsigned long millis( void );
+unsigned long micros( void );
+void delay( unsigned long ms );
+void delayMicroseconds( unsigned int us );
+
+inline void pinMode( uint8_t, uint8_t ) {}
+inline void digitalWrite( uint8_t, uint8_t ) {}
+
+/// avr-libc conversion, missing from glibc
+inline char *utoa( unsigned val, char *s, int radix )
+{
+	sprintf( s, radix == 16? "%x" : "%u", val );
+	return s;
+}
+
+#include "HardwareSerial.h"
+
+#endif
@@ -0,0 +1,22 @@
+/*************************************************************************//**
+ * \file   EEPROM.h
+ * \brief  Simulated EEPROM of EE_SIZE bytes, erased to 0xff and timed like the
+ *         real one.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SIM_EEPROM_H
+#define SIM_EEPROM_H
+
+#include <stdint.h>
+
+/// EEPROM with the Arduino interface
+class EEPROMClass {
+public:
+	uint8_t read( int addr );
+	void write( int addr, uint8_t val );
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
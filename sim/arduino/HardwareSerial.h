@@ -0,0 +1,44 @@
+/*************************************************************************//**
+ * \file   HardwareSerial.h
+ * \brief  Simulated serial port; the host side is driven by host.cpp.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SIM_HARDWARESERIAL_H
+#define SIM_HARDWARESERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Serial port with the Arduino interface, timed by belt.cpp
+class HardwareSerial {
+public:
+	void begin( unsigned long baud );
+	void end( void ) {}
+	int available( void );
+	int read( void );
+	int peek( void );
+	void flush( void );
+
+	size_t write( uint8_t ch );
+	size_t write( const uint8_t *buf, size_t len );
+	size_t write( const char *str );
+
+	size_t print( const char *str ) { return write( str ); }
+	size_t print( char ch ) { return write( (uint8_t)ch ); }
+	size_t print( unsigned char val, int base = 10 ) { return print( (unsigned long)val, base ); }
+	size_t print( int val, int base = 10 ) { return print( (long)val, base ); }
+	size_t print( unsigned val, int base = 10 ) { return print( (unsigned long)val, base ); }
+	size_t print( long val, int base = 10 );
+	size_t print( unsigned long val, int base = 10 );
+
+	size_t println( void ) { return write( "\r\n" ); }
+	template<typename T> size_t println( T val ) { return print( val ) + println(); }
+	template<typename T> size_t println( T val, int base ) { return print( val, base ) + println(); }
+
+	operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
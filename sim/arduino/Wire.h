@@ -0,0 +1,35 @@
+/*************************************************************************//**
+ * \file   Wire.h
+ * \brief  Simulated TWI master; the bus and tactors are modelled in belt.cpp.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SIM_WIRE_H
+#define SIM_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// TWI master with the Arduino interface
+class TwoWire {
+public:
+	void begin( void ) {}
+	void setClock( uint32_t hz );
+	void beginTransmission( uint8_t addr );
+	void beginTransmission( int addr ) { beginTransmission( (uint8_t)addr ); }
+	uint8_t endTransmission( uint8_t stop = 1 );
+	size_t write( uint8_t ch );
+	size_t write( int ch ) { return write( (uint8_t)ch ); }
+	size_t write( unsigned ch ) { return write( (uint8_t)ch ); }
+	size_t write( const uint8_t *buf, size_t len );
+	size_t write( const char *str );
+	uint8_t requestFrom( uint8_t addr, uint8_t len, uint8_t stop = 1 );
+	uint8_t requestFrom( int addr, int len, int stop = 1 )
+		{ return requestFrom( (uint8_t)addr, (uint8_t)len, (uint8_t)stop ); }
+	int available( void );
+	int read( void );
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,19 @@
+/*************************************************************************//**
+ * \file   pgmspace.h
+ * \brief  Program space access; on the host it is ordinary memory.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SIM_PGMSPACE_H
+#define SIM_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR( _s_ ) (_s_)
+#define pgm_read_byte( _addr_ ) (*(const uint8_t*)(_addr_))
+#define pgm_read_word( _addr_ ) *(_addr_)
+#define memcpy_P memcpy
+
+#endif
@@ -0,0 +1,9 @@
+/*************************************************************************//**
+ * \file   power.h
+ * \brief  Power reduction; nothing to do on the host.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#define power_adc_enable()
+#define power_spi_disable()
+#define power_timer1_disable()
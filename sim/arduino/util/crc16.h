@@ -0,0 +1,24 @@
+/*************************************************************************//**
+ * \file   crc16.h
+ * \brief  The avr-libc CRC used by framed mode, in plain C.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SIM_CRC16_H
+#define SIM_CRC16_H
+
+#include <stdint.h>
+
+/// CRC-16/XMODEM, polynomial 0x1021, as in avr-libc
+static inline uint16_t _crc_xmodem_update( uint16_t crc, uint8_t data )
+{
+	int i;
+
+	crc ^= (uint16_t)data << 8;
+	for( i=0; i<8; ++i )
+		crc = crc & 0x8000? (crc << 1) ^ 0x1021 : crc << 1;
+
+	return crc;
+}
+
+#endif
@@ -0,0 +1,467 @@
+/*************************************************************************//**
+ * \file   belt.cpp
+ * \brief  Discrete-event model of a belt, for running the sketch on a host.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+// keep glibc's error_t out of the way of the firmware's
+#define __error_t_defined 1
+
+#include "belt.h"
+#include "Arduino.h"
+#include "Wire.h"
+#include "EEPROM.h"
+#include "error.h"
+#include "wire_err.h"
+
+#include <deque>
+#include <vector>
+
+// as many segments as the sketch was built for, unless told otherwise
+#ifndef TWI_SEGMENTS
+#	define TWI_SEGMENTS 1
+#endif
+
+HardwareSerial Serial;
+TwoWire Wire;
+EEPROMClass EEPROM;
+
+namespace sim {
+
+uint64_t now_ns;
+config_t config = { 4, TWI_SEGMENTS, 0, 100000, 0, 0 };
+counters_t count;
+void (*host_poll)( void );
+void (*tactor_hit)( tactor_t *t, uint8_t v );
+unsigned long ee_left;
+void (*power_fail)( void );
+
+/// Size of the serial receive and transmit buffers of the Arduino core
+#define SERIAL_BUF 64
+
+/// TWI address of the multiplexer; see TWI_MUX_ADDR
+#define MUX_ADDR 0x70
+
+/// Byte in flight on the serial link, with the time it arrives
+struct timed_t {
+	uint8_t ch;
+	uint8_t over;	///<1 once counted as an overrun
+	uint64_t at;
+};
+
+static std::vector<tactor_t> belt;
+static std::deque<timed_t> rx, tx;	///<Towards the sketch, and the host
+static uint64_t rx_free, tx_free;	///<When each direction is next idle
+static unsigned long baud;		///<Rate the sketch last set
+
+static unsigned long twi_hz;
+static uint8_t twi_addr, twi_seg, twi_open;
+static std::vector<uint8_t> twi_tx;
+static std::deque<uint8_t> twi_rx;
+static uint32_t seed = 1;
+
+/// Size of the EEPROM; the sketch is built with the same EE_SIZE
+#ifndef EE_SIZE
+#	define EE_SIZE 1024
+#endif
+static uint8_t eeprom[ EE_SIZE ];
+
+/// Time to send one serial byte, 10 bits with start and stop
+static uint64_t byte_ns( void )
+{
+	unsigned long rate = config.baud? config.baud : baud;
+	return rate? 10000000000ULL / rate : 0;
+}
+
+/// Roll for a chance of \a per in 1000
+static bool roll( unsigned per )
+{
+	if( !per ) return false;
+
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % 1000 < per;
+}
+
+/// Put a serial byte on the line towards \a q, unless it is lost
+/** A byte is lost or damaged by the chances in config; a lost byte still
+ *  takes up its time on the line.
+ */
+static void line_put( std::deque<timed_t> &q, uint8_t ch, uint64_t at )
+{
+	timed_t b;
+
+	if( roll(config.drop) ) {
+		++count.dropped;
+		return;
+	}
+	if( roll(config.corrupt) ) {
+		ch ^= 1 << ( seed >> 8 & 7 );
+		++count.corrupted;
+	}
+
+	b.ch = ch;
+	b.over = 0;
+	b.at = at;
+	q.push_back( b );
+}
+
+void belt_init( void )
+{
+	unsigned per = (config.motors + config.segments-1) / config.segments;
+	unsigned i;
+
+	belt.resize( config.motors );
+	for( i=0; i<config.motors; ++i ) {
+		memset( &belt[i], 0, sizeof(belt[i]) );
+		belt[i].seg = i / per;
+		belt[i].addr = 0x10 + i % per;
+		belt[i].alive = 1;
+		belt[i].gen = 0xffff;
+	}
+
+	twi_hz = config.twi_hz;
+	memset( eeprom, 0xff, sizeof(eeprom) );
+}
+
+tactor_t *tactor( uint8_t seg, uint8_t addr )
+{
+	for( size_t i=0; i<belt.size(); ++i )
+		if( belt[i].seg == seg && belt[i].addr == addr )
+			return &belt[i];
+	return NULL;
+}
+
+unsigned tactors( void ) { return belt.size(); }
+
+tactor_t *tactor_at( unsigned i ) { return &belt[i]; }
+
+void brownout( tactor_t *t )
+{
+	memset( t->rhy, 0, sizeof(t->rhy) );
+	memset( t->mag, 0, sizeof(t->mag) );
+	t->status = 0;
+	t->gen = 0xffff;
+}
+
+uint64_t host_send( const uint8_t *buf, size_t len, uint64_t at_ns )
+{
+	if( rx_free < at_ns ) rx_free = at_ns;
+	count.down += len;
+	for( ; len; --len ) {
+		rx_free += byte_ns();
+		line_put( rx, *buf++, rx_free );
+	}
+
+	return rx_free;
+}
+
+void link_clear( void )
+{
+	rx.clear();
+	tx.clear();
+}
+
+int host_recv( uint64_t *at )
+{
+	int ch;
+
+	if( tx.empty() || tx.front().at > now_ns ) return -1;
+
+	ch = tx.front().ch;
+	*at = tx.front().at;
+	tx.pop_front();
+	return ch;
+}
+
+/// Take up the TWI bus for a transaction of \a bytes, address included
+static void twi_charge( size_t bytes )
+{
+	// 9 clocks per byte with its ack, plus start and stop
+	uint64_t ns = (9*bytes + 2) * 1000000000ULL / twi_hz;
+
+	now_ns += ns;
+	count.twi_ns += ns;
+}
+
+/// Roll for whether \a t fails to acknowledge this transaction
+static bool twi_nack( const tactor_t *t )
+{
+	if( !t || !t->alive ) return true;
+	if( t->max_khz && twi_hz > t->max_khz * 1000UL ) return true;
+	if( !t->nack_pct ) return false;
+
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % 100 < t->nack_pct;
+}
+
+/// Hand a command written over TWI to a tactor
+/** A single byte is a vibration_t; anything longer is a learn command in
+ *  text, "LRN RHY <ID> ..." or "LRN MAG <ID> ...", IDs from 1, which also
+ *  forget the generation tag, or "LRN GEN <HEX>", which sets it.
+ */
+static void tactor_rx( tactor_t *t, const uint8_t *buf, size_t len )
+{
+	if( len == 1 ) {
+		uint8_t v = buf[0];
+
+		if( !(v & 7) )
+			t->status = ESUCCESS;	// duration 0 stops the motor
+		else if( !t->rhy[v >> 5] )
+			t->status = ENOR;
+		else if( !t->mag[(v >> 3) & 3] )
+			t->status = ENOM;
+		else	t->status = ESUCCESS;
+		if( tactor_hit && t->status == ESUCCESS ) tactor_hit( t, v );
+		return;
+	}
+
+	if( len == 12 && !memcmp(buf, "LRN GEN ", 8) ) {
+		char hex[ 5 ];
+
+		memcpy( hex, buf+8, 4 );
+		hex[4] = '\0';
+		t->gen = strtoul( hex, NULL, 16 );
+		t->status = ESUCCESS;
+		return;
+	}
+
+	t->gen = 0xffff;
+	if( len > 9 && !memcmp(buf, "LRN RHY ", 8) ) {
+		unsigned id = buf[8] - '1';
+
+		t->status = id < 8? ESUCCESS : EARG;
+		if( id < 8 ) t->rhy[ id ] = 1;
+	}else if( len > 9 && !memcmp(buf, "LRN MAG ", 8) ) {
+		unsigned id = buf[8] - '1';
+
+		t->status = id < 4? ESUCCESS : EARG;
+		if( id < 4 ) t->mag[ id ] = 1;
+	}else	t->status = EBADVC;
+}
+
+} // namespace sim
+
+using namespace sim;
+
+unsigned long millis( void )
+{
+	now_ns += COST_CLOCK;
+	return now_ns / 1000000;
+}
+
+unsigned long micros( void )
+{
+	now_ns += COST_CLOCK;
+	return now_ns / 1000;
+}
+
+void delay( unsigned long ms ) { now_ns += ms * 1000000ULL; }
+
+void delayMicroseconds( unsigned int us ) { now_ns += us * 1000ULL; }
+
+void HardwareSerial::begin( unsigned long rate )
+{
+	flush();
+	baud = rate;
+}
+
+int HardwareSerial::available( void )
+{
+	size_t n;
+
+	if( host_poll ) host_poll();
+
+	// the real buffer would have dropped the bytes past SERIAL_BUF; they
+	// are kept, so that the run stays in step, but counted
+	for( n=0; n<rx.size() && rx[n].at <= now_ns; ++n )
+		if( n >= SERIAL_BUF && !rx[n].over ) {
+			rx[n].over = 1;
+			++count.overrun;
+		}
+
+	if( !n ) now_ns += COST_IDLE;
+	return n;
+}
+
+int HardwareSerial::read( void )
+{
+	int ch;
+
+	if( rx.empty() || rx.front().at > now_ns ) return -1;
+
+	ch = rx.front().ch;
+	rx.pop_front();
+	return ch;
+}
+
+int HardwareSerial::peek( void )
+{
+	if( rx.empty() || rx.front().at > now_ns ) return -1;
+	return rx.front().ch;
+}
+
+void HardwareSerial::flush( void )
+{
+	if( now_ns < tx_free ) now_ns = tx_free;
+}
+
+size_t HardwareSerial::write( uint8_t ch )
+{
+	size_t queued = 0;
+	std::deque<timed_t>::reverse_iterator i;
+
+	// block while the transmit buffer is full, as the Arduino core does
+	for( i=tx.rbegin(); i!=tx.rend() && i->at > now_ns; ++i )
+		++queued;
+	if( queued >= SERIAL_BUF )
+		now_ns = tx[ tx.size() - queued ].at;
+
+	if( tx_free < now_ns ) tx_free = now_ns;
+	tx_free += byte_ns();
+	++count.up;
+	line_put( tx, ch, tx_free );
+
+	return 1;
+}
+
+size_t HardwareSerial::write( const uint8_t *buf, size_t len )
+{
+	for( size_t i=0; i<len; ++i )
+		write( buf[i] );
+	return len;
+}
+
+size_t HardwareSerial::write( const char *str )
+{
+	return write( (const uint8_t*)str, strlen(str) );
+}
+
+size_t HardwareSerial::print( long val, int base )
+{
+	char buf[ 24 ];
+
+	snprintf( buf, sizeof(buf), base == 16? "%lX" : "%ld", val );
+	return write( buf );
+}
+
+size_t HardwareSerial::print( unsigned long val, int base )
+{
+	char buf[ 24 ];
+
+	snprintf( buf, sizeof(buf), base == 16? "%lX" : "%lu", val );
+	return write( buf );
+}
+
+void TwoWire::setClock( uint32_t hz ) { twi_hz = hz; }
+
+void TwoWire::beginTransmission( uint8_t addr )
+{
+	twi_addr = addr;
+	twi_open = 1;
+	twi_tx.clear();
+}
+
+size_t TwoWire::write( uint8_t ch )
+{
+	if( twi_tx.size() >= 32 ) return 0;	// the Wire buffer is 32 bytes
+	twi_tx.push_back( ch );
+	return 1;
+}
+
+size_t TwoWire::write( const uint8_t *buf, size_t len )
+{
+	size_t i;
+
+	for( i=0; i<len && write(buf[i]); ++i );
+	return i;
+}
+
+size_t TwoWire::write( const char *str )
+{
+	return write( (const uint8_t*)str, strlen(str) );
+}
+
+uint8_t TwoWire::endTransmission( uint8_t stop )
+{
+	tactor_t *t;
+	bool ack = false;
+
+	if( !twi_open ) return WE_SUCCESS;
+	twi_open = 0;
+
+	twi_charge( 1 + twi_tx.size() );
+	++count.tx;
+
+	if( config.segments > 1 && twi_addr == MUX_ADDR ) {
+		++count.mux;
+		twi_seg = twi_tx.size()? __builtin_ctz( twi_tx[0] | 0x100 ) : 0;
+		return WE_SUCCESS;
+	}
+
+	// general call: every tactor on the segment takes it
+	if( twi_addr == 0 ) {
+		for( size_t i=0; i<belt.size(); ++i ) {
+			t = &belt[i];
+			if( t->seg != twi_seg || twi_nack(t) ) continue;
+			tactor_rx( t, twi_tx.data(), twi_tx.size() );
+			ack = true;
+		}
+		if( !ack ) ++count.nack;
+		return ack? WE_SUCCESS : WE_ANACK;
+	}
+
+	t = tactor( twi_seg, twi_addr );
+	if( twi_nack(t) ) {
+		++count.nack;
+		return WE_ANACK;
+	}
+	tactor_rx( t, twi_tx.data(), twi_tx.size() );
+
+	return WE_SUCCESS;
+}
+
+uint8_t TwoWire::requestFrom( uint8_t addr, uint8_t len, uint8_t stop )
+{
+	tactor_t *t = tactor( twi_seg, addr );
+
+	twi_charge( 1 + len );
+	++count.rx;
+	twi_rx.clear();
+
+	if( twi_nack(t) ) {
+		++count.nack;
+		return 0;
+	}
+
+	twi_rx.push_back( t->status );
+	twi_rx.push_back( t->gen >> 8 );
+	twi_rx.push_back( t->gen & 0xff );
+	while( twi_rx.size() < len )
+		twi_rx.push_back( 0 );
+	twi_rx.resize( len );
+
+	return len;
+}
+
+int TwoWire::available( void ) { return twi_rx.size(); }
+
+int TwoWire::read( void )
+{
+	int ch;
+
+	if( twi_rx.empty() ) return -1;
+	ch = twi_rx.front();
+	twi_rx.pop_front();
+	return ch;
+}
+
+uint8_t EEPROMClass::read( int addr ) { return eeprom[ addr % EE_SIZE ]; }
+
+void EEPROMClass::write( int addr, uint8_t val )
+{
+	if( ee_left && !--ee_left && power_fail )
+		power_fail();
+	now_ns += COST_EEPROM;
+	++count.ee;
+	eeprom[ addr % EE_SIZE ] = val;
+}
@@ -0,0 +1,123 @@
+/*************************************************************************//**
+ * \file   belt.h
+ * \brief  Discrete-event model of a belt, for running the sketch on a host.
+ * \date   20261016 - initial version
+ *
+ * The sketch is built unmodified against the Serial, Wire and EEPROM
+ * objects in belt.cpp, which keep a simulated clock instead of a real one.
+ * Time moves on only by what the model charges for: serial bytes at the
+ * configured rate, TWI transactions at the clock the sketch set, EEPROM
+ * writes, and a small fixed cost per loop() pass and per clock read. Runs
+ * are therefore exactly repeatable.
+ *
+ * Each tactor keeps its own rhythm and magnitude tables, answers a one-byte
+ * vibration with ENOR/ENOM if it has not learned them, can be made to stop
+ * acknowledging some or all transactions, and can brown out, forgetting
+ * everything it learned. It also keeps the generation tag it was last sent
+ * with "LRN GEN <HEX>", forgets it when it learns anything else, and sends
+ * it after its status byte, most significant byte first; 0xffff for none.
+ ****************************************************************************/
+
+#ifndef SIM_BELT_H
+#define SIM_BELT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace sim {
+
+/// Simulated time, in ns since the run began
+extern uint64_t now_ns;
+
+/// Costs charged to the sketch's own work, in ns
+enum {
+	COST_CLOCK = 500,	///<Each millis() or micros() call
+	COST_LOOP = 10000,	///<Each loop() pass
+	COST_IDLE = 5000,	///<Each Serial.available() with nothing to read
+	COST_EEPROM = 3300000	///<Each EEPROM byte written
+};
+
+/// Simulated tactor
+struct tactor_t {
+	uint8_t seg;		///<TWI segment
+	uint8_t addr;		///<TWI address
+	uint8_t alive;		///<0 if it does not answer at all
+	uint8_t nack_pct;	///<Percentage of transactions not acknowledged
+	uint16_t max_khz;	///<Fastest TWI clock it copes with; 0 for any
+	uint8_t rhy[ 8 ];	///<1 for each rhythm learned
+	uint8_t mag[ 4 ];	///<1 for each magnitude learned
+	uint8_t status;		///<Status of the last command, read back
+	uint16_t gen;		///<Generation tag; 0xffff for none
+};
+
+/// Belt and link settings; set before setup() is called
+struct config_t {
+	unsigned motors;	///<Number of tactors, from address 0x10 up
+	unsigned segments;	///<TWI segments the tactors are spread over
+	unsigned long baud;	///<Serial rate; 0 for a link with no delay
+	unsigned long twi_hz;	///<TWI clock until the sketch sets one
+	unsigned drop;		///<Serial bytes lost, per 1000, either way
+	unsigned corrupt;	///<Serial bytes with a bit flipped, per 1000
+};
+
+/// Counters kept by the model
+struct counters_t {
+	uint64_t twi_ns;	///<Time the TWI bus was busy
+	unsigned long tx;	///<TWI write transactions, multiplexer included
+	unsigned long rx;	///<TWI read transactions
+	unsigned long nack;	///<Transactions not acknowledged
+	unsigned long mux;	///<Multiplexer switches
+	unsigned long ee;	///<EEPROM bytes written
+	unsigned long overrun;	///<Bytes that would have overrun the RX buffer
+	unsigned long dropped;	///<Serial bytes lost to config.drop
+	unsigned long corrupted;	///<Serial bytes damaged by config.corrupt
+	unsigned long down;	///<Serial bytes from the host to the sketch
+	unsigned long up;	///<Serial bytes from the sketch to the host
+};
+
+extern config_t config;
+extern counters_t count;
+
+/// Build the tactors from \a config; call once, before setup()
+void belt_init( void );
+
+/// Tactor at TWI address \a addr on segment \a seg, or NULL
+tactor_t *tactor( uint8_t seg, uint8_t addr );
+
+/// Number of tactors made by belt_init()
+unsigned tactors( void );
+
+/// Tactor \a i, in segment then address order
+tactor_t *tactor_at( unsigned i );
+
+/// Make a tactor forget everything it has learned, its tag included
+void brownout( tactor_t *t );
+
+/// Queue bytes from the host, arriving no sooner than \a at_ns
+/** Bytes arrive one after another at the serial rate. The return value is
+ *  when the last of them has arrived.
+ */
+uint64_t host_send( const uint8_t *buf, size_t len, uint64_t at_ns );
+
+/// Take the next byte the host has received by now; -1 if none
+/** \a at is set to the time the byte arrived. */
+int host_recv( uint64_t *at );
+
+/// Called whenever the sketch looks for serial input; see host.cpp
+extern void (*host_poll)( void );
+
+/// Called whenever a tactor takes a vibration; may be NULL
+extern void (*tactor_hit)( tactor_t *t, uint8_t v );
+
+/// EEPROM bytes the sketch may still write; 0 for no limit. See power_fail
+extern unsigned long ee_left;
+
+/// Called in place of the EEPROM write that uses up ee_left; must not return
+extern void (*power_fail)( void );
+
+/// Drop every serial byte still on the line, both ways
+void link_clear( void );
+
+} // namespace sim
+
+#endif
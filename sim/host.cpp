@@ -0,0 +1,1093 @@
+/*************************************************************************//**
+ * \file   host.cpp
+ * \brief  Scenario runner for the belt simulator.
+ * \date   20261016 - initial version
+ *
+ * Plays the part of the host PC. It boots the sketch, then works through a
+ * scenario script one step at a time, feeding the sketch serial input at the
+ * simulated time it is due and reading its replies. Steps, one per line:
+ *
+ *	motors N	number of tactors (before the first other step)
+ *	segments N	TWI segments they are spread over (likewise); more
+ *			than one needs the sketch built with TWI_SEGMENTS
+ *	baud N		serial rate, instead of the one the sketch sets
+ *	twi N		TWI clock in Hz until the sketch sets one
+ *	line TEXT	send a learning mode line; wait for its STS
+ *	begin		BGN, into active mode
+ *	end		ACX_LRN, back to learning mode
+ *	load RATE N [M]	offer N activations at RATE per second, round robin
+ *			over the first M motors, or all; wait for every status
+ *	pipe DEPTH N	send N activations round robin over the motors,
+ *			keeping DEPTH in flight, as a pipelined client does
+ *	working W	have the activations of later load, pipe and frames
+ *			steps go round W library rhythms, with ACX_LIB
+ *			prefixes past the eighth; 0 for the usual ones
+ *	send N HEX...	send the active mode bytes HEX; wait for N bytes
+ *			back, and print them
+ *	hits [M]	print the tactors, from 1, that took a vibration
+ *			since the last send or sched step, and when from the start
+ *			of it; only those from tactor M on, if given
+ *	burst K HEX...	send the active mode command HEX K times, each once
+ *			the status of the one before is back, timing them
+ *	sched N MS LEAD	ACX_SYNC, then N activations round robin over the
+ *			motors, each with an ACX_AT prefix, due MS ms apart
+ *			from LEAD ms on; wait for every status
+ *	framed [BAUD]	FRM, into framed mode; see frame.h
+ *	frames N	send N activations round robin over the motors in
+ *			frames, keeping FRM_WINDOW in flight, resending by
+ *			go-back-N; wait for every frame to be acked
+ *	unframe		ACX_LRN in a frame, back to learning mode
+ *	noise DROP BAD	lose DROP and damage BAD serial bytes per 1000,
+ *			each way
+ *	export		QRY CFG, keeping the library image it sends
+ *	import [BAD] [hold BYTE MS]
+ *			LRN CFG of the image kept, a chunk for each CFG_XON;
+ *			with BAD, byte BAD of it damaged on the way; with
+ *			hold, byte BYTE and the rest of its chunk sent MS ms
+ *			late
+ *	wait MS		let MS ms pass
+ *	brownout [ADDR]	a tactor (hex TWI address), or all, forgets everything
+ *	nack ADDR PCT	a tactor (or "all") fails PCT% of transactions
+ *	slow ADDR KHZ	a tactor (or "all") fails every transaction at a
+ *			TWI clock faster than KHZ kHz; 0 for none
+ *	report [LABEL]	print what was measured since the last report
+ *	reached		print how many tactors took a vibration since the
+ *			last report, and the first few that did not
+ *	reboot		restart the sketch, in learning mode; the tactors
+ *			and the EEPROM keep what they hold
+ *	cut N		the power fails in place of the sketch's Nth EEPROM
+ *			write from now on, ending the step it comes in; the
+ *			sketch restarts as for reboot, with whatever was on
+ *			the serial link lost
+ *
+ * A report gives the latency from offering each command to its status, and
+ * of those vibrations that reached a tactor, from offering to the tactor;
+ * for those of a sched step, how late they reached it instead. It also
+ * counts the TWI transactions and multiplexer switches, the serial bytes
+ * each way and the EEPROM bytes written.
+ * The brownout, nack and slow steps may also come before the boot, after
+ * the settings. Blank lines and lines starting with '#' are skipped. RSP lines the sketch
+ * sends are printed as they arrive. The boot, and each reboot, is reported on
+ * its own.
+ *
+ * Build from the directory above with, for example,
+ *	g++ -O2 -include sim/prelude.h -Isim -Isim/arduino -I. \
+ *		-x c++ haptic_firmware.ino -x none debug_main.cpp \
+ *		sim/belt.cpp sim/host.cpp -o belt_sim
+ *	./belt_sim [-m MOTORS] [-s SEGMENTS] sim/scenarios/load.txt
+ * adding -DTWI_SEGMENTS=N for a belt on a multiplexer.
+ ****************************************************************************/
+
+// keep glibc's error_t out of the way of the firmware's
+#define __error_t_defined 1
+
+#include "belt.h"
+#include "active_command.h"
+#include "error.h"
+#include "frame.h"
+#include "util/crc16.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+void setup( void );
+void loop( void );
+
+using namespace sim;
+
+/// Command offered to the sketch in active mode, waiting for its status
+struct offer_t {
+	uint64_t at;		///<When the host offered it
+	bool timed;		///<Whether it counts towards the report
+	uint8_t tag;		///<The vibration itself; see offer_load()
+	uint64_t due;		///<When a scheduled one should reach its tactor
+};
+
+static std::vector<std::string> script;
+static size_t step;			///<Next step of the script
+static bool busy;			///<Waiting for the current step to finish
+static bool active;			///<The sketch is in active mode
+static bool booted;			///<setup() has returned
+static bool rebooting;			///<A reboot step is due
+static uint64_t until;			///<End of a wait step
+
+static std::deque<offer_t> offers;	///<Active commands not yet answered
+static std::vector< std::deque<offer_t> > cues;	///<Not yet taken, by motor
+static std::string line;		///<Reply line being received
+static unsigned long piped;		///<Activations of a pipe step to send
+static unsigned working;		///<Library rhythms to go round; 0 if not
+
+/// Reply of a send step, or of the ACX_SYNC of a sched step
+static struct {
+	size_t need;			///<Bytes still to come
+	std::vector<uint8_t> got;	///<Bytes so far
+	uint64_t start;			///<When the bytes were sent
+	unsigned n, ms, lead;		///<Activations of a sched step to send
+} raw;
+
+/// Tactor and time of each vibration taken since the last send step
+static std::vector< std::pair<unsigned, uint64_t> > hit_log;
+
+/// Command of a burst step
+static struct {
+	std::vector<uint8_t> cmd;	///<Its bytes
+	unsigned long left;		///<Times still to send it
+} burst;
+
+/// Time after which the frames not yet acked are sent again, in ns
+#define FRM_RESEND 50000000ULL
+
+/// Byte with which the sketch asks for the next chunk of a LRN CFG image
+#define CFG_XON 0x11
+/// Bytes of a LRN CFG image sent for each CFG_XON
+#define CFG_CHUNK 16
+
+/// Library image of the export and import steps
+static struct {
+	std::vector<uint8_t> img;	///<Image QRY CFG sent
+	std::string crc;		///<Its CRC, as QRY CFG sent it
+	size_t need;			///<Bytes of the image still to come
+	size_t sent;			///<Bytes of it sent by an import step
+	long bad;			///<Byte to damage on import; -1 if none
+	long hold;			///<Byte to send late on import; -1 if none
+	uint64_t hold_ns;		///<How late it and the rest of its chunk are
+	uint64_t start;			///<When the step started
+	unsigned long ee;		///<count.ee when the step started
+} cfg;
+
+/// Sender of a frames step, go-back-N; see frame.h
+static struct {
+	bool on;			///<The sketch is in framed mode
+	bool leave;			///<The frames end framed mode
+	std::vector< std::vector<uint8_t> > data;	///<Commands of each frame
+	std::vector<uint64_t> first;	///<When each frame was first sent
+	size_t base;			///<Oldest frame not acked
+	size_t next;			///<Next frame to send
+	size_t high;			///<First frame never sent
+	uint8_t seq0;			///<Sequence number of data[0]
+	uint64_t last;			///<When the sender last saw progress
+	std::vector<uint8_t> rx;	///<Frame from the sketch so far
+	unsigned long resent, naks, timeouts, acked, unknown;
+} frm;
+
+/// Measurements since the last report
+static struct {
+	uint64_t start, last;		///<First offer, last status
+	std::vector<uint32_t> lat;	///<Latency of each command, in us
+	std::vector<uint32_t> act;	///<Offer to tactor of each one taken, in us
+	std::vector<int32_t> late;	///<Due to tactor of each scheduled one, in us
+	unsigned long failed;		///<Commands that failed
+	unsigned long replaced;		///<Commands answered EOVRLD
+	unsigned long refused;		///<Commands answered EQFULL
+	unsigned long hits;		///<Vibrations taken by tactors
+	std::vector<bool> reached;	///<Tactors that took one, by number
+	counters_t base;		///<Model counters at the start
+} meas;
+
+/// Start a new measurement window
+static void meas_reset( void )
+{
+	meas.start = meas.last = 0;
+	meas.lat.clear();
+	meas.act.clear();
+	meas.late.clear();
+	meas.failed = meas.replaced = meas.refused = meas.hits = 0;
+	meas.reached.assign( tactors(), false );
+	meas.base = count;
+
+	// vibrations replaced before they were sent are never taken
+	for( size_t i=0; i<cues.size(); ++i )
+		cues[ i ].clear();
+}
+
+/// Print the measurements since the last report, and start again
+static void report( const char *label )
+{
+	uint64_t span = meas.last > meas.start? meas.last - meas.start : 0;
+	uint64_t busy_ns = count.twi_ns - meas.base.twi_ns;
+	size_t n = meas.lat.size();
+
+	std::sort( meas.lat.begin(), meas.lat.end() );
+	printf( "%-10s %3u motors %6zu cmds", label, tactors(), n );
+	if( n && span ) {
+		printf( " %7.0f cmds/s  p50 %6u us  p99 %6u us  max %6u us",
+			n * 1e9 / span, meas.lat[n/2], meas.lat[n*99/100],
+			meas.lat[n-1] );
+		printf( "  twi %3.0f%%", 100.0 * busy_ns / span );
+	}
+	n = meas.act.size();
+	std::sort( meas.act.begin(), meas.act.end() );
+	if( n )
+		printf( "  taken %zu p50 %u us p99 %u us", n, meas.act[n/2],
+			meas.act[n*99/100] );
+	n = meas.late.size();
+	std::sort( meas.late.begin(), meas.late.end() );
+	if( n )
+		printf( "  late %zu min %d p50 %d p99 %d max %d us", n,
+			meas.late[0], meas.late[n/2], meas.late[n*99/100],
+			meas.late[n-1] );
+	printf( "  tx %lu rx %lu", count.tx - meas.base.tx,
+		count.rx - meas.base.rx );
+	printf( "  serial %lu/%lu", count.down - meas.base.down,
+		count.up - meas.base.up );
+	if( meas.failed ) printf( "  failed %lu", meas.failed );
+	if( meas.replaced ) printf( "  replaced %lu", meas.replaced );
+	if( meas.refused ) printf( "  refused %lu", meas.refused );
+	if( count.mux - meas.base.mux )
+		printf( "  mux %lu", count.mux - meas.base.mux );
+	if( count.ee - meas.base.ee )
+		printf( "  eeprom %lu", count.ee - meas.base.ee );
+	if( count.overrun - meas.base.overrun )
+		printf( "  overrun %lu", count.overrun - meas.base.overrun );
+	if( count.dropped - meas.base.dropped )
+		printf( "  dropped %lu", count.dropped - meas.base.dropped );
+	if( count.corrupted - meas.base.corrupted )
+		printf( "  corrupted %lu",
+			count.corrupted - meas.base.corrupted );
+	printf( "\n" );
+
+	meas_reset();
+}
+
+/// Send a learning mode line
+static void send_line( const char *text )
+{
+	std::string s( text );
+
+	s += '\r';
+	host_send( (const uint8_t*)s.data(), s.size(), now_ns );
+	busy = true;
+}
+
+/// First byte of an ACX_WIDE prefix
+#define WIDE_BYTE ( ACM_LRN << 6 | ACX_WIDE )
+/// First byte of an ACX_LIB prefix
+#define LIB_BYTE ( ACM_LRN << 6 | ACX_LIB )
+/// Longest activation, with both prefixes
+#define ACT_MAX_LEN 6
+
+/// Make the next activation of motor \a m, offered at \a at, into \a cmd
+/** The vibrations of each motor go through every rhythm, magnitude and
+ *  duration but 0 in turn, so that on_hit() can tell them apart; the
+ *  scenario has to have taught rhythms 1 to 8 and magnitudes 1 to 4. Only
+ *  activations with \a taken set are timed to the tactor. Motors past 63
+ *  get an ACX_WIDE prefix first.
+ *
+ *  After a working step they go round that many library rhythms instead,
+ *  which the scenario has to have taught, with an ACX_LIB prefix for those
+ *  past the eighth. The sketch sends the tactor the motor slot it keeps
+ *  each one in rather than the rhythm, so none of them are timed.
+ *  \return The number of bytes at \a cmd, up to ACT_MAX_LEN.
+ */
+static size_t activation( unsigned m, uint64_t at, uint8_t *cmd,
+	bool taken, offer_t &o
+) {
+	static std::vector<uint8_t> seq;	///<Next vibration, by motor
+	static unsigned next_rhy;		///<Next rhythm of a working set
+	size_t len = 0;
+
+	seq.resize( tactors() );
+	cues.resize( tactors() );
+	o.at = at;
+	o.timed = true;
+	o.tag = seq[m] / 7 << 3 | ( seq[m] % 7 + 1 );
+	o.due = 0;
+	seq[ m ] = ( seq[m] + 1 ) % 224;
+	if( m >= 64 ) {
+		cmd[ len++ ] = WIDE_BYTE;
+		cmd[ len++ ] = m >> 6;
+	}
+	if( working ) {
+		unsigned r = next_rhy++ % working;
+
+		if( r >= 8 ) {
+			cmd[ len++ ] = LIB_BYTE;
+			cmd[ len++ ] = r >> 3 << 4;
+		}
+		o.tag = r % 8 << 5 | 1;
+		taken = false;
+	}
+	cmd[ len++ ] = m & 0x3f;	// ACM_VIB
+	cmd[ len++ ] = o.tag;
+	if( taken ) cues[ m ].push_back( o );
+
+	return len;
+}
+
+/// Whether \a b is the first byte of a prefix activation() may make
+static bool is_prefix( uint8_t b )
+{
+	return b == WIDE_BYTE || b == LIB_BYTE;
+}
+
+/// Queue an activation of motor \a m, arriving from \a at on
+static void offer( unsigned m, uint64_t at )
+{
+	uint8_t cmd[ ACT_MAX_LEN ];
+	offer_t o;
+	size_t len = activation( m, at, cmd, true, o ), i;
+
+	for( i=2; i<len; i+=2 ) {
+		// each prefix has a status of its own
+		offer_t prefix = { o.at, false, 0, 0 };
+
+		offers.push_back( prefix );
+	}
+	host_send( cmd, len, o.at );
+	offers.push_back( o );
+}
+
+/// Send the activations of a sched step, now that ACX_SYNC got its reply
+/** The controller's clock read \a ms at about halfway between sending the
+ *  ACX_SYNC and its reply arriving at \a at, so the time of each one is
+ *  due from then on is known as well as the clock's 1 ms steps allow.
+ */
+static void offer_sched( uint16_t ms, uint64_t at )
+{
+	uint64_t mid = ( raw.start + at ) / 2;
+	uint8_t cmd[ 2+ACT_MAX_LEN ];
+	unsigned i, t;
+	size_t k;
+	offer_t o;
+
+	if( !meas.start ) meas.start = now_ns;
+	for( i=0; i<raw.n; ++i ) {
+		offer_t prefix = { now_ns, false, 0, 0 };
+		unsigned m = i % tactors();
+		size_t len;
+
+		t = ( ms + raw.lead + i*raw.ms ) & 0x1fff;
+		cmd[ 0 ] = ACM_LRN << 6 | ACX_AT | t >> 8;
+		cmd[ 1 ] = t & 0xff;
+		len = 2 + activation( m, now_ns, cmd+2, false, o );
+		o.due = mid + ( raw.lead + i*raw.ms ) * 1000000ULL;
+		cues[ m ].push_back( o );
+
+		// the ACX_AT prefix, and any others, have statuses of their own
+		for( k=2; k<len; k+=2 )
+			offers.push_back( prefix );
+		host_send( cmd, len, now_ns );
+		offers.push_back( o );
+	}
+	raw.n = 0;
+}
+
+/// Queue \a n activations at \a rate per second from now, over \a motors
+static void offer_load( double rate, unsigned long n, unsigned motors )
+{
+	unsigned long i;
+
+	if( !meas.start ) meas.start = now_ns;
+	for( i=0; i<n; ++i )
+		offer( i % motors, now_ns + (uint64_t)(i * 1e9 / rate) );
+	busy = true;
+}
+
+/// Send the next activation of a pipe step, if any are left
+static void offer_piped( void )
+{
+	static unsigned m;
+
+	if( !piped ) return;
+	--piped;
+	offer( m++ % tactors(), now_ns );
+}
+
+/// Send the command of a burst step again, if it is not done
+static void offer_burst( void )
+{
+	offer_t o = { now_ns, true, 0, 0 };
+
+	if( !burst.left ) return;
+	--burst.left;
+	host_send( burst.cmd.data(), burst.cmd.size(), now_ns );
+	offers.push_back( o );
+}
+
+/// Read the hex bytes in \a p into \a b; false if anything else is there
+static bool hex_bytes( const char *p, std::vector<uint8_t> &b )
+{
+	char *end;
+
+	for( ;; p = end ) {
+		unsigned long v = strtoul( p, &end, 16 );
+
+		if( end == p ) break;
+		b.push_back( v );
+	}
+
+	return !*p && !b.empty();
+}
+
+/// Send frame \a k of a frames step
+static void frame_put( size_t k )
+{
+	std::vector<uint8_t> f;
+	uint16_t crc = 0;
+	size_t i;
+
+	f.push_back( FRM_SOF );
+	f.push_back( FRT_CMD );
+	f.push_back( frm.seq0 + k );
+	f.push_back( frm.data[k].size() );
+	f.insert( f.end(), frm.data[k].begin(), frm.data[k].end() );
+	for( i=1; i<f.size(); ++i )
+		crc = _crc_xmodem_update( crc, f[i] );
+	f.push_back( crc >> 8 );
+	f.push_back( crc & 0xff );
+
+	host_send( f.data(), f.size(), now_ns );
+}
+
+/// Send frames for as long as the window allows
+static void frame_pump( void )
+{
+	while( frm.next < frm.data.size() &&
+		frm.next < frm.base + FRM_WINDOW
+	) {
+		if( frm.next < frm.high )
+			++frm.resent;
+		else {
+			frm.first[ frm.next ] = now_ns;
+			frm.high = frm.next + 1;
+		}
+		frame_put( frm.next++ );
+	}
+}
+
+/// Start sending the frames in frm.data
+static void frame_start( void )
+{
+	frm.first.resize( frm.data.size() );
+	frm.base = frm.next = frm.high = 0;
+	frm.last = now_ns;
+	if( !meas.start ) meas.start = now_ns;
+	busy = true;
+	frame_pump();
+}
+
+/// Number of activations in frame \a k, not counting prefixes
+static unsigned frame_acts( size_t k )
+{
+	unsigned n = 0;
+	size_t i;
+
+	for( i=0; i<frm.data[k].size(); i+=2 )
+		n += !is_prefix( frm.data[k][i] );
+
+	return n;
+}
+
+/// Note that frames before \a k were handled, though their acks were lost
+static void frame_lost( size_t k )
+{
+	for( ; frm.base < k; ++frm.base )
+		frm.unknown += frame_acts( frm.base );
+}
+
+/// Handle a frame from the sketch that arrived whole
+static void frame_got( uint8_t type, uint8_t seq, const uint8_t *d,
+	uint8_t len
+) {
+	size_t k = frm.base + (uint8_t)( seq - frm.seq0 - frm.base ), i;
+
+	if( type == FRT_NAK && k <= frm.next ) {
+		// go back to the first frame not handled
+		frame_lost( k );
+		frm.next = k;
+		++frm.naks;
+	}else if( type == FRT_ACK && k < frm.next ) {
+		frame_lost( k );
+		if( len == frm.data[k].size() / 2 ) {
+			for( i=0; i<len; ++i ) {
+				if( is_prefix(frm.data[k][2*i]) ) continue;
+				meas.lat.push_back(
+					(now_ns - frm.first[k]) / 1000 );
+				if( d[i] ) ++meas.failed;
+			}
+			frm.acked += frame_acts( k );
+			meas.last = now_ns;
+		}else	frm.unknown += frame_acts( k );
+		frm.base = k + 1;
+	}else
+		return;
+
+	frm.last = now_ns;
+	frame_pump();
+	if( frm.base < frm.data.size() ) return;
+
+	printf( "%-10s %6zu frames  resent %lu  naks %lu  timeouts %lu  "
+		"acked %lu  unknown %lu  hits %lu\n", "frames",
+		frm.data.size(), frm.resent, frm.naks, frm.timeouts, frm.acked,
+		frm.unknown, meas.hits );
+	frm.seq0 += frm.data.size();
+	frm.resent = frm.naks = frm.timeouts = frm.acked = frm.unknown = 0;
+	frm.data.clear();
+	if( frm.leave ) frm.on = frm.leave = false;
+	busy = false;
+}
+
+/// Take a byte from the sketch in framed mode
+/** Bytes are dropped until a start-of-frame marker, and a frame whose CRC
+ *  does not match is dropped whole.
+ */
+static void frame_rx( uint8_t ch )
+{
+	std::vector<uint8_t> &b = frm.rx;
+	uint16_t crc = 0;
+	size_t i;
+
+	if( b.empty() && ch != FRM_SOF ) return;
+	b.push_back( ch );
+	if( b.size() < 4 ) return;
+	if( b[3] > FRM_MAX_LEN ) {
+		b.clear();
+		return;
+	}
+	if( b.size() < 6u + b[3] ) return;
+
+	for( i=1; i<4u + b[3]; ++i )
+		crc = _crc_xmodem_update( crc, b[i] );
+	if( crc == (b[4 + b[3]] << 8 | b[5 + b[3]]) )
+		frame_got( b[1], b[2], &b[4], b[3] );
+	b.clear();
+}
+
+/// Note how long a vibration offered by a load step took to reach a tactor
+/** The one taken is the oldest of its motor not taken yet that matches;
+ *  any older ones were replaced, or will never be sent, but for scheduled
+ *  ones, which may still be to come. Only after 224 more for the same motor
+ *  can one be mistaken for another.
+ */
+static void on_hit( tactor_t *t, uint8_t v )
+{
+	unsigned m = t - tactor_at( 0 );
+	size_t i;
+
+	++meas.hits;
+	if( m < meas.reached.size() ) meas.reached[ m ] = true;
+	hit_log.push_back( std::make_pair(m, now_ns) );
+	if( m >= cues.size() ) return;
+	std::deque<offer_t> &q = cues[ m ];
+
+	for( i=0; i<q.size() && q[i].at <= now_ns; ++i ) {
+		if( q[i].tag != v ) continue;
+
+		if( q[i].due ) {
+			meas.late.push_back( ((int64_t)now_ns -
+				(int64_t)q[i].due) / 1000 );
+			// the report spans the schedule, not just the statuses
+			meas.last = std::max( meas.last, now_ns );
+		}else	meas.act.push_back( (now_ns - q[i].at) / 1000 );
+		q.erase( q.begin() + i );
+		while( i-- )
+			if( !q[i].due ) q.erase( q.begin() + i );
+		return;
+	}
+}
+
+/// Handle a step that only changes the belt; false if \a word is not one
+static bool belt_step( const char *word, const char *arg )
+{
+	char which[ 16 ];
+	unsigned i, val = 0;
+	bool all;
+
+	if( strcmp(word, "brownout") && strcmp(word, "nack") &&
+		strcmp(word, "slow")
+	)
+		return false;
+
+	which[0] = '\0';
+	if( sscanf(arg, "%15s %u", which, &val) != 2 && strcmp(word, "brownout") ) {
+		fprintf( stderr, "bad %s: %s\n", word, arg );
+		exit( 1 );
+	}
+	all = !which[0] || !strcmp( which, "all" );
+
+	for( i=0; i<tactors(); ++i ) {
+		tactor_t *t = tactor_at( i );
+
+		if( !all && t->addr != strtoul(which, NULL, 16) ) continue;
+		if( word[0] == 'b' )
+			brownout( t );
+		else if( word[0] == 'n' )
+			t->nack_pct = val;
+		else	t->max_khz = val;
+	}
+
+	return true;
+}
+
+/// Start the next step of the script; false once it is finished
+static bool next_step( void )
+{
+	char word[ 16 ], arg[ 512 ];
+	const char *s;
+	double rate;
+	unsigned long n;
+	unsigned i, m;
+
+	while( step < script.size() ) {
+		s = script[ step++ ].c_str();
+		if( !*s || *s == '#' ) continue;
+
+		word[0] = arg[0] = '\0';
+		sscanf( s, "%15s %511[^\n]", word, arg );
+
+		if( !strcmp(word, "line") )
+			send_line( arg );
+		else if( !strcmp(word, "begin") )
+			send_line( "BGN" );
+		else if( !strcmp(word, "end") ) {
+			static const uint8_t lrn[2] = { 0xc0, 0x00 };
+			offer_t o = { now_ns, false, 0, 0 };
+
+			host_send( lrn, 2, now_ns );
+			offers.push_back( o );
+			busy = true;
+		}else if( !strcmp(word, "load") ) {
+			m = tactors();
+			if( sscanf(arg, "%lf %lu %u", &rate, &n, &m) < 2 ||
+				!active || !m || m > tactors()
+			) {
+				fprintf( stderr, "bad load: %s\n", s );
+				exit( 1 );
+			}
+			offer_load( rate, n, m );
+		}else if( !strcmp(word, "framed") ) {
+			send_line( ("FRM " + std::string(arg)).c_str() );
+		}else if( !strcmp(word, "frames") || !strcmp(word, "unframe") ) {
+			static unsigned next_m;
+			uint8_t cmd[ ACT_MAX_LEN ];
+			offer_t o;
+			size_t len;
+
+			if( !frm.on ) {
+				fprintf( stderr, "%s not in framed mode\n", s );
+				exit( 1 );
+			}
+			if( word[0] == 'u' ) {
+				frm.data.assign( 1, std::vector<uint8_t>(2) );
+				frm.data[0][0] = 0xc0;	// ACX_LRN
+				frm.leave = true;
+			}else	for( n=strtoul(arg, NULL, 10); n; --n ) {
+				len = activation( next_m++ % tactors(), now_ns,
+					cmd, false, o );
+				// keep a prefix in the frame of its command
+				if( frm.data.empty() || frm.data.back().size()
+					+ len > FRM_MAX_LEN
+				)
+					frm.data.push_back( std::vector<uint8_t>() );
+				frm.data.back().insert( frm.data.back().end(),
+					cmd, cmd + len );
+			}
+			frame_start();
+		}else if( !strcmp(word, "noise") ) {
+			if( sscanf(arg, "%u %u", &config.drop, &config.corrupt)
+				!= 2
+			) {
+				fprintf( stderr, "bad noise: %s\n", s );
+				exit( 1 );
+			}
+			continue;
+		}else if( !strcmp(word, "export") ) {
+			cfg.img.clear();
+			cfg.start = now_ns;
+			cfg.ee = count.ee;
+			send_line( "QRY CFG" );
+		}else if( !strcmp(word, "import") ) {
+			char text[ 32 ];
+
+			if( cfg.img.empty() ) {
+				fprintf( stderr, "%s before export\n", s );
+				exit( 1 );
+			}
+			cfg.sent = 0;
+			cfg.bad = cfg.hold = -1;
+			if( sscanf(arg, "hold %ld %lu", &cfg.hold, &n) == 2 ||
+				sscanf(arg, "%ld hold %ld %lu", &cfg.bad,
+					&cfg.hold, &n) == 3
+			)
+				cfg.hold_ns = n * 1000000ULL;
+			else if( arg[0] && sscanf(arg, "%ld", &cfg.bad) != 1 ) {
+				fprintf( stderr, "bad import: %s\n", s );
+				exit( 1 );
+			}
+			cfg.start = now_ns;
+			cfg.ee = count.ee;
+			snprintf( text, sizeof(text), "LRN CFG %zu %s",
+				cfg.img.size(), cfg.crc.c_str() );
+			send_line( text );
+		}else if( !strcmp(word, "pipe") ) {
+			if( sscanf(arg, "%u %lu", &m, &n) != 2 || !active || !m ) {
+				fprintf( stderr, "bad pipe: %s\n", s );
+				exit( 1 );
+			}
+			if( !meas.start ) meas.start = now_ns;
+			piped = n;
+			for( i=0; i<m; ++i )
+				offer_piped();
+			busy = true;
+		}else if( !strcmp(word, "working") ) {
+			working = strtoul( arg, NULL, 10 );
+			continue;
+		}else if( !strcmp(word, "send") ) {
+			std::vector<uint8_t> b;
+			char *p;
+
+			n = strtoul( arg, &p, 10 );
+			if( !active || !n || !hex_bytes(p, b) ) {
+				fprintf( stderr, "bad send: %s\n", s );
+				exit( 1 );
+			}
+			raw.need = n;
+			raw.got.clear();
+			raw.start = now_ns;
+			hit_log.clear();
+			host_send( b.data(), b.size(), now_ns );
+			busy = true;
+		}else if( !strcmp(word, "burst") ) {
+			char *p;
+
+			burst.cmd.clear();
+			burst.left = strtoul( arg, &p, 10 );
+			if( !active || !burst.left ||
+				!hex_bytes(p, burst.cmd) || burst.cmd.size() != 2
+			) {
+				fprintf( stderr, "bad burst: %s\n", s );
+				exit( 1 );
+			}
+			if( !meas.start ) meas.start = now_ns;
+			offer_burst();
+			busy = true;
+		}else if( !strcmp(word, "sched") ) {
+			static const uint8_t sync[2] = { ACM_LRN << 6 | ACX_SYNC };
+
+			if( sscanf(arg, "%u %u %u", &raw.n, &raw.ms, &raw.lead)
+				!= 3 || !active || !raw.n
+			) {
+				fprintf( stderr, "bad sched: %s\n", s );
+				exit( 1 );
+			}
+			raw.need = 3;
+			raw.got.clear();
+			raw.start = now_ns;
+			hit_log.clear();
+			host_send( sync, 2, now_ns );
+			busy = true;
+		}else if( !strcmp(word, "wait") ) {
+			until = now_ns + strtoull( arg, NULL, 10 ) * 1000000;
+			busy = true;
+		}else if( !strcmp(word, "reboot") ) {
+			if( active ) {
+				fprintf( stderr, "reboot in active mode\n" );
+				exit( 1 );
+			}
+			rebooting = busy = true;
+		}else if( !strcmp(word, "cut") ) {
+			ee_left = strtoul( arg, NULL, 10 );
+			continue;
+		}else if( belt_step(word, arg) ) {
+			continue;
+		}else if( !strcmp(word, "report") ) {
+			report( arg[0]? arg : "report" );
+			continue;
+		}else if( !strcmp(word, "hits") ) {
+			m = arg[0]? strtoul( arg, NULL, 10 ) : 1;
+			printf( "%-10s", "hits" );
+			for( i=0; i<hit_log.size(); ++i )
+				if( hit_log[i].first + 1 >= m )
+					printf( " %u@%.1f", hit_log[i].first + 1,
+						(hit_log[i].second - raw.start) / 1e6 );
+			printf( "\n" );
+			hit_log.clear();
+			continue;
+		}else if( !strcmp(word, "reached") ) {
+			n = std::count( meas.reached.begin(),
+				meas.reached.end(), true );
+			printf( "%-10s %6lu of %u tactors", "reached", n,
+				tactors() );
+			for( i=0, m=0; i<tactors() && m<8; ++i )
+				if( !meas.reached[i] )
+					printf( "%s%u", m++? " " : "  missed ", i );
+			printf( "\n" );
+			continue;
+		}else {
+			fprintf( stderr, "unknown step: %s\n", s );
+			exit( 1 );
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/// Take in the replies that have reached the host by now
+static void take_replies( void )
+{
+	uint64_t at;
+	int ch;
+
+	while( (ch = host_recv(&at)) >= 0 ) {
+		if( frm.on ) {
+			frame_rx( ch );
+			continue;
+		}
+		if( active && raw.need ) {
+			raw.got.push_back( ch );
+			if( --raw.need ) continue;
+
+			if( raw.n ) {
+				offer_sched( raw.got[1] << 8 | raw.got[2], at );
+				continue;
+			}
+			printf( "%-10s", "send" );
+			for( size_t i=0; i<raw.got.size(); ++i )
+				printf( " %02x", raw.got[i] );
+			printf( "  %7.1f ms\n", (at - raw.start) / 1e6 );
+			busy = false;
+			continue;
+		}
+		if( active ) {
+			// one status byte per command sent by load, pipe, burst
+			// and sched steps; none of those have extra bytes
+			if( offers.empty() ) continue;
+
+			bool timed = offers.front().timed;
+
+			if( timed ) {
+				meas.lat.push_back( (at-offers.front().at) / 1000 );
+				meas.last = at;
+				if( ch == EOVRLD ) ++meas.replaced;
+				else if( ch == EQFULL ) ++meas.refused;
+				else if( ch ) ++meas.failed;
+			}
+			offers.pop_front();
+			// a pipe keeps its depth in activations, not prefixes
+			if( timed ) {
+				offer_piped();
+				offer_burst();
+			}
+
+			if( offers.empty() ) busy = false;
+			// a status for ACX_LRN means the sketch is back in
+			// learning mode; it is the only one that could be last
+			// in a step that went through "end"
+			if( !busy && script[step-1].compare(0, 3, "end") == 0 )
+				active = false;
+			continue;
+		}
+
+		if( cfg.need ) {
+			cfg.img.push_back( ch );
+			--cfg.need;
+			continue;
+		}
+		if( ch == CFG_XON && !script[step-1].compare(0, 6, "import") ) {
+			std::vector<uint8_t> c( cfg.img.begin() + cfg.sent,
+				cfg.img.begin() + std::min(cfg.sent + CFG_CHUNK,
+				cfg.img.size()) );
+
+			if( cfg.bad >= (long)cfg.sent &&
+				cfg.bad < (long)(cfg.sent + c.size())
+			)
+				c[ cfg.bad - cfg.sent ] ^= 0x01;
+			if( cfg.hold >= (long)cfg.sent &&
+				cfg.hold < (long)(cfg.sent + c.size())
+			) {
+				size_t k = cfg.hold - cfg.sent;
+
+				host_send( c.data(), k, now_ns );
+				host_send( c.data() + k, c.size() - k,
+					now_ns + cfg.hold_ns );
+			}else
+				host_send( c.data(), c.size(), now_ns );
+			cfg.sent += c.size();
+			continue;
+		}
+		if( ch == '\r' ) continue;
+		if( ch != '\n' ) {
+			line += (char)ch;
+			continue;
+		}
+
+		if( !line.compare(0, 8, "RSP CFG ") ) {
+			char crc[ 8 ];
+
+			if( sscanf(line.c_str()+8, "%zu %7s", &cfg.need, crc)
+				== 2
+			)
+				cfg.crc = crc;
+		}
+		if( !line.compare(0, 4, "RSP ") )
+			printf( "%s\n", line.c_str() );
+		else if( !line.compare(0, 4, "STS ") ) {
+			if( !script[step-1].compare(0, 6, "export") ||
+				!script[step-1].compare(0, 6, "import")
+			)
+				printf( "%-10s %6zu bytes %7.1f ms  eeprom %lu\n",
+					script[step-1].c_str(),
+					script[step-1][0] == 'e'?
+					cfg.img.size() : cfg.sent,
+					(now_ns - cfg.start) / 1e6,
+					count.ee - cfg.ee );
+			if( line != "STS 0" )
+				printf( "%s: %s\n", script[step-1].c_str(),
+					line.c_str() );
+			if( script[step-1] == "begin" && line == "STS 0" )
+				active = true;
+			if( !script[step-1].compare(0, 6, "framed") &&
+				line == "STS 0"
+			)
+				frm.on = true;
+			busy = false;
+		}
+		line.clear();
+	}
+}
+
+/// Drive the script; called whenever the sketch looks for serial input
+static void host_step( void )
+{
+	if( !booted ) return;
+
+	take_replies();
+	if( busy && until && now_ns >= until ) {
+		until = 0;
+		busy = false;
+	}
+	if( busy && frm.base < frm.data.size() &&
+		now_ns - frm.last > FRM_RESEND
+	) {
+		// nothing heard for a while: send the window again
+		frm.next = frm.base;
+		frm.last = now_ns;
+		++frm.timeouts;
+		frame_pump();
+	}
+	while( !busy && next_step() )
+		;
+}
+
+/// Where a power failure takes the run back to; see the cut step
+static jmp_buf cut_env;
+
+/// Fail the power in the middle of whatever the sketch is doing
+static void power_cut( void )
+{
+	longjmp( cut_env, 1 );
+}
+
+/// Run setup(), and report what it did as \a label
+static void boot( const char *label )
+{
+	uint64_t start = now_ns;
+
+	meas_reset();
+	booted = false;
+	setup();
+	booted = true;
+	printf( "%-10s %3u motors %5.0f ms  tx %lu rx %lu  eeprom %lu\n",
+		label, tactors(), (now_ns - start) / 1e6,
+		count.tx - meas.base.tx, count.rx - meas.base.rx,
+		count.ee - meas.base.ee );
+	meas_reset();
+}
+
+int main( int argc, char **argv )
+{
+	char buf[ 1024 ];
+	FILE *f;
+	int i;
+
+	for( i=1; i<argc-1 && argv[i][0] == '-'; i+=2 ) {
+		if( !strcmp(argv[i], "-m") )
+			config.motors = atoi( argv[i+1] );
+		else if( !strcmp(argv[i], "-s") )
+			config.segments = atoi( argv[i+1] );
+		else	break;
+	}
+	if( i != argc-1 ) {
+		fprintf( stderr, "usage: %s [-m MOTORS] [-s SEGMENTS] "
+			"SCENARIO\n", argv[0] );
+		return 2;
+	}
+	f = fopen( argv[i], "r" );
+	if( !f ) {
+		perror( argv[i] );
+		return 1;
+	}
+	while( fgets(buf, sizeof(buf), f) ) {
+		buf[ strcspn(buf, "\r\n") ] = '\0';
+		script.push_back( buf );
+	}
+	fclose( f );
+
+	// settings come first; the command line overrides them
+	for( ; step < script.size(); ++step ) {
+		unsigned long val;
+
+		if( sscanf(script[step].c_str(), "motors %lu", &val) == 1 ) {
+			if( !strcmp(argv[1], "-m") ) continue;
+			config.motors = val;
+		}else if( sscanf(script[step].c_str(), "segments %lu", &val) == 1 )
+			config.segments = val;
+		else if( sscanf(script[step].c_str(), "baud %lu", &val) == 1 )
+			config.baud = val;
+		else if( sscanf(script[step].c_str(), "twi %lu", &val) == 1 )
+			config.twi_hz = val;
+		else if( !script[step].empty() && script[step][0] != '#' )
+			break;
+	}
+	for( i=1; i<argc-1; i+=2 )
+		if( !strcmp(argv[i], "-m") )
+			config.motors = atoi( argv[i+1] );
+		else if( !strcmp(argv[i], "-s") )
+			config.segments = atoi( argv[i+1] );
+
+	belt_init();
+	host_poll = host_step;
+	tactor_hit = on_hit;
+
+	for( ; step < script.size(); ++step ) {
+		char word[ 16 ], arg[ 512 ];
+
+		word[0] = arg[0] = '\0';
+		sscanf( script[step].c_str(), "%15s %511[^\n]", word, arg );
+		if( word[0] && word[0] != '#' && !belt_step(word, arg) )
+			break;
+	}
+	boot( "boot" );
+
+	// a cut step ends here, with the step it came in
+	power_fail = power_cut;
+	if( setjmp(cut_env) ) {
+		link_clear();
+		line.clear();
+		offers.clear();
+		cfg.need = 0;
+		active = rebooting = busy = false;
+		boot( "cut" );
+	}
+
+	while( busy || step < script.size() ) {
+		now_ns += COST_LOOP;
+		loop();
+		host_step();
+		if( rebooting ) {
+			rebooting = busy = false;
+			boot( "reboot" );
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+/*************************************************************************//**
+ * \file   prelude.h
+ * \brief  Included ahead of the sketch when it is built for the simulator.
+ * \date   20261016 - initial version
+ *
+ * globals_main.h defines its own mode_t, so the system headers that declare
+ * one are pulled in here first, with theirs renamed out of the way.
+ ****************************************************************************/
+
+#define mode_t glibc_mode_t
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#undef mode_t
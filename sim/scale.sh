@@ -0,0 +1,15 @@
+#!/bin/sh
+# Build the belt simulator and run a scenario at 1 to 64 motors.
+#	sim/scale.sh [SCENARIO] [SEGMENTS]
+# Run from the directory above sim/.
+scenario=${1:-sim/scenarios/load.txt}
+segments=${2:-1}
+
+g++ -O2 -DTWI_SEGMENTS=$segments -include sim/prelude.h \
+	-Isim -Isim/arduino -I. -x c++ haptic_firmware.ino -x none \
+	debug_main.cpp sim/belt.cpp sim/host.cpp -o belt_sim || exit 1
+
+for m in 1 2 4 8 16 32 64; do
+	[ $m -ge $segments ] || continue
+	./belt_sim -m $m "$scenario" || exit 1
+done
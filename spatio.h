@@ -0,0 +1,41 @@
+/*************************************************************************//**
+ * \file   spatio.h
+ * \brief  The spatio-temporal pattern structure.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef SPATIO_H
+#define SPATIO_H
+
+#include<inttypes.h>
+
+#include"vibration.h"
+
+#define MAX_SPATIO 4	///<Maximum number of patterns that can be learned
+#define MAX_SSTEPS 16	///<Maximum number of steps in each pattern
+
+/// One step of a spatio-temporal pattern
+typedef struct {
+	uint16_t offset;	///<Time from the start of the pattern, in ms
+	uint8_t motor;		///<Motor to activate
+	vibration_t v;		///<Rhythm, magnitude, and duration
+} spatio_step_t;
+
+/// Spatio-temporal pattern definition
+/** Steps are stored in the order they fire, so offsets never decrease from
+ *  one step to the next.
+ */
+typedef struct {
+	uint8_t steps;			///<Number of steps used; 0 if undefined
+	spatio_step_t step[ MAX_SSTEPS ];	///<Steps, in firing order
+} spatio_t;
+
+/// Playback state of a spatio-temporal pattern
+typedef struct {
+	uint8_t steps;		///<Number of steps in the pattern
+	uint8_t next;		///<Next step to fire; done once equal to steps
+	unsigned long start;	///<Value of millis() when playback started
+	spatio_step_t step;	///<Copy of the next step, read from EEPROM
+} spatio_play_t;
+
+#endif
@@ -0,0 +1,55 @@
+/*************************************************************************//**
+ * \file   stats.h
+ * \brief  Latency histograms for the active mode command path.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include<inttypes.h>
+
+/// If STATS is defined, compile in the latency histograms read by QRY STA
+//#define STATS
+
+/** \brief Number of buckets in each histogram. Bucket 0 counts times under
+ *  16 us, and each bucket after it counts times up to twice as long as the
+ *  one before; the last bucket also counts everything longer.
+ */
+#define STA_BUCKETS 12
+
+/// log2 of the upper bound of bucket 0, in us
+#define STA_SHIFT 4
+
+/// Phases of handling an active command that are timed
+typedef enum {
+	STP_RX,		///<Serial receive, first byte to whole command or frame
+	STP_ACTIVE,	///<parse_active(), including the phases below
+	STP_TX,		///<TWI write of a command
+	STP_STATUS,	///<TWI read of a status
+	STP_TEACH,	///<Re-teach and retry in reliable_activate()
+	STP_SCHED,	///<Lateness of a scheduled command; 1 ms resolution
+	STP_MAX		///<Number of phases timed
+} stats_phase_t;
+
+/// Latency statistics, kept in glbl.sta
+typedef struct {
+	uint16_t hist[ STP_MAX ][ STA_BUCKETS ];	///<Counts; saturate
+	uint16_t max[ STP_MAX ];	///<Longest time seen, in us; saturates
+	unsigned long rx;	///<micros() when the command being received began
+} stats_t;
+
+#ifdef STATS
+	/// Declare \a _t_ and start timing a phase in it
+#	define STA_START( _t_ ) unsigned long _t_ = micros()
+	/// Start timing a phase in the existing variable \a _t_
+#	define STA_MARK( _t_ ) ( (_t_) = micros() )
+	/// Add the time since \a _t_ was started to the histogram of \a _p_
+#	define STA_STOP( _p_, _t_ ) stats_add( _p_, micros() - (_t_) )
+#else
+#	define STA_START( _t_ )
+#	define STA_MARK( _t_ ) ((void)0)
+#	define STA_STOP( _p_, _t_ ) ((void)0)
+#endif
+
+#endif
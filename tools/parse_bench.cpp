@@ -0,0 +1,462 @@
+/*************************************************************************//**
+ * \file   parse_bench.cpp
+ * \brief  Cost of parse() for typical learning mode lines, and of the text
+ *         helpers around it, on a host.
+ * \date   20261016 - initial version
+ *
+ * Builds parse.c for the host against tables with the same words as those
+ * of haptic_firmware.ino, whose handlers do nothing, so that only the parser
+ * is measured. Beside it runs the linear parser it replaced, from
+ * parse_old.h, over tables with the same words in the same order. For each
+ * line it prints the time per parse() of both and, where the kernel allows
+ * perf events, their instructions per parse(). Each run parses a fresh copy
+ * of the line, because the old parser splits it in place; the copy is
+ * counted for both.
+ *
+ * It then times each of htoi(), itoh(), parse_rhythm(), parse_magnitude(),
+ * parse(), errstr(), and rhythm_text() and magnitude_text(), which do the
+ * formatting of rtos() and mtos() once the entry has been read from the
+ * library, on one typical argument each.
+ *
+ * Built with PARSE_BENCH_AVR, it instead counts the characters, words,
+ * program space reads and string compares of each parse() and turns them
+ * into an ESTIMATE of AVR cycles with the costs in avr_cost below, and of
+ * the time at 8 MHz. Nothing is run on an AVR or under simavr, and no
+ * avr-objdump listing is counted: the costs are guesses from instruction
+ * timings, good only for comparing changes to the parser and its tables.
+ * Only a board, or simavr on the firmware built with avr-gcc, gives real
+ * numbers.
+ *
+ * Build and run from this directory with
+ *	make bench
+ *	make bench-avr
+ * or by hand, for example
+ *	g++ -O2 -I.. parse_bench.cpp -o parse_bench
+ *	./parse_bench [ITERATIONS]
+ ****************************************************************************/
+
+// keep glibc's error_t out of the way of the firmware's
+#define __error_t_defined 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include <chrono>
+
+#ifdef PARSE_BENCH_AVR
+/// Program space reads and string compares made by parse(); see avr_cost
+static struct {
+	unsigned long bytes;		///<pgm_read_byte() calls
+	unsigned long words;		///<pgm_read_word() calls
+	unsigned long copies;		///<memcpy_P() calls, each of one step
+	unsigned long cmps;		///<strcasecmp() calls
+	unsigned long cmped;		///<Characters strcasecmp() looked at
+} lpm;
+
+static inline uint8_t lpm_byte( const void *p )
+{
+	++lpm.bytes;
+	return *(const uint8_t*)p;
+}
+
+/// strcasecmp(), counting the characters it compares
+static inline int cmp_count( const char *a, const char *b )
+{
+	int d;
+
+	++lpm.cmps;
+	for( ;; ++a, ++b ) {
+		++lpm.cmped;
+		d = tolower( (uint8_t)*a ) - tolower( (uint8_t)*b );
+		if( d || !*a ) return d;
+	}
+}
+
+#	define pgm_read_byte( _addr_ ) lpm_byte( _addr_ )
+#	define pgm_read_word( _addr_ ) ( ++lpm.words, *(_addr_) )
+#	define memcpy_P( _d_, _s_, _n_ ) ( ++lpm.copies, memcpy(_d_, _s_, _n_) )
+#	define strcasecmp( _a_, _b_ ) cmp_count( _a_, _b_ )
+#else
+#	include <linux/perf_event.h>
+#	include <sys/ioctl.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+#include "parse.c"
+#include "error.c"
+#include "parse_old.h"
+
+/// Handler for every command; the parse is all that is measured
+static error_t done( const char *line, int argc, const parse_span_t *argv )
+{
+	return ESUCCESS;
+}
+
+/// Handler for every command of the old parser
+static error_t old_done( int argc, const char *const *argv )
+{
+	return ESUCCESS;
+}
+
+/// Words after LRN, as in haptic_firmware.ino
+static PROGMEM constexpr parse_step_t pt_learn_steps[] = {
+	{ PARSE_KEY('R','H','Y'), NULL, done },
+	{ PARSE_KEY('M','A','G'), NULL, done },
+	{ PARSE_KEY('S','P','T'), NULL, done },
+	{ PARSE_KEY('A','D','D'), NULL, done },
+	{ PARSE_KEY('G','R','P'), NULL, done },
+	{ PARSE_KEY('C','F','G'), NULL, done },
+	{ PARSE_KEY('B','U','S'), NULL, done },
+};
+PARSE_CHECK( pt_learn_steps );
+static PROGMEM constexpr parse_table_t pt_learn = PARSE_TABLE(pt_learn_steps);
+
+/// Words after QRY, as in haptic_firmware.ino with STATS and TRACE_LEN
+static PROGMEM constexpr parse_step_t pt_query_steps[] = {
+	{ PARSE_KEY('R','H','Y'), NULL, done },
+	{ PARSE_KEY('M','A','G'), NULL, done },
+	{ PARSE_KEY('S','P','T'), NULL, done },
+	{ PARSE_KEY('M','T','R'), NULL, done },
+	{ PARSE_KEY('D','L','T'), NULL, done },
+	{ PARSE_KEY('H','L','T'), NULL, done },
+	{ PARSE_KEY('G','R','P'), NULL, done },
+	{ PARSE_KEY('L','I','B'), NULL, done },
+	{ PARSE_KEY('C','F','G'), NULL, done },
+	{ PARSE_KEY('B','U','S'), NULL, done },
+	{ PARSE_KEY('C','U','E'), NULL, done },
+	{ PARSE_KEY('V','E','R'), NULL, done },
+	{ PARSE_KEY('A','L','L'), NULL, done },
+	{ PARSE_KEY('T','S','T'), NULL, done },
+	{ PARSE_KEY('S','T','A'), NULL, done },
+	{ PARSE_KEY('T','R','C'), NULL, done },
+};
+PARSE_CHECK( pt_query_steps );
+static PROGMEM constexpr parse_table_t pt_query = PARSE_TABLE(pt_query_steps);
+
+/// First words, as in haptic_firmware.ino
+static PROGMEM constexpr parse_step_t pt_top_steps[] = {
+	{ PARSE_KEY('L','R','N'), &pt_learn, NULL },
+	{ PARSE_KEY('Q','R','Y'), &pt_query, NULL },
+	{ PARSE_KEY('T','S','T'), NULL, done },
+	{ PARSE_KEY('B','G','N'), NULL, done },
+	{ PARSE_KEY('F','R','M'), NULL, done },
+	{ PARSE_KEY('Z','A','P'), NULL, done },
+};
+PARSE_CHECK( pt_top_steps );
+static PROGMEM constexpr parse_table_t pt_top = PARSE_TABLE(pt_top_steps);
+
+/// The same words for the old parser, in the same order
+static PROGMEM const parse_old::parse_step_t old_learn[] = {
+	{ "RHY", NULL, old_done },
+	{ "MAG", NULL, old_done },
+	{ "SPT", NULL, old_done },
+	{ "ADD", NULL, old_done },
+	{ "GRP", NULL, old_done },
+	{ "CFG", NULL, old_done },
+	{ "BUS", NULL, old_done },
+	{ "", NULL, NULL }
+};
+
+static PROGMEM const parse_old::parse_step_t old_query[] = {
+	{ "RHY", NULL, old_done },
+	{ "MAG", NULL, old_done },
+	{ "SPT", NULL, old_done },
+	{ "MTR", NULL, old_done },
+	{ "DLT", NULL, old_done },
+	{ "HLT", NULL, old_done },
+	{ "GRP", NULL, old_done },
+	{ "LIB", NULL, old_done },
+	{ "CFG", NULL, old_done },
+	{ "BUS", NULL, old_done },
+	{ "CUE", NULL, old_done },
+	{ "VER", NULL, old_done },
+	{ "ALL", NULL, old_done },
+	{ "TST", NULL, old_done },
+	{ "STA", NULL, old_done },
+	{ "TRC", NULL, old_done },
+	{ "", NULL, NULL }
+};
+
+static PROGMEM const parse_old::parse_step_t old_top[] = {
+	{ "LRN", old_learn, NULL },
+	{ "QRY", old_query, NULL },
+	{ "TST", NULL, old_done },
+	{ "BGN", NULL, old_done },
+	{ "FRM", NULL, old_done },
+	{ "ZAP", NULL, old_done },
+	{ "", NULL, NULL }
+};
+
+/// Lines parsed, with the status parse() should return for each
+static const struct {
+	const char *line;
+	error_t want;
+} lines[] = {
+	{ "BGN", ESUCCESS },
+	{ "QRY VER", ESUCCESS },
+	{ "QRY MTR", ESUCCESS },
+	{ "qry trc 1", ESUCCESS },
+	{ "LRN MAG 1 1000 200", ESUCCESS },
+	{ "LRN RHY 1 F0F0F0F0F0F0F0F0 20", ESUCCESS },
+	{ "LRN SPT 1 1 0 3 24", ESUCCESS },
+	{ "QRY FOO", EBADCMD },
+	{ "HELLO", EBADCMD },
+	{ "QRY A B C D E F G H I J", ETOOBIG },
+};
+
+/// Parse \a s with the current parser, from a fresh copy like the old one
+static int parse_new( const char *s )
+{
+	char buf[ PARSE_MAX_LEN+1 ];
+
+	strcpy( buf, s );
+	return parse( &pt_top, buf );
+}
+
+/// Parse \a s with the old parser, which splits a copy of it in place
+static int parse_old_copy( const char *s )
+{
+	char buf[ PARSE_MAX_LEN+1 ];
+
+	strcpy( buf, s );
+	return parse_old::parse( old_top, buf );
+}
+
+#ifndef PARSE_BENCH_AVR
+/// Words of "1 F0F0F0F0F0F0F0F0 20", as parse() hands them to LRN RHY
+static const parse_span_t rhy_args[] = { { 0, 1 }, { 2, 16 }, { 19, 2 } };
+/// Words of "1 1000 200", as parse() hands them to LRN MAG
+static const parse_span_t mag_args[] = { { 0, 1 }, { 2, 4 }, { 7, 3 } };
+
+/// Rhythm and magnitude formatted by rhythm_text() and magnitude_text()
+static const rhythm_t rhy = { { 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0, 0xf0,
+	0xf0 }, 20 };
+static const magnitude_t mag = { 1000, 200 };
+
+/// Status looked up by errstr()
+static const char err_arg[] = { EINVM, 0 };
+
+static int run_htoi( const char *s ) { return htoi( s[0] ); }
+
+static int run_itoh( const char *s )
+{
+	char hex[3];
+
+	itoh( hex, s[0] );
+	return hex[0] + hex[1];
+}
+
+static int run_parse_rhythm( const char *s )
+{
+	rhythm_t r = { { 0 }, 0 };
+
+	return parse_rhythm( s, 3, rhy_args, MAX_RHYTHM, &r ) + r.bits;
+}
+
+static int run_parse_magnitude( const char *s )
+{
+	magnitude_t m = { 0, 0 };
+
+	return parse_magnitude( s, 3, mag_args, MAX_MAGNITUDE, &m ) +
+		m.duty;
+}
+
+static int run_errstr( const char *s ) { return *errstr( (error_t)*s ); }
+
+static int run_rhythm_text( const char *s )
+{
+	char text[ PARSE_MAX_LEN ];
+
+	rhythm_text( text, (const rhythm_t*)s, 0 );
+	return text[ 20 ];
+}
+
+static int run_magnitude_text( const char *s )
+{
+	char text[ PARSE_MAX_LEN ];
+
+	magnitude_text( text, (const magnitude_t*)s, 0 );
+	return text[ 10 ];
+}
+
+/// Each function timed on its own, with its argument
+static const struct {
+	const char *name;		///<What is timed
+	int (*f)( const char* );	///<Calls it once on \a arg
+	const char *arg;		///<Its argument
+} funcs[] = {
+	{ "htoi", run_htoi, "B" },
+	{ "itoh", run_itoh, "\xa5" },
+	{ "parse_rhythm", run_parse_rhythm, "1 F0F0F0F0F0F0F0F0 20" },
+	{ "parse_magnitude", run_parse_magnitude, "1 1000 200" },
+	{ "parse LRN RHY", parse_new, "LRN RHY 1 F0F0F0F0F0F0F0F0 20" },
+	{ "errstr", run_errstr, err_arg },
+	{ "rtos (rhythm_text)", run_rhythm_text, (const char*)&rhy },
+	{ "mtos (magnitude_text)", run_magnitude_text, (const char*)&mag },
+};
+#endif
+
+#ifdef PARSE_BENCH_AVR
+/** \brief Estimated AVR cycles for each thing parse() does, from the
+ *  instruction timings of the ATmega328 (LPM 3 cycles, MUL 2, ICALL 3, loads
+ *  and stores 2) and the code avr-gcc makes of similar loops.
+ */
+static const struct {
+	unsigned call;		///<parse() itself: prologue, epilogue, checks
+	unsigned ch;		///<Each character scanned for spaces
+	unsigned word;		///<Each word span or pointer stored
+	unsigned key;		///<parse_key() and PARSE_HASH() of each lookup
+	unsigned lpm_byte;	///<Each pgm_read_byte()
+	unsigned lpm_word;	///<Each pgm_read_word()
+	unsigned copy;		///<Each memcpy_P() call, less its bytes
+	unsigned copied;	///<Each byte memcpy_P() copies
+	unsigned cmp;		///<Each strcasecmp() call, less its characters
+	unsigned cmped;		///<Each character strcasecmp() compares
+	unsigned handler;	///<Calling the handler through a pointer
+} avr_cost = { 40, 8, 10, 60, 5, 8, 20, 5, 12, 14, 12 };
+
+/// Size of a parse_step_t on the AVR: a key and two pointers
+#define AVR_STEP 6
+/// Size of an old parse_step_t on the AVR: four characters, two pointers
+#define AVR_OLD_STEP 8
+
+/// Clock of the Funnel I/O, in MHz
+#define AVR_MHZ 8
+
+/// Estimated cycles of one parse of \a s that returned \a ret
+static unsigned long avr_cycles( const char *s, int ret, unsigned step )
+{
+	unsigned long words = 1, k;
+
+	for( k=0; s[k]; ++k )
+		if( s[k] == ' ' ) ++words;
+
+	return avr_cost.call + (k+1) * avr_cost.ch
+		+ words * avr_cost.word
+		+ lpm.bytes * (avr_cost.key + avr_cost.lpm_byte)
+		+ lpm.words * avr_cost.lpm_word
+		+ lpm.copies * (avr_cost.copy + step * avr_cost.copied)
+		+ lpm.cmps * avr_cost.cmp
+		+ lpm.cmped * avr_cost.cmped
+		+ (ret != EBADCMD && ret != ETOOBIG) * avr_cost.handler;
+}
+#else
+/// Instruction counter, or -1 where the kernel does not allow perf events
+static int perf_fd = -1;
+
+/// Time \a n calls of \a f on \a s; store ns and instructions per call
+static void measure( int (*f)( const char* ), const char *s,
+	unsigned long n, double *ns, double *insn
+) {
+	std::chrono::steady_clock::time_point t0;
+	const char *volatile arg = s;	// read afresh for every call
+	volatile int sink;
+	long long count = 0;
+	unsigned long k;
+
+	if( perf_fd >= 0 ) {
+		ioctl( perf_fd, PERF_EVENT_IOC_RESET, 0 );
+		ioctl( perf_fd, PERF_EVENT_IOC_ENABLE, 0 );
+	}
+	t0 = std::chrono::steady_clock::now();
+	for( k=0; k<n; ++k )
+		sink = f( arg );
+	*ns = std::chrono::duration<double, std::nano>(
+		std::chrono::steady_clock::now() - t0 ).count() / n;
+	if( perf_fd >= 0 ) {
+		ioctl( perf_fd, PERF_EVENT_IOC_DISABLE, 0 );
+		if( read(perf_fd, &count, sizeof(count)) != sizeof(count) )
+			count = 0;
+	}
+	*insn = (double)count / n;
+	(void)sink;
+}
+#endif
+
+int main( int argc, char **argv )
+{
+	unsigned long n = argc > 1? strtoul( argv[1], NULL, 10 ) : 1000000;
+	size_t i;
+
+	if( !n ) {
+		fprintf( stderr, "usage: %s [ITERATIONS]\n", argv[0] );
+		return 2;
+	}
+
+	// both parsers must agree with the expected status before timing
+	for( i=0; i<sizeof(lines)/sizeof(*lines); ++i ) {
+		const char *s = lines[i].line;
+
+		if( parse_new(s) != lines[i].want ||
+			parse_old_copy(s) != lines[i].want
+		) {
+			fprintf( stderr, "%s: status %d and %d, not %d\n", s,
+				parse_new(s), parse_old_copy(s), lines[i].want );
+			return 1;
+		}
+	}
+
+#ifdef PARSE_BENCH_AVR
+	printf( "ESTIMATED AVR cycles of parse(), from avr_cost; not measured "
+		"on an AVR or simavr\n" );
+	printf( "%-32s %8s %8s %8s %8s\n", "line", "old est", "new est",
+		"old us", "new us" );
+	for( i=0; i<sizeof(lines)/sizeof(*lines); ++i ) {
+		const char *s = lines[i].line;
+		unsigned long old_cycles, new_cycles;
+
+		memset( &lpm, 0, sizeof(lpm) );
+		old_cycles = avr_cycles( s, parse_old_copy(s), AVR_OLD_STEP );
+		memset( &lpm, 0, sizeof(lpm) );
+		new_cycles = avr_cycles( s, parse_new(s), AVR_STEP );
+		printf( "%-32s %8lu %8lu %8.1f %8.1f\n", s, old_cycles,
+			new_cycles, (double)old_cycles / AVR_MHZ,
+			(double)new_cycles / AVR_MHZ );
+	}
+#else
+	struct perf_event_attr pe;
+
+	// instructions, where the kernel lets us count them
+	memset( &pe, 0, sizeof(pe) );
+	pe.size = sizeof(pe);
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	perf_fd = syscall( SYS_perf_event_open, &pe, 0, -1, -1, 0 );
+
+	printf( "%-32s %8s %8s %8s %8s\n", "line", "old ns", "new ns",
+		"old insn", "new insn" );
+	for( i=0; i<sizeof(lines)/sizeof(*lines); ++i ) {
+		const char *s = lines[i].line;
+		double old_ns, new_ns, old_insn, new_insn;
+
+		measure( parse_old_copy, s, n, &old_ns, &old_insn );
+		measure( parse_new, s, n, &new_ns, &new_insn );
+
+		printf( "%-32s %8.1f %8.1f ", s, old_ns, new_ns );
+		if( perf_fd >= 0 )
+			printf( "%8.1f %8.1f\n", old_insn, new_insn );
+		else	printf( "%8s %8s\n", "-", "-" );
+	}
+
+	printf( "\n%-32s %8s %8s\n", "function", "ns/op", "insn/op" );
+	for( i=0; i<sizeof(funcs)/sizeof(*funcs); ++i ) {
+		double ns, insn;
+
+		measure( funcs[i].f, funcs[i].arg, n, &ns, &insn );
+		printf( "%-32s %8.1f ", funcs[i].name, ns );
+		if( perf_fd >= 0 )
+			printf( "%8.1f\n", insn );
+		else	printf( "%8s\n", "-" );
+	}
+#endif
+
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*************************************************************************//**
+ * \file   parse_equiv.cpp
+ * \brief  Check that parse() dispatches every command as the parser it
+ *         replaced did, on a host.
+ * \date   20261016 - initial version
+ *
+ * Runs each form of every LRN, QRY, TST, BGN, FRM and ZAP command through
+ * the current parse() and through the old one from parse_old.h, over
+ * tables with the same words as those of haptic_firmware.ino. Each form is
+ * also tried lowercased, with extra spaces, with mangled command words and
+ * with as many words as a line may have and one more, and a list of lines
+ * that are not commands at all is tried too. For each line the two parsers
+ * must return the same status, call the handler of the same command, and
+ * pass it the same arguments; the current one must also leave the line as
+ * it was. Prints each line that differs and exits with 1 if there are any.
+ *
+ * Build and run from this directory with
+ *	make test
+ ****************************************************************************/
+
+// keep glibc's error_t out of the way of the firmware's
+#define __error_t_defined 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+
+#include "parse.c"
+
+/** \brief strcasecmp() for the old parser, which compares the word after a
+ *  bare LRN or QRY although there is none: its pointer is NULL. An AVR
+ *  reads registers there rather than faulting, and nothing in the table
+ *  matches them, so here that word is taken to be empty.
+ */
+static int cmp_null( const char *a, const char *b )
+{
+	return strcasecmp( a, b? b : "" );
+}
+#define strcasecmp( _a_, _b_ ) cmp_null( _a_, _b_ )
+
+#include "parse_old.h"
+
+/// What the handler called by the last parse was given
+static struct {
+	const char *cmd;	///<Command whose handler was called, or NULL
+	int argc;		///<Number of arguments
+	std::string argv[ PARSE_MAX_WORDS ];	///<The arguments themselves
+} got;
+
+/// Record a call to the handler of \a cmd by the current parser
+static error_t took( const char *cmd, const char *line, int argc,
+	const parse_span_t *argv
+) {
+	int i;
+
+	got.cmd = cmd;
+	got.argc = argc;
+	for( i=0; i<argc; ++i )
+		got.argv[ i ].assign( argp(i), argl(i) );
+	return ESUCCESS;
+}
+
+/// Record a call to the handler of \a cmd by the old parser
+static error_t took_old( const char *cmd, int argc, const char *const *argv )
+{
+	int i;
+
+	got.cmd = cmd;
+	got.argc = argc;
+	for( i=0; i<argc; ++i )
+		got.argv[ i ] = argv[ i ];
+	return ESUCCESS;
+}
+
+/// Handlers of command \a _name_ for both parsers
+#define HANDLERS( _name_ ) \
+	static error_t new_##_name_( const char *line, int argc, \
+		const parse_span_t *argv ) \
+	{ return took( #_name_, line, argc, argv ); } \
+	static error_t old_##_name_( int argc, const char *const *argv ) \
+	{ return took_old( #_name_, argc, argv ); }
+
+HANDLERS( lrn_rhy ) HANDLERS( lrn_mag ) HANDLERS( lrn_spt )
+HANDLERS( lrn_add ) HANDLERS( lrn_grp ) HANDLERS( lrn_cfg )
+HANDLERS( lrn_bus )
+HANDLERS( qry_rhy ) HANDLERS( qry_mag ) HANDLERS( qry_spt )
+HANDLERS( qry_mtr ) HANDLERS( qry_dlt ) HANDLERS( qry_hlt )
+HANDLERS( qry_grp ) HANDLERS( qry_lib ) HANDLERS( qry_cfg )
+HANDLERS( qry_bus ) HANDLERS( qry_cue ) HANDLERS( qry_ver )
+HANDLERS( qry_all ) HANDLERS( qry_tst ) HANDLERS( qry_sta )
+HANDLERS( qry_trc )
+HANDLERS( tst ) HANDLERS( bgn ) HANDLERS( frm ) HANDLERS( zap )
+
+/// Words after LRN, as in haptic_firmware.ino
+static PROGMEM constexpr parse_step_t pt_learn_steps[] = {
+	{ PARSE_KEY('R','H','Y'), NULL, new_lrn_rhy },
+	{ PARSE_KEY('M','A','G'), NULL, new_lrn_mag },
+	{ PARSE_KEY('S','P','T'), NULL, new_lrn_spt },
+	{ PARSE_KEY('A','D','D'), NULL, new_lrn_add },
+	{ PARSE_KEY('G','R','P'), NULL, new_lrn_grp },
+	{ PARSE_KEY('C','F','G'), NULL, new_lrn_cfg },
+	{ PARSE_KEY('B','U','S'), NULL, new_lrn_bus },
+};
+PARSE_CHECK( pt_learn_steps );
+static PROGMEM constexpr parse_table_t pt_learn = PARSE_TABLE(pt_learn_steps);
+
+/// Words after QRY, as in haptic_firmware.ino with STATS and TRACE_LEN
+static PROGMEM constexpr parse_step_t pt_query_steps[] = {
+	{ PARSE_KEY('R','H','Y'), NULL, new_qry_rhy },
+	{ PARSE_KEY('M','A','G'), NULL, new_qry_mag },
+	{ PARSE_KEY('S','P','T'), NULL, new_qry_spt },
+	{ PARSE_KEY('M','T','R'), NULL, new_qry_mtr },
+	{ PARSE_KEY('D','L','T'), NULL, new_qry_dlt },
+	{ PARSE_KEY('H','L','T'), NULL, new_qry_hlt },
+	{ PARSE_KEY('G','R','P'), NULL, new_qry_grp },
+	{ PARSE_KEY('L','I','B'), NULL, new_qry_lib },
+	{ PARSE_KEY('C','F','G'), NULL, new_qry_cfg },
+	{ PARSE_KEY('B','U','S'), NULL, new_qry_bus },
+	{ PARSE_KEY('C','U','E'), NULL, new_qry_cue },
+	{ PARSE_KEY('V','E','R'), NULL, new_qry_ver },
+	{ PARSE_KEY('A','L','L'), NULL, new_qry_all },
+	{ PARSE_KEY('T','S','T'), NULL, new_qry_tst },
+	{ PARSE_KEY('S','T','A'), NULL, new_qry_sta },
+	{ PARSE_KEY('T','R','C'), NULL, new_qry_trc },
+};
+PARSE_CHECK( pt_query_steps );
+static PROGMEM constexpr parse_table_t pt_query = PARSE_TABLE(pt_query_steps);
+
+/// First words, as in haptic_firmware.ino
+static PROGMEM constexpr parse_step_t pt_top_steps[] = {
+	{ PARSE_KEY('L','R','N'), &pt_learn, NULL },
+	{ PARSE_KEY('Q','R','Y'), &pt_query, NULL },
+	{ PARSE_KEY('T','S','T'), NULL, new_tst },
+	{ PARSE_KEY('B','G','N'), NULL, new_bgn },
+	{ PARSE_KEY('F','R','M'), NULL, new_frm },
+	{ PARSE_KEY('Z','A','P'), NULL, new_zap },
+};
+PARSE_CHECK( pt_top_steps );
+static PROGMEM constexpr parse_table_t pt_top = PARSE_TABLE(pt_top_steps);
+
+/// The same words for the old parser, in the same order
+static PROGMEM const parse_old::parse_step_t old_learn[] = {
+	{ "RHY", NULL, old_lrn_rhy },
+	{ "MAG", NULL, old_lrn_mag },
+	{ "SPT", NULL, old_lrn_spt },
+	{ "ADD", NULL, old_lrn_add },
+	{ "GRP", NULL, old_lrn_grp },
+	{ "CFG", NULL, old_lrn_cfg },
+	{ "BUS", NULL, old_lrn_bus },
+	{ "", NULL, NULL }
+};
+
+static PROGMEM const parse_old::parse_step_t old_query[] = {
+	{ "RHY", NULL, old_qry_rhy },
+	{ "MAG", NULL, old_qry_mag },
+	{ "SPT", NULL, old_qry_spt },
+	{ "MTR", NULL, old_qry_mtr },
+	{ "DLT", NULL, old_qry_dlt },
+	{ "HLT", NULL, old_qry_hlt },
+	{ "GRP", NULL, old_qry_grp },
+	{ "LIB", NULL, old_qry_lib },
+	{ "CFG", NULL, old_qry_cfg },
+	{ "BUS", NULL, old_qry_bus },
+	{ "CUE", NULL, old_qry_cue },
+	{ "VER", NULL, old_qry_ver },
+	{ "ALL", NULL, old_qry_all },
+	{ "TST", NULL, old_qry_tst },
+	{ "STA", NULL, old_qry_sta },
+	{ "TRC", NULL, old_qry_trc },
+	{ "", NULL, NULL }
+};
+
+static PROGMEM const parse_old::parse_step_t old_top[] = {
+	{ "LRN", old_learn, NULL },
+	{ "QRY", old_query, NULL },
+	{ "TST", NULL, old_tst },
+	{ "BGN", NULL, old_bgn },
+	{ "FRM", NULL, old_frm },
+	{ "ZAP", NULL, old_zap },
+	{ "", NULL, NULL }
+};
+
+/// Every form of every command, as the firmware documents them
+static const char *const forms[] = {
+	"LRN RHY 1 F0F0F0F0F0F0F0F0 20",
+	"LRN RHY 24 FFFF0000FFFF0000 64",
+	"LRN MAG 1 1000 200",
+	"LRN MAG 8 2000 2000",
+	"LRN SPT 1 1 0 3 24",
+	"LRN SPT 1 4",
+	"LRN ADD 1 16",
+	"LRN GRP 1 1 AAAA",
+	"LRN GRP 1",
+	"LRN CFG 249 1A2B",
+	"LRN BUS",
+	"QRY RHY",
+	"QRY MAG",
+	"QRY SPT",
+	"QRY MTR",
+	"QRY DLT",
+	"QRY HLT",
+	"QRY HLT 12",
+	"QRY GRP",
+	"QRY LIB",
+	"QRY LIB CLR",
+	"QRY CFG",
+	"QRY BUS",
+	"QRY CUE",
+	"QRY CUE CLR",
+	"QRY VER",
+	"QRY ALL",
+	"QRY TST",
+	"QRY STA",
+	"QRY STA CLR",
+	"QRY TRC",
+	"QRY TRC 1",
+	"QRY TRC 0",
+	"TST",
+	"TST 1 1",
+	"BGN",
+	"FRM",
+	"FRM 115200",
+	"ZAP",
+};
+
+/// Lines that are not commands, beyond those made from the forms
+static const char *const errors[] = {
+	"", " ", "  ", "LRN", "QRY", "lrn", "LRN FOO", "QRY FOO 1",
+	"HELLO", "LR", "L", "LRNRHY", "LRN  RHY", "L@N RHY", "Q{Y VER",
+	"QRY V R", "Z P", "ZAP!", "BGN\t", "\tBGN", "1RY VER", "QRY 1ER",
+	"LRN RHY1", "QRY VERB", "BGN BGN", "QRY QRY VER", "LRN LRN RHY",
+	"TST TST", "FRM FRM FRM", "ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP",
+	"ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP ZAP",
+};
+
+/// Number of the words of \a s that the parsers would split it into
+static int words( const std::string &s )
+{
+	int n = 1;
+	size_t i;
+
+	for( i=0; i<s.size(); ++i )
+		if( s[i] == ' ' ) ++n;
+	return n;
+}
+
+/// \a s with its \a n-th word, from 0, replaced by \a w; \a s if too short
+static std::string with_word( const std::string &s, int n, const char *w )
+{
+	size_t start = 0, end;
+
+	while( n-- ) {
+		start = s.find( ' ', start );
+		if( start == std::string::npos ) return s;
+		++start;
+	}
+	end = s.find( ' ', start );
+	if( end == std::string::npos ) end = s.size();
+	return s.substr( 0, start ) + w + s.substr( end );
+}
+
+/// Add \a s and its variants to \a lines
+static void variants( std::vector<std::string> &lines, const std::string &s )
+{
+	std::string t;
+	size_t i;
+	int n;
+
+	lines.push_back( s );
+
+	// case and spacing
+	t = s;
+	for( i=0; i<t.size(); ++i ) t[i] = tolower( t[i] );
+	lines.push_back( t );
+	for( i=0; i<t.size(); i+=2 ) t[i] = toupper( t[i] );
+	lines.push_back( t );
+	lines.push_back( s + " " );
+	lines.push_back( " " + s );
+	if( (i = s.find(' ')) != std::string::npos )
+		lines.push_back( s.substr(0, i) + " " + s.substr(i) );
+
+	// command words that are near misses
+	for( n=0; n<2 && n<words(s); ++n ) {
+		lines.push_back( with_word(s, n, "") );
+		lines.push_back( with_word(s, n, "LR") );
+		lines.push_back( with_word(s, n, "QRYX") );
+		lines.push_back( with_word(s, n, "V1R") );
+		lines.push_back( with_word(s, n, "R@Y") );
+	}
+
+	// as many words as a line can have, and then one too many
+	t = s;
+	while( words(t) < PARSE_MAX_WORDS ) t += " 9";
+	lines.push_back( t );
+	lines.push_back( t + " 9" );
+}
+
+/// Result of one parse: status, handler and arguments, as text
+static std::string result( error_t ret )
+{
+	std::string r = std::to_string( ret );
+	int i;
+
+	if( got.cmd ) {
+		r += std::string( " " ) + got.cmd + " " +
+			std::to_string( got.argc );
+		for( i=0; i<got.argc; ++i )
+			r += " [" + got.argv[ i ] + "]";
+	}
+	return r;
+}
+
+int main()
+{
+	std::vector<std::string> lines;
+	std::string want, have;
+	char buf[ 256 ];
+	size_t i;
+	unsigned bad = 0, handled = 0;
+
+	for( i=0; i<sizeof(forms)/sizeof(*forms); ++i )
+		variants( lines, forms[i] );
+	for( i=0; i<sizeof(errors)/sizeof(*errors); ++i )
+		lines.push_back( errors[i] );
+
+	for( i=0; i<lines.size(); ++i ) {
+		const std::string &s = lines[i];
+
+		got.cmd = NULL;
+		strcpy( buf, s.c_str() );
+		want = result( parse_old::parse(old_top, buf) );
+
+		got.cmd = NULL;
+		strcpy( buf, s.c_str() );
+		have = result( parse(&pt_top, buf) );
+		if( s != buf )
+			have += " (line changed)";
+		if( got.cmd ) ++handled;
+
+		if( want != have ) {
+			printf( "\"%s\": old %s, new %s\n", s.c_str(),
+				want.c_str(), have.c_str() );
+			++bad;
+		}
+	}
+
+	printf( "%zu lines, %u reach a handler, %u differ\n", lines.size(),
+		handled, bad );
+	return bad != 0;
+}
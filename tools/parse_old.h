@@ -0,0 +1,118 @@
+/*************************************************************************//**
+ * \file   parse_old.h
+ * \brief  The learning mode parser as it was before hashed tables and word
+ *         spans, for comparisons on a host.
+ * \date   20261016 - initial version
+ *
+ * A copy of parse() and parse_step_t from the parse.c and parse.h of the
+ * baseline tree, unchanged but for the namespace: a linear walk of each
+ * table with memcpy_P() and strcasecmp(), over words split in place. It is
+ * only here so that parse_bench.cpp and parse_equiv.cpp can run it beside
+ * the current parser.
+ * Include parse.h, or the program space macros of a host build, first.
+ ****************************************************************************/
+
+#ifndef PARSE_OLD_H
+#define PARSE_OLD_H
+
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<inttypes.h>
+
+#include"error.h"
+
+namespace parse_old {
+
+#define PARSE_OLD_MAX_WORDS 10	///<Maximum number of words in each command
+
+/// Function pointer type for individual command handlers
+typedef error_t (*parse_func_t)( int argc, const char *const *argv );
+
+/** \brief Parse table constituent type. A table is an array of these, ended
+ *  by one whose \a str is empty.
+ */
+typedef struct parse_step_s {
+	/// A word that can occur as part of a valid command
+	const char str[4];
+	/// Array of words that can occur next if \a str was matched
+	const struct parse_step_s *next;
+	/// Function to call when \a str is matched and \a next is NULL
+	parse_func_t func;
+} parse_step_t;
+
+/** \param table
+ *	Tree that specifies the set of valid commands.
+ *  \param line
+ *	The command line to be parsed. Its contents will be modified in place.
+ *
+ *  The parser begins by iterating through \a table, looking for an entry with
+ *  a \a str member that matches the first word of \a line. If such an entry
+ *  is found, the parser iterates through the array pointed to by the \a next
+ *  field of that entry, attempting to match the second word of \a line to the
+ *  \a str field of each entry in that array. This continues until either no
+ *  entry matches the next word in \a line, or the next word matches an entry
+ *  whose \a next field is NULL.
+ *
+ *  \retval EBADCMD
+ *	Invalid command; the next word did not match any parse_step_t entry.
+ *  \retval ETOOBIG
+ *	Too many words in \a line.
+ *  \retval x
+ *	Where \a x is any status code that can be returned by the callback
+ *	function specified by the \a func field of the parse_step_t entry that
+ *	terminated the parse (the \a str field matched the next word of
+ *	\a line, but the \a next field was NULL).
+ */
+static error_t parse( const parse_step_t *table, char *line )
+{
+	static const char **argv, *words[ PARSE_OLD_MAX_WORDS+1 ];
+	parse_step_t step = { "", NULL, NULL };
+	int argc = 1;
+
+	if( *line == '\0' ) return EBADCMD;
+
+	*words = line;
+
+	// split the line into words
+	for( ; *line; ++line ) {
+		if( *line != ' ' ) continue;
+
+		*line = '\0';
+
+		if( argc+1 > PARSE_OLD_MAX_WORDS )
+			return ETOOBIG;
+
+		words[ argc ] = line + 1;
+		++argc;
+	}
+	words[ argc ] = NULL;
+
+	// walk the table to determine which function to call
+	argv = words;
+	memcpy_P( &step, table, sizeof(step) );
+	while( step.str[0] != '\0' ) {
+		if( strcasecmp(step.str, *argv) )
+			++table;
+		else {
+			// this word matched something in the table, so move
+			// argv past it and decrement the argument count
+			++argv;
+			--argc;
+
+			// call the handler if this is the end of the chain
+			if( step.next )
+				table = step.next;
+			else
+				return step.func( argc, argv );
+		}
+		memcpy_P( &step, table, sizeof(step) );
+	}
+
+	// no matching command found
+	return EBADCMD;
+}
+
+} // namespace parse_old
+
+#endif
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Decode the event trace printed by the QRY TRC command.
+
+Reads controller output from the files given, or from stdin, and prints
+each event of every "RSP TRC" line on a line of its own: the time since
+the first event and since the one before it, in microseconds, then the
+event and its arguments. Event and status names are read from trace.h
+and error.h, so this stays in step with the firmware it came from.
+
+    $ echo "QRY TRC" > /dev/ttyUSB0; head -2 /dev/ttyUSB0 | trace_decode.py
+
+Tracing starts with "QRY TRC 1". The default build keeps the last 8 events;
+build with e.g. -DTRACE_LEN=32 to keep more.
+"""
+
+import os
+import re
+import sys
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+
+
+def enum_names(header, first):
+    """Return the names of the enum in header that starts with first."""
+    with open(os.path.join(ROOT, header)) as f:
+        text = f.read()
+    body = text[text.index(first):]
+    body = body[:body.index('}')]
+    names, value = {}, 0
+    for m in re.finditer(r'^\s*(\w+)\s*(?:=\s*(\d+))?\s*,?', body, re.M):
+        if m.group(2):
+            value = int(m.group(2))
+        names[value] = m.group(1)
+        value += 1
+    return names
+
+
+ERRORS = enum_names('error.h', 'ESUCCESS')
+EVENTS = enum_names('trace.h', 'TRE_SEND')
+
+
+def status(a):
+    return ERRORS.get(a, str(a))
+
+
+def motor(b):
+    return 'all' if b in (0xff, 0xffff) else str(b)
+
+
+def active(b):
+    mode, mtr, v = b >> 14, b >> 8 & 0x3f, b & 0xff
+    return 'mode=%d motor=%d rhy=%d mag=%d dur=%d' % (
+        mode, mtr, (v >> 5) + 1, (v >> 3 & 3) + 1, v & 7)
+
+
+# how to show the two arguments of each event; see trace_event_t
+FORMATS = {
+    'TRE_SEND': lambda a, b: '%s motor %s' % (status(a), motor(b)),
+    'TRE_DETECT': lambda a, b: '%d motors%s' % (b, ' (boot)' if a else ''),
+    'TRE_TEACH': lambda a, b: '%d slots to motor %s' % (a, motor(b)),
+    'TRE_ACTIVE': lambda a, b: '%s %04X %s' % (status(a), b, active(b)),
+    'TRE_CUE': lambda a, b: 'cue %s motor %s' % (status(a), motor(b)),
+}
+
+
+def decode(words):
+    on, lost = int(words[0]), int(words[1])
+    print('# tracing %s, %d events lost' % ('on' if on else 'off', lost))
+    start = last = None
+    for w in words[2:]:
+        us, ev, a, b = int(w[:8], 16), int(w[8:10], 16), \
+            int(w[10:12], 16), int(w[12:16], 16)
+        if start is None:
+            start = last = us
+        name = EVENTS.get(ev, 'event %d' % ev)
+        args = FORMATS[name](a, b) if name in FORMATS else '%d %d' % (a, b)
+        # micros() wraps every 71 minutes
+        print('%10d %+8d  %-10s %s' % ((us - start) & 0xffffffff,
+            (us - last) & 0xffffffff, name[4:], args))
+        last = us
+
+
+def main():
+    files = [open(n) for n in sys.argv[1:]] or [sys.stdin]
+    for f in files:
+        for line in f:
+            words = line.split()
+            if words[:2] == ['RSP', 'TRC'] and len(words) >= 4:
+                decode(words[2:])
+
+
+if __name__ == '__main__':
+    main()
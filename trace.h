@@ -0,0 +1,58 @@
+/*************************************************************************//**
+ * \file   trace.h
+ * \brief  Binary event trace for field diagnostics.
+ * \date   20261016 - initial version
+ ****************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include<inttypes.h>
+
+/** \brief Number of events kept in the trace ring, oldest overwritten first.
+ *  Each costs 8 bytes of SRAM. The default ring is small enough to keep in
+ *  every build and is started and stopped at run time with QRY TRC; a build
+ *  for diagnostics can keep more, e.g. with -DTRACE_LEN=32, and
+ *  -DTRACE_LEN=0 leaves tracing out altogether.
+ */
+#ifndef TRACE_LEN
+#	define TRACE_LEN 8
+#endif
+
+/** \brief Events recorded in the trace, with the meaning of their two
+ *  arguments. tools/trace_decode.py must be kept in step with this list.
+ */
+typedef enum {
+	TRE_SEND = 1,	///<send_command(): status, motor number
+	TRE_DETECT,	///<detect_motors(): boot flag, motors found
+	TRE_TEACH,	///<teach_motor(): slots taught, motor number
+	TRE_ACTIVE,	///<parse_active(): status, command bytes, big endian
+	TRE_CUE		///<cue_send(): status of a cue that failed, motor number
+} trace_event_t;
+
+/// One trace event, stored as recorded; formatted only by the host
+typedef struct {
+	uint32_t us;	///<micros() when the event was recorded
+	uint8_t ev;	///<Event, see trace_event_t
+	uint8_t a;	///<First argument
+	uint16_t b;	///<Second argument
+} trace_t;
+
+/// Trace ring, kept in glbl.trc
+typedef struct {
+	trace_t buf[ TRACE_LEN ];	///<Events, oldest at \a head once full
+	uint8_t head;		///<Index of the next event to record
+	uint8_t len;		///<Number of events in \a buf
+	uint8_t on;		///<1 while events are being recorded
+	uint16_t lost;		///<Events overwritten since cleared; saturates
+} trace_ring_t;
+
+#if TRACE_LEN
+	/// Record event \a _ev_ with arguments \a _a_ and \a _b_, if tracing
+#	define TRC( _ev_, _a_, _b_ ) \
+		do{ if( glbl.trc.on ) trace_add( _ev_, _a_, _b_ ); }while(0)
+#else
+#	define TRC( _ev_, _a_, _b_ ) ((void)0)
+#endif
+
+#endif